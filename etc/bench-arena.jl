@@ -0,0 +1,79 @@
+;;;; bench-arena.jl -- Time loading and freeing a large buffer
+;;;  $Id$
+
+;;; This file is part of Jade.
+
+;;; Jade is free software; you can redistribute it and/or modify it
+;;; under the terms of the GNU General Public License as published by
+;;; the Free Software Foundation; either version 2, or (at your option)
+;;; any later version.
+
+;;; Jade is distributed in the hope that it will be useful, but
+;;; WITHOUT ANY WARRANTY; without even the implied warranty of
+;;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;;; GNU General Public License for more details.
+
+;;; You should have received a copy of the GNU General Public License
+;;; along with Jade; see the file COPYING.  If not, write to
+;;; the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+;;; Run as `jade -l etc/bench-arena.jl -q'. A temporary file of lines
+;;; of assorted lengths, bench-arena-megabytes long, is written and read
+;;; into a buffer, which is then cleared, freeing all its lines. The
+;;; time taken by each, from the microsecond counter, is printed with
+;;; the storage the lines took, for each of several runs.
+
+(defvar bench-arena-megabytes 300)
+(defvar bench-arena-runs 3)
+
+;; Returns a string of about a megabyte made of lines between none and
+;; 120 characters long, as in a typical log or source file.
+(defun bench-arena-block ()
+  (let ((lines '())
+	(size 0))
+    (do ((i 0 (1+ i)))
+	((>= size 1048576))
+      (let ((line (concat (make-string (modulo (* i 37) 121) ?x) ?\n)))
+	(set! lines (cons line lines))
+	(set! size (+ size (length line)))))
+    (apply concat lines)))
+
+(defun bench-arena-make-file ()
+  (let ((file (make-temp-name))
+	(buffer (make-buffer "*bench-arena*"))
+	(block (bench-arena-block)))
+    (with-buffer buffer
+      (set-buffer-record-undo nil)
+      (do ((i 0 (1+ i)))
+	  ((= i bench-arena-megabytes))
+	(insert block))
+      (write-buffer-contents file))
+    (kill-buffer buffer)
+    file))
+
+(defun bench-arena ()
+  (let ((file (bench-arena-make-file))
+	(buffer (make-buffer "*bench-arena*"))
+	(mmap-file-threshold nil))
+    (with-buffer buffer
+      ;; Otherwise clearing the buffer copies all its text to the undo list
+      (set-buffer-record-undo nil)
+      (do ((i 0 (1+ i)))
+	  ((= i bench-arena-runs))
+	(let ((start (current-utime))
+	      load-time free-time lines text)
+	  (read-file-contents file)
+	  (set! load-time (- (current-utime) start))
+	  (set! lines (buffer-length))
+	  (set! text (cdr (assq 'text (buffer-memory-usage))))
+	  (set! start (current-utime))
+	  (clear-buffer)
+	  (set! free-time (- (current-utime) start))
+	  (format (stderr-file)
+		  "%d lines: load %dms, %d bytes of text storage, free %dms\n"
+		  lines (quotient load-time 1000) text
+		  (quotient free-time 1000)))))
+    (kill-buffer buffer)
+    (delete-file file)))
+
+(bench-arena)
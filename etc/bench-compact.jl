@@ -0,0 +1,82 @@
+;;;; bench-compact.jl -- Time scans of a buffer before and after compaction
+;;;  $Id$
+
+;;; This file is part of Jade.
+
+;;; Jade is free software; you can redistribute it and/or modify it
+;;; under the terms of the GNU General Public License as published by
+;;; the Free Software Foundation; either version 2, or (at your option)
+;;; any later version.
+
+;;; Jade is distributed in the hope that it will be useful, but
+;;; WITHOUT ANY WARRANTY; without even the implied warranty of
+;;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;;; GNU General Public License for more details.
+
+;;; You should have received a copy of the GNU General Public License
+;;; along with Jade; see the file COPYING.  If not, write to
+;;; the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+;;; Run as `jade -l etc/bench-compact.jl -q'. A buffer is filled with
+;;; lines, which are then edited at random until their strings are
+;;; scattered through its storage. Searches that scan the whole buffer
+;;; are timed, then the buffer is compacted (see `compact-buffer') and
+;;; the searches are timed again. The text storage before and after is
+;;; printed as well.
+
+(defvar bench-compact-lines 400000)
+(defvar bench-compact-edits 300000)
+(defvar bench-compact-scans 5)
+
+(defvar bench-compact-seed 1)
+
+(defun bench-compact-random (limit)
+  (set! bench-compact-seed
+	(modulo (+ (* bench-compact-seed 69069) 1) 4294967296))
+  (modulo (quotient bench-compact-seed 65536) limit))
+
+;; Returns the best time in microseconds of bench-compact-scans searches
+;; for a string that isn't in the buffer, so each scans all of it.
+(defun bench-compact-scan ()
+  (let ((best nil))
+    (do ((i 0 (1+ i)))
+	((= i bench-compact-scans))
+      (let ((start (current-utime)))
+	(search-forward "not in the buffer" (start-of-buffer))
+	(let ((time (- (current-utime) start)))
+	  (when (or (null best) (< time best))
+	    (set! best time)))))
+    best))
+
+(defun bench-compact-report (when)
+  (format (stderr-file) "%s: scan %dus, %d bytes of text storage\n"
+	  when (bench-compact-scan)
+	  (cdr (assq 'text (buffer-memory-usage)))))
+
+(defun bench-compact ()
+  (let ((buffer (make-buffer "*bench-compact*")))
+    (with-buffer buffer
+      (set-buffer-record-undo nil)
+      (do ((i 0 (1+ i)))
+	  ((= i bench-compact-lines))
+	(insert "The quick brown fox jumps over the lazy dog\n"))
+      (bench-compact-report "fresh")
+
+      ;; Lines grow and shrink through several size classes, so their
+      ;; strings are reallocated wherever there's space
+      (do ((i 0 (1+ i)))
+	  ((= i bench-compact-edits))
+	(let ((p (pos 0 (bench-compact-random bench-compact-lines))))
+	  (if (< (pos-col (end-of-line p)) 200)
+	      (insert (make-string (1+ (bench-compact-random 40)) ?y) p)
+	    (delete-area p (pos 150 (pos-line p))))))
+      (bench-compact-report "edited")
+
+      (let ((start (current-utime)))
+	(compact-buffer)
+	(format (stderr-file) "compact-buffer: %dus\n"
+		(- (current-utime) start)))
+      (bench-compact-report "compacted"))
+    (kill-buffer buffer)))
+
+(bench-compact)
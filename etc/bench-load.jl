@@ -0,0 +1,72 @@
+;;;; bench-load.jl -- Measure how fast files are read into buffers
+;;;  $Id$
+
+;;; This file is part of Jade.
+
+;;; Jade is free software; you can redistribute it and/or modify it
+;;; under the terms of the GNU General Public License as published by
+;;; the Free Software Foundation; either version 2, or (at your option)
+;;; any later version.
+
+;;; Jade is distributed in the hope that it will be useful, but
+;;; WITHOUT ANY WARRANTY; without even the implied warranty of
+;;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;;; GNU General Public License for more details.
+
+;;; You should have received a copy of the GNU General Public License
+;;; along with Jade; see the file COPYING.  If not, write to
+;;; the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+;;; Run as `jade -l etc/bench-load.jl -q'. Two temporary files are
+;;; written, one of short lines and one of lines a megabyte long, then
+;;; each is read into a buffer several times and the best rate, in
+;;; megabytes per second, is printed. Files are copied, not mapped.
+
+(defvar bench-load-megabytes 64)
+(defvar bench-load-runs 3)
+
+;; Returns a string of about a megabyte made of lines LINE-LENGTH
+;; characters long, not counting their newlines.
+(defun bench-load-block (line-length)
+  (let ((line (concat (make-string line-length ?x) ?\n))
+	(lines '()))
+    (do ((i 0 (1+ i)))
+	((>= (* i (1+ line-length)) 1048576))
+      (set! lines (cons line lines)))
+    (apply concat lines)))
+
+;; Write a file of about bench-load-megabytes made of lines LINE-LENGTH
+;; characters long, returning its name.
+(defun bench-load-make-file (line-length)
+  (let ((file (make-temp-name))
+	(buffer (make-buffer "*bench-load*"))
+	(block (bench-load-block line-length)))
+    (with-buffer buffer
+      (do ((i 0 (1+ i)))
+	  ((= i bench-load-megabytes))
+	(insert block))
+      (write-buffer-contents file))
+    (kill-buffer buffer)
+    file))
+
+(defun bench-load-file (description line-length)
+  (let ((file (bench-load-make-file line-length))
+	(buffer (make-buffer "*bench-load*"))
+	(mmap-file-threshold nil)
+	(best nil))
+    (with-buffer buffer
+      (do ((i 0 (1+ i)))
+	  ((= i bench-load-runs))
+	(let ((start (current-utime)))
+	  (read-file-contents file)
+	  (let ((time (- (current-utime) start)))
+	    (when (or (null best) (< time best))
+	      (set! best time))))))
+    (format (stderr-file) "%s: %d bytes, %d MB/s\n" description
+	    (file-size file)
+	    (quotient (file-size file) (max best 1)))
+    (kill-buffer buffer)
+    (delete-file file)))
+
+(bench-load-file "short lines" 40)
+(bench-load-file "long lines" (1- 1048576))
@@ -0,0 +1,81 @@
+;;;; bench-positions.jl -- Count garbage collections while editing
+;;;  $Id$
+
+;;; This file is part of Jade.
+
+;;; Jade is free software; you can redistribute it and/or modify it
+;;; under the terms of the GNU General Public License as published by
+;;; the Free Software Foundation; either version 2, or (at your option)
+;;; any later version.
+
+;;; Jade is distributed in the hope that it will be useful, but
+;;; WITHOUT ANY WARRANTY; without even the implied warranty of
+;;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;;; GNU General Public License for more details.
+
+;;; You should have received a copy of the GNU General Public License
+;;; along with Jade; see the file COPYING.  If not, write to
+;;; the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+;;; Run as `jade -l etc/bench-positions.jl -q'. A scripted session of
+;;; insertions, deletions, searches and mark movements is made in a
+;;; scratch buffer, and the number of garbage collections during it is
+;;; printed. Every position made while editing used to be a fresh
+;;; cons; now they're fixnums, so most of what's left to collect is
+;;; the inserted strings and the undo list.
+
+(defvar bench-positions-lines 2000)
+(defvar bench-positions-edits 30000)
+(defvar bench-positions-marks 100)
+
+(defvar bench-positions-seed 1)
+
+(defun bench-positions-random (limit)
+  (set! bench-positions-seed
+	(modulo (+ (* bench-positions-seed 69069) 1) 4294967296))
+  (modulo (quotient bench-positions-seed 65536) limit))
+
+;; Returns a function that returns the number of garbage collections
+;; seen so far. Each one is noticed by a weak reference to a fresh
+;; cons being cleared, so call it often.
+(defun bench-positions-gc-counter ()
+  (let ((ref (make-weak-ref (list nil)))
+	(count 0))
+    (lambda ()
+      (unless (weak-ref ref)
+	(set! count (1+ count))
+	(set! ref (make-weak-ref (list nil))))
+      count)))
+
+(defun bench-positions ()
+  (let ((buffer (make-buffer "*bench-positions*"))
+	(marks '())
+	gc-count)
+    (with-buffer buffer
+      (do ((i 0 (1+ i)))
+	  ((= i bench-positions-lines))
+	(insert "The quick brown fox jumps over the lazy dog\n"))
+      (do ((i 0 (1+ i)))
+	  ((= i bench-positions-marks))
+	(set! marks (cons (make-mark (pos 0 (bench-positions-random
+					     bench-positions-lines)))
+			  marks)))
+      (garbage-collect)
+      (set! gc-count (bench-positions-gc-counter))
+      (do ((i 0 (1+ i)))
+	  ((= i bench-positions-edits))
+	(let ((p (pos (bench-positions-random 40)
+		      (bench-positions-random bench-positions-lines))))
+	  (case (bench-positions-random 5)
+	    ((0) (insert "x" p))
+	    ((1) (delete-area p (forward-char 1 p)))
+	    ((2) (re-search-forward "fox" p))
+	    ((3) (set-mark-pos (nth (bench-positions-random
+				     bench-positions-marks) marks) p))
+	    ((4) (goto (end-of-line p)))))
+	(gc-count))
+      (format (stderr-file) "%d edits, %d garbage collections\n"
+	      bench-positions-edits (gc-count)))
+    (kill-buffer buffer)))
+
+(bench-positions)
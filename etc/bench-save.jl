@@ -0,0 +1,65 @@
+;;;; bench-save.jl -- Measure how fast buffers are saved
+;;;  $Id$
+
+;;; This file is part of Jade.
+
+;;; Jade is free software; you can redistribute it and/or modify it
+;;; under the terms of the GNU General Public License as published by
+;;; the Free Software Foundation; either version 2, or (at your option)
+;;; any later version.
+
+;;; Jade is distributed in the hope that it will be useful, but
+;;; WITHOUT ANY WARRANTY; without even the implied warranty of
+;;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;;; GNU General Public License for more details.
+
+;;; You should have received a copy of the GNU General Public License
+;;; along with Jade; see the file COPYING.  If not, write to
+;;; the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+;;; Run as `jade -l etc/bench-save.jl -q'. Buffers of short lines and
+;;; of lines a kilobyte long, bench-save-megabytes each, are written to
+;;; a temporary file with each setting of `save-file-durability', and
+;;; the best rate of several runs, in megabytes per second, is printed.
+
+(defvar bench-save-megabytes 256)
+(defvar bench-save-runs 3)
+
+;; Returns a string of about a megabyte made of lines LINE-LENGTH
+;; characters long, not counting their newlines.
+(defun bench-save-block (line-length)
+  (let ((line (concat (make-string line-length ?x) ?\n))
+	(lines '()))
+    (do ((i 0 (1+ i)))
+	((>= (* i (1+ line-length)) 1048576))
+      (set! lines (cons line lines)))
+    (apply concat lines)))
+
+(defun bench-save-buffer (description line-length)
+  (let ((buffer (make-buffer "*bench-save*"))
+	(file (make-temp-name))
+	(block (bench-save-block line-length)))
+    (with-buffer buffer
+      (set-buffer-record-undo nil)
+      (do ((i 0 (1+ i)))
+	  ((= i bench-save-megabytes))
+	(insert block))
+      (mapc (lambda (durability)
+	      (let ((save-file-durability durability)
+		    (best nil))
+		(do ((i 0 (1+ i)))
+		    ((= i bench-save-runs))
+		  (let ((start (current-utime)))
+		    (write-buffer-contents file)
+		    (let ((time (- (current-utime) start)))
+		      (when (or (null best) (< time best))
+			(set! best time)))))
+		(format (stderr-file) "%s, durability %s: %d MB/s\n"
+			description durability
+			(quotient (file-size file) (max best 1)))))
+	    '(nil fsync t)))
+    (kill-buffer buffer)
+    (delete-file file)))
+
+(bench-save-buffer "short lines" 40)
+(bench-save-buffer "long lines" 1023)
@@ -571,15 +571,26 @@ file NAME."
 (defun auto-save-function (buffer)
   "Automatically called when BUFFER is due to be automatically saved.
 This function calls the hook `auto-save-hook', if this returns nil it then
-saves it to the file specified by `make-auto-save-name' appiled to the
-name of the file stored in BUFFER."
+starts saving it in the background to the file specified by
+`make-auto-save-name' appiled to the name of the file stored in BUFFER.
+Returns nil if BUFFER couldn't be saved yet, because an earlier save of
+it hasn't finished."
   (message (concat "Auto-saving `" (buffer-name buffer) "'...") t)
   (with-buffer buffer
-    (if (or (call-hook 'auto-save-hook (list buffer) 'or)
-	    (write-buffer-contents (make-auto-save-name (buffer-file-name))))
-	(message (concat "Auto-saving `" (buffer-name buffer) "'...done"))
-      (error "Can't auto-save" buffer)
-      nil)))
+    (if (call-hook 'auto-save-hook (list buffer) 'or)
+	(progn
+	  (message (concat "Auto-saving `" (buffer-name buffer) "'...done"))
+	  t)
+      (write-buffer-contents-in-background
+       (make-auto-save-name (buffer-file-name)) auto-save-finished))))
+
+(defun auto-save-finished (buffer status)
+  "Called when the background save started by `auto-save-function' has
+finished. STATUS is t if BUFFER was saved, otherwise a string describing
+the error."
+  (if (eq status t)
+      (message (concat "Auto-saving `" (buffer-name buffer) "'...done"))
+    (message (concat "Can't auto-save `" (buffer-name buffer) "': " status) t)))
 
 (defun delete-auto-save-file (#!optional buffer)
   "Deletes the file used to store the auto-save'd copy of the file stored in
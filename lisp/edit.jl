@@ -78,17 +78,6 @@ only enabled if the list contains the closing delimiter being blinked.")
 (defvar blink-matching-delay 1
   "The number of seconds to delay when blinking parentheses.")
 
-
-;; Some macros
-
-(defmacro pos-col (p)
-  "Return the column pointed to by position P."
-  (list 'cdr p))
-
-(defmacro pos-line (p)
-  "Return the row pointed to by position P."
-  (list 'car p))
-
 
 ;; Marks
 
@@ -968,6 +957,19 @@ exit occurring (as long as the original buffer wasn't killed)."
 	 (when (mark-resident-p ,mark)
 	   (goto-mark ,mark t))))))
 
+(defmacro with-batched-edits (#!rest forms)
+  "Evaluate FORMS, recording all the changes they make to the current buffer
+as a single change in its undo list. Useful for commands that make a large
+number of small edits."
+  (let
+      ((buffer (gensym)))
+    `(let
+	 ((,buffer (current-buffer)))
+       (begin-batched-edits ,buffer)
+       (unwind-protect
+	   (progn ,@forms)
+	 (end-batched-edits ,buffer)))))
+
 (defmacro map-extents-at (function #!optional position buffer)
   "Call (FUNCTION EXTENT) for all extents containing location POSITION in
 BUFFER (defaulting to the current position in the current buffer), working
@@ -338,17 +338,23 @@ is split.")
 (defun info-highlight-buffer ()
   (delete-all-extents)
   (let
-      ((tem (start-of-buffer)))
+      ((tem (start-of-buffer))
+       (regions ()))
     (while (re-search-forward "\\*[\t\n ]*note[\t\n ]+([^:]+)" tem nil t)
       (set! tem (match-end 1))
-      (make-extent (match-start 1) tem (list 'face info-xref-face
-					     'mouse-face active-face)))
+      (set! regions (cons (list (match-start 1) tem
+				(list 'face info-xref-face
+				      'mouse-face active-face))
+			  regions)))
     (when (re-search-forward "^\\* menu:" (start-of-buffer) nil t)
       (set! tem (match-end))
       (while (re-search-forward "^\\*[\t ]+([^:\n]+)" tem)
 	(set! tem (match-end 1))
-	(make-extent (match-start 1) tem (list 'face info-menu-face
-					       'mouse-face active-face))))))
+	(set! regions (cons (list (match-start 1) tem
+				  (list 'face info-menu-face
+					'mouse-face active-face))
+			    regions))))
+    (make-extents (apply vector regions))))
 
 ;; Return a list of all node names matching START in the current tag table
 (defun info-list-nodes (start)
@@ -494,7 +494,7 @@ whole of the buffer (if no block)."
 (defun ispell-idle-function ()
   (when ispell-minor-mode-last-scan
     (let
-	((start (display-to-char-pos '(0 . 0)))
+	((start (display-to-char-pos (pos 0 0)))
 	 (end (view-dimensions)))
       (set! end (display-to-char-pos (pos (1- (car end)) (1- (cdr end)))))
       (when (or (null? end)
@@ -278,9 +278,10 @@ END."
   (set! end (start-of-line end))
   (unless mode-indent-line
     (error "No method for indenting lines in this buffer"))
-  (while (< start end)
-    (mode-indent-line start)
-    (set! start (forward-line 1 start))))
+  (with-batched-edits
+    (while (< start end)
+      (mode-indent-line start)
+      (set! start (forward-line 1 start)))))
 
 (defun newline-and-indent ()
   "Insert a newline then either call this buffer's `mode-indent-line' function
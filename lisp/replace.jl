@@ -62,8 +62,9 @@ details of what can be in TEMPLATE). Moves the cursor to the end of the
 last change."
   (interactive "sReplace regexp:\nsReplace regexp `%s' with:")
   (goto (start-of-buffer))
-  (while (re-search-forward from nil nil case-fold-search)
-    (goto (replace-last-match template))))
+  (with-batched-edits
+    (while (re-search-forward from nil nil case-fold-search)
+      (goto (replace-last-match template)))))
 
 
 ;;; Query replace
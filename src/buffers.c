@@ -24,6 +24,10 @@
 #include <stdlib.h>
 #include <inttypes.h>
 
+/* Buffers using less than this many bytes of blocks for their lines
+   are never compacted while idle. */
+#define COMPACT_MIN_BYTES (1024 * 1024)
+
 static void mark_sweep(void);
 static void make_marks_resident(repv newtx);
 static void make_marks_non_resident(Lisp_Buffer *oldtx);
@@ -34,6 +38,30 @@ int buffer_type;
 Lisp_Buffer *buffer_chain;
 
 DEFSYM(auto_save_function, "auto-save-function");
+DEFSYM(compact_buffer_threshold, "compact-buffer-threshold"); /*
+::doc:compact-buffer-threshold::
+When an integer, the percentage of the storage for the lines of a buffer
+that may be wasted before the buffer is compacted (see `compact-buffer')
+while the editor is idle. When nil, buffers are never compacted
+automatically.
+::end:: */
+
+DEFSYM(buffer_compression_delay, "buffer-compression-delay"); /*
+::doc:buffer-compression-delay::
+When an integer, the number of minutes that a buffer may go without being
+displayed in any view before its text is compressed (see `compress-buffer')
+while the editor is idle. When nil, buffers are never compressed
+automatically.
+::end:: */
+
+DEFSYM(lines, "lines");
+DEFSYM(text, "text");
+DEFSYM(mapped, "mapped");
+DEFSYM(compressed, "compressed");
+DEFSYM(extents, "extents");
+DEFSYM(marks, "marks");
+DEFSYM(glyphs, "glyphs");
+DEFSYM(buffers, "buffers");
 
 DEFSTRING(first_buffer_name, "*jade*");
 
@@ -46,9 +74,9 @@ pos_getc(Lisp_Buffer *tx, repv *pos)
     int c = EOF;
     intptr_t row = VROW(*pos);
     intptr_t col = VCOL(*pos);
-    if(row < tx->logical_end)
+    if(row < tx->logical_end && THAW_LINES(tx))
     {
-	if(col >= (tx->lines[row].ln_Strlen - 1))
+	if(col >= (TX_LINE(tx, row).ln_Strlen - 1))
 	{
 	    if(++row == tx->logical_end)
 		--row;
@@ -59,7 +87,7 @@ pos_getc(Lisp_Buffer *tx, repv *pos)
 	    }
 	}
 	else
-	    c = tx->lines[row].ln_Line[col++];
+	    c = LINE_TEXT(&TX_LINE(tx, row))[col++];
     }
     *pos = make_pos(col, row);
     return c;
@@ -71,7 +99,7 @@ pos_getc(Lisp_Buffer *tx, repv *pos)
 	if(--col < 0)					\
 	{						\
 	    row--;					\
-	    col = (tx)->lines[row].ln_Strlen - 1;	\
+	    col = TX_LINE((tx), row).ln_Strlen - 1;	\
 	}						\
 	(p) = make_pos(col, row);			\
     } while(0)
@@ -192,6 +220,7 @@ Return a new buffer, it's name is the result of (make-buffer-name NAME).
 		tx->saved_block_state = -1;
 		tx->tab_size = 8;
 		tx->last_saved_time = rep_time();
+		tx->last_displayed_time = tx->last_saved_time;
 		tx->undo_list = Qnil;
 		tx->pending_undo_list = 0;
 		tx->did_undo_list = Qnil;
@@ -246,12 +275,16 @@ buffer_sweep(void)
 	Lisp_Buffer *nxt = tx->next;
 	if(!rep_GC_CELL_MARKEDP(rep_VAL(tx)))
 	{
-	    if(tx->mark_chain != NULL)
+	    if(tx->marks.count != 0)
 	    {
 		/* rep_mark_value has ensured that canonical_file_name
 		   and file_name are kept even if the buffer isn't */
 		make_marks_non_resident(tx);
 	    }
+	    if(tx->marks.marks != 0)
+		rep_free(tx->marks.marks);
+	    if(tx->batch_text != 0)
+		release_buffer_snapshot(tx->batch_text);
 	    kill_line_list(tx);
 	    rep_free(tx);
 	}
@@ -314,6 +347,8 @@ buffer_putc (repv stream, int c)
 	else
 	{
 	    repv pos = Frestriction_end (rep_CAR(stream));
+	    if (pos == 0)
+		return EOF;
 	    return pos_putc (VBUFFER(rep_CAR(stream)), &pos, c);
 	}
     }
@@ -337,6 +372,8 @@ buffer_puts (repv stream, const void *data, intptr_t len, bool is_val)
 	else
 	{
 	    repv pos = Frestriction_end (rep_CAR(stream));
+	    if (pos == 0)
+		return EOF;
 	    return pos_puts (VBUFFER(rep_CAR(stream)), &pos, buf, len);
 	}
     }
@@ -347,7 +384,10 @@ buffer_puts (repv stream, const void *data, intptr_t len, bool is_val)
 static repv
 buffer_bind (repv tx)
 {
-    Lisp_Buffer *old = swap_buffers (curr_vw, VBUFFER(tx));
+    Lisp_Buffer *old;
+    if (!THAW_LINES(VBUFFER(tx)))
+	return 0;
+    old = swap_buffers (curr_vw, VBUFFER(tx));
     return Fcons (rep_VAL(old), rep_VAL(curr_vw));
 }
 
@@ -381,15 +421,18 @@ first_buffer(void)
 }
 
 /* Installs buffer NEW as the current buffer of VW. Returns the originally
-   current buffer (may be a null pointer) */
+   current buffer (may be a null pointer). If NEW's text is compressed and
+   can't be uncompressed, an error is signalled and VW is left alone. */
 Lisp_Buffer *
 swap_buffers(Lisp_View *vw, Lisp_Buffer *new)
 {
     Lisp_Buffer *old = vw->tx;
-    if(old != new)
+    if(old != new && THAW_LINES(new))
     {
 	if(old != NULL)
 	{
+	    old->last_displayed_time = rep_time();
+
 	    /* Save buffer context */
 	    old->saved_cursor_pos = vw->cursor_pos;
 	    old->saved_display_origin = vw->display_origin;
@@ -397,6 +440,9 @@ swap_buffers(Lisp_View *vw, Lisp_Buffer *new)
 	    old->saved_block[1] = vw->block_end;
 	    old->saved_block_state = vw->block_state;
 	}
+	/* Cached extents of OLD would keep it alive after it's killed */
+	clear_extent_cache(vw);
+
 	/* Restore old context */
 	vw->tx = new;
 	vw->cursor_pos = new->saved_cursor_pos;
@@ -501,7 +547,10 @@ get_buffer_cursor(Lisp_Buffer *tx)
 
 /* Returns true if a buffer was saved, in which case calling the
    function again may save another buffer. If force_save is true, don't
-   worry about the time between saves, just save the next buffer */
+   worry about the time between saves, just save the next buffer (after
+   any background saves have finished). A buffer only counts as saved
+   if `auto-save-function' returns non-nil; otherwise it's tried again
+   after its next interval. */
 
 bool
 auto_save_buffers(bool force_save)
@@ -524,14 +573,21 @@ auto_save_buffers(bool force_save)
 	       && (force_save
 	           || (time > (tx->last_saved_time + tx->auto_save_interval))))
 	    {
-		repv val_tx = rep_VAL(tx);
+		repv val_tx = rep_VAL(tx), saved;
+		int change_count = tx->change_count;
 		rep_GC_root gc_tx;
 		rep_PUSHGC(gc_tx, val_tx);
-		rep_call_lisp1(Fsymbol_value(Qauto_save_function, Qt),
-			       rep_VAL(tx));
+		/* An earlier background save of this buffer would make
+		   it refuse to start another */
+		if(force_save)
+		    wait_for_background_saves();
+		saved = rep_call_lisp1(Fsymbol_value(Qauto_save_function, Qt),
+				       rep_VAL(tx));
 		rep_POPGC;
 		tx->last_saved_time = time;
-		tx->last_saved_change_count = tx->change_count;
+		/* When forced there's no later chance to try again */
+		if(force_save || (saved != 0 && !rep_NILP(saved)))
+		    tx->last_saved_change_count = change_count;
 		Exclusion = false;
 		return true;
 	    }
@@ -542,6 +598,229 @@ auto_save_buffers(bool force_save)
     return false;
 }
 
+/* Compact the first buffer whose line storage is more than
+   `compact-buffer-threshold' percent wasted. Buffers with less than
+   COMPACT_MIN_BYTES of storage aren't worth it. The unused end of the
+   newest block doesn't count as wasted, it's where the next lines will
+   go; and a buffer isn't compacted again until it's been changed, in
+   case compacting couldn't get it under the threshold. Returns true if
+   a buffer was compacted, in which case calling the function again may
+   compact another buffer. */
+bool
+compact_idle_buffers(void)
+{
+    repv threshold = Fsymbol_value(Qcompact_buffer_threshold, Qt);
+    Lisp_Buffer *tx;
+    if(!rep_INTP(threshold))
+	return false;
+    for(tx = buffer_chain; tx != 0; tx = tx->next)
+    {
+	struct line_arena_stats *stats = &tx->line_arena.stats;
+	intptr_t waste = (stats->block_bytes - stats->small_bytes
+			  - (tx->line_arena.block_end
+			     - tx->line_arena.block_ptr));
+	if(stats->block_bytes >= COMPACT_MIN_BYTES
+	   && tx->change_count != tx->compacted_change_count
+	   && waste * 100 > stats->block_bytes * rep_INT(threshold))
+	{
+	    if(!compact_line_list(tx))
+		return false;
+	    tx->compacted_change_count = tx->change_count;
+	    return true;
+	}
+    }
+    return false;
+}
+
+DEFUN("compact-buffer", Fcompact_buffer, Scompact_buffer, (repv tx), rep_Subr1) /*
+::doc:compact-buffer::
+compact-buffer [BUFFER]
+
+Copy the text of BUFFER into fresh storage, each line following the one
+before it in memory. After a lot of editing the lines of a buffer are
+scattered about, compacting it frees the space between them and makes
+operations on the whole buffer (like searching it) faster. Returns
+BUFFER.
+::end:: */
+{
+    if(!BUFFERP(tx))
+	tx = rep_VAL(curr_vw->tx);
+    if(!compact_line_list(VBUFFER(tx)))
+	return rep_mem_error();
+    return tx;
+}
+
+/* Returns true if TX is being displayed by any view. */
+static bool
+buffer_displayed_p(Lisp_Buffer *tx)
+{
+    Lisp_View *vw;
+    for(vw = view_chain; vw != 0; vw = vw->next)
+    {
+	if(vw->window != 0 && vw->tx == tx)
+	    return true;
+    }
+    return false;
+}
+
+/* Compress the text of the first buffer that hasn't been displayed
+   for `buffer-compression-delay' minutes. Returns true if a buffer was
+   compressed, in which case calling the function again may compress
+   another buffer. */
+bool
+compress_idle_buffers(void)
+{
+    repv delay = Fsymbol_value(Qbuffer_compression_delay, Qt);
+    intptr_t time = rep_time();
+    Lisp_Buffer *tx;
+    if(!rep_INTP(delay))
+	return false;
+    for(tx = buffer_chain; tx != 0; tx = tx->next)
+    {
+	if(tx->lines != 0 && tx->line_arena.frozen == 0
+	   && time - tx->last_displayed_time >= rep_INT(delay) * 60
+	   && !buffer_displayed_p(tx))
+	{
+	    return compress_line_list(tx);
+	}
+    }
+    return false;
+}
+
+DEFUN("compress-buffer", Fcompress_buffer, Scompress_buffer, (repv tx), rep_Subr1) /*
+::doc:compress-buffer::
+compress-buffer [BUFFER]
+
+Compress the text of BUFFER, freeing the memory used by its lines. The
+text is uncompressed again as soon as anything looks at it, so this is
+only worth doing for buffers that won't be used for a while. Returns
+BUFFER, or nil if its text can't be compressed at the moment (for
+example while it's being saved in the background, or while it's shown
+in a view).
+::end:: */
+{
+    if(!BUFFERP(tx))
+	tx = rep_VAL(curr_vw->tx);
+    if(buffer_displayed_p(VBUFFER(tx)))
+	return Qnil;
+    return compress_line_list(VBUFFER(tx)) ? tx : Qnil;
+}
+
+DEFUN("buffer-compressed-size", Fbuffer_compressed_size, Sbuffer_compressed_size, (repv tx), rep_Subr1) /*
+::doc:buffer-compressed-size::
+buffer-compressed-size [BUFFER]
+
+When the text of BUFFER is compressed, returns a cons cell
+`(COMPRESSED-BYTES . TEXT-BYTES)', the size of the compressed text and
+of the text itself. Otherwise returns nil.
+::end:: */
+{
+    struct compressed_text *c;
+    if(!BUFFERP(tx))
+	tx = rep_VAL(curr_vw->tx);
+    c = VBUFFER(tx)->compressed;
+    if(c == 0)
+	return Qnil;
+    return Fcons(rep_make_long_uint(c->length),
+		 rep_make_long_uint(c->text_length));
+}
+
+/* Bytes used by buffers, see buffer-memory-usage */
+struct memory_usage {
+    size_t lines, text, mapped, compressed, extents, marks, undo;
+};
+
+/* Add the memory used by TX to the counts in U. Every count is kept
+   up to date as the buffer changes, so this doesn't depend on the
+   size of the buffer. */
+static void
+add_buffer_memory_usage(Lisp_Buffer *tx, struct memory_usage *u)
+{
+    u->lines += sizeof(LINE) * tx->total_lines;
+    if(tx->offset_tree != 0)
+	u->lines += sizeof(intptr_t) * (tx->total_lines + 1);
+    u->text += (tx->line_arena.stats.block_bytes
+		+ tx->line_arena.stats.large_bytes);
+    u->mapped += tx->line_arena.stats.mapped_bytes;
+    if(tx->compressed != 0)
+	u->compressed += tx->compressed->length;
+    /* The global extent isn't included in EXTENT_COUNT */
+    u->extents += sizeof(Lisp_Extent) * (tx->extent_count + 1);
+    u->marks += (sizeof(Lisp_Mark) * tx->marks.count
+		 + sizeof(Lisp_Mark *) * tx->marks.allocated);
+    u->undo += tx->undo_bytes;
+}
+
+/* Returns the counts in U as an alist, in front of TAIL. */
+static repv
+memory_usage_alist(struct memory_usage *u, repv tail)
+{
+    tail = Fcons(Fcons(Qundo, rep_make_long_uint(u->undo)), tail);
+    tail = Fcons(Fcons(Qmarks, rep_make_long_uint(u->marks)), tail);
+    tail = Fcons(Fcons(Qextents, rep_make_long_uint(u->extents)), tail);
+    tail = Fcons(Fcons(Qcompressed, rep_make_long_uint(u->compressed)), tail);
+    tail = Fcons(Fcons(Qmapped, rep_make_long_uint(u->mapped)), tail);
+    tail = Fcons(Fcons(Qtext, rep_make_long_uint(u->text)), tail);
+    tail = Fcons(Fcons(Qlines, rep_make_long_uint(u->lines)), tail);
+    return tail;
+}
+
+DEFUN("buffer-memory-usage", Fbuffer_memory_usage, Sbuffer_memory_usage, (repv tx), rep_Subr1) /*
+::doc:buffer-memory-usage::
+buffer-memory-usage [BUFFER]
+
+Return an alist describing the memory used by BUFFER. Each element is
+`(TYPE . BYTES)', where TYPE is one of:
+
+	lines		The array of lines and the index into it
+	text		The storage allocated for the text of the lines
+	mapped		The part of the loaded file that's mapped into
+			 memory, and shared with the file itself
+	compressed	The compressed text (see `compress-buffer')
+	extents		The extents of the buffer
+	marks		The marks pointing into the buffer
+	undo		The undo information (see `buffer-undo-list'),
+			 this is approximate; changes in the middle of
+			 being undone aren't counted
+
+The figures are kept up to date as the buffer changes, so this is quick
+no matter how large the buffer is.
+::end:: */
+{
+    struct memory_usage u;
+    if(!BUFFERP(tx))
+	tx = rep_VAL(curr_vw->tx);
+    memset(&u, 0, sizeof(u));
+    add_buffer_memory_usage(VBUFFER(tx), &u);
+    return memory_usage_alist(&u, Qnil);
+}
+
+DEFUN("editor-memory-usage", Feditor_memory_usage, Seditor_memory_usage, (void), rep_Subr0) /*
+::doc:editor-memory-usage::
+editor-memory-usage
+
+Return an alist describing the memory used by all buffers together,
+with the same elements as the value of `buffer-memory-usage', and
+these two as well:
+
+	glyphs		The glyph buffers of all windows
+	buffers		The number of buffers (not a count of bytes)
+::end:: */
+{
+    struct memory_usage u;
+    intptr_t count = 0;
+    Lisp_Buffer *tx;
+    memset(&u, 0, sizeof(u));
+    for(tx = buffer_chain; tx != 0; tx = tx->next)
+    {
+	add_buffer_memory_usage(tx, &u);
+	count++;
+    }
+    return memory_usage_alist(&u, rep_list_2(
+	Fcons(Qglyphs, rep_make_long_uint(glyph_buf_bytes)),
+	Fcons(Qbuffers, rep_make_long_int(count))));
+}
+
 DEFUN("current-buffer", Fcurrent_buffer, Scurrent_buffer, (repv vw), rep_Subr1) /*
 ::doc:current-buffer::
 current-buffer [VIEW]
@@ -565,6 +844,8 @@ the buffer which was being displayed before.
     rep_DECLARE1(tx, BUFFERP);
     if(!VIEWP(vw))
 	vw = rep_VAL(curr_vw);
+    if(!THAW_LINES(VBUFFER(tx)))
+	return 0;
     return rep_VAL(swap_buffers(VVIEW(vw), VBUFFER(tx)));
 }
 
@@ -726,7 +1007,9 @@ using current cursor position if specifiers are not provided.
 	pos = curr_vw->cursor_pos;
 	tx = rep_VAL(curr_vw->tx);
     }
-    return(rep_MAKE_INT(VBUFFER(tx)->lines[VROW(pos)].ln_Strlen - 1));
+    if(!THAW_LINES(VBUFFER(tx)))
+	return 0;
+    return(rep_MAKE_INT(TX_LINE(VBUFFER(tx), VROW(pos)).ln_Strlen - 1));
 }
 
 DEFUN("bufferp", Fbufferp, Sbufferp, (repv arg), rep_Subr1) /*
@@ -799,7 +1082,9 @@ Return the position of the last character that may be displayed in BUFFER
 {
     if(!BUFFERP(tx))
 	tx = rep_VAL(curr_vw->tx);
-    return make_pos(VBUFFER(tx)->lines[VBUFFER(tx)->logical_end - 1].ln_Strlen -1,
+    if(!THAW_LINES(VBUFFER(tx)))
+	return 0;
+    return make_pos(TX_LINE(VBUFFER(tx), VBUFFER(tx)->logical_end - 1).ln_Strlen -1,
 		    VBUFFER(tx)->logical_end - 1);
 }
 
@@ -941,8 +1226,8 @@ static Lisp_Mark *mark_chain;
 
 DEFSTRING(non_resident, "Marks used as streams must be resident");
 
-/* For all non-resident marks, see if any point to NEWTX, if so link them
-   onto NEWTX's `tx_Marks' chain. */
+/* For all non-resident marks, see if any point to NEWTX, if so add them
+   to NEWTX's mark index. */
 static void
 make_marks_resident(repv newtx)
 {
@@ -954,12 +1239,12 @@ make_marks_resident(repv newtx)
 	
 	if(rep_STRINGP(VBUFFER(newtx)->canonical_file_name)
 	    && strcmp(rep_STR(VBUFFER(newtx)->canonical_file_name),
-		      rep_STR(VMARK(mk)->canon_file)) == 0)
+		      rep_STR(VMARK(mk)->canon_file)) == 0
+	    && index_mark(VBUFFER(newtx), VMARK(mk)))
 	{
 	    VMARK(mk)->file = newtx;
 	    VMARK(mk)->canon_file = Qnil;
-	    VMARK(mk)->next = VBUFFER(newtx)->mark_chain;
-	    VBUFFER(newtx)->mark_chain = VMARK(mk);
+	    VMARK(mk)->next = NULL;
 	}
 	else
 	{
@@ -970,25 +1255,26 @@ make_marks_resident(repv newtx)
     }
 }
 
-/* Takes MK off the buffer mark chain that it's on (or the list of non-
+/* Takes MK out of the mark index of its buffer (or off the list of non-
    resident marks). */
 static void
 unchain_mark(Lisp_Mark *mk)
 {
-    Lisp_Mark **headp, *this;
-    if(!MARK_RESIDENT_P(mk))
-	headp = &non_resident_mark_chain;
-    else
-	headp = &(VBUFFER(mk->file)->mark_chain);
-    this = *headp;
-    *headp = NULL;
+    Lisp_Mark *this;
+    if(MARK_RESIDENT_P(mk))
+    {
+	unindex_mark(VBUFFER(mk->file), mk);
+	return;
+    }
+    this = non_resident_mark_chain;
+    non_resident_mark_chain = NULL;
     while(this)
     {
 	Lisp_Mark *tmp = this->next;
 	if(this != mk)
 	{
-	    this->next = *headp;
-	    *headp = this;
+	    this->next = non_resident_mark_chain;
+	    non_resident_mark_chain = this;
 	}
 	this = tmp;
     }
@@ -1009,25 +1295,23 @@ make_marks_non_resident(Lisp_Buffer *oldtx)
     repv file = (rep_STRINGP(oldtx->file_name)
 		  ? oldtx->file_name
 		  : canon_file);
-    Lisp_Mark *nxt, *mk = oldtx->mark_chain;
-    oldtx->mark_chain = NULL;
-    while(mk != NULL)
+    struct mark_index *mi = &oldtx->marks;
+    intptr_t i;
+    for(i = 0; i < mi->count; i++)
     {
-	nxt = mk->next;
-	if (rep_NILP(canon_file) || rep_NILP(file))
-	{
-	    /* No file to associate with, lose the mark. */
-	    unchain_mark(mk);
-	}
-	else
+	Lisp_Mark *mk = MARK_AT(mi, i);
+	mk->pos = mark_pos(mk);
+	if (!rep_NILP(canon_file) && !rep_NILP(file))
 	{
 	    mk->next = non_resident_mark_chain;
 	    non_resident_mark_chain = mk;
 	}
+	/* else there's no file to associate with, lose the mark. */
 	mk->file = file;
 	mk->canon_file = canon_file;
-	mk = nxt;
     }
+    mi->count = mi->gap = 0;
+    mi->shift_start = mi->shift_rows = 0;
 }
 
 static void
@@ -1054,13 +1338,23 @@ static void
 mark_sweep(void)
 {
     Lisp_Mark *mk = mark_chain;
+    bool swept_resident = false;
     mark_chain = NULL;
     while(mk)
     {
 	Lisp_Mark *nxt = mk->next_alloc;
 	if(!rep_GC_CELL_MARKEDP(rep_VAL(mk)))
 	{
-	    unchain_mark(mk);
+	    if(MARK_RESIDENT_P(mk))
+	    {
+		/* Taking each mark out of the index in turn could take
+		   time proportional to the square of the number of
+		   marks, so leave a hole and remove them all below */
+		VBUFFER(mk->file)->marks.marks[mk->index] = 0;
+		swept_resident = true;
+	    }
+	    else
+		unchain_mark(mk);
 	    rep_free(mk);
 	}
 	else
@@ -1071,6 +1365,12 @@ mark_sweep(void)
 	}
 	mk = nxt;
     }
+    if(swept_resident)
+    {
+	Lisp_Buffer *tx;
+	for(tx = buffer_chain; tx != 0; tx = tx->next)
+	    sweep_mark_index(tx);
+    }
 }
 
 /* Compare two marks. */
@@ -1086,9 +1386,10 @@ mark_cmp(repv v1, repv v2)
 	       && (rep_value_cmp(VMARK(v1)->canon_file,
 				 VMARK(v2)->canon_file) == 0)))
 	{
-	    rc = VROW(VMARK(v1)->pos) - VROW(VMARK(v2)->pos);
+	    repv pos1 = mark_pos(VMARK(v1)), pos2 = mark_pos(VMARK(v2));
+	    rc = VROW(pos1) - VROW(pos2);
 	    if(rc == 0)
-		rc = VCOL(VMARK(v1)->pos) - VROW(VMARK(v2)->pos);
+		rc = VCOL(pos1) - VCOL(pos2);
 	}
     }
     return rc;
@@ -1098,6 +1399,7 @@ static void
 mark_prin(repv strm, repv obj)
 {
     char tbuf[40];
+    repv pos = mark_pos(VMARK(obj));
     rep_stream_puts(strm, "#<mark ", -1, false);
     if(MARK_RESIDENT_P(VMARK(obj)))
 	buffer_prin(strm, VMARK(obj)->file);
@@ -1113,8 +1415,7 @@ mark_prin(repv strm, repv obj)
     sprintf(tbuf,
 #endif
 	    " #<pos %" PRIdPTR " %" PRIdPTR ">>",
-	    VCOL(VMARK(obj)->pos),
-	    VROW(VMARK(obj)->pos));
+	    VCOL(pos), VROW(pos));
     rep_stream_puts(strm, tbuf, -1, false);
 }
 
@@ -1127,13 +1428,20 @@ mark_getc (repv stream)
 	return EOF;
     }
     else
-	return pos_getc(VBUFFER(VMARK(stream)->file), &VMARK(stream)->pos);
+    {
+	repv pos = mark_pos(VMARK(stream));
+	int c = pos_getc(VBUFFER(VMARK(stream)->file), &pos);
+	move_mark(VMARK(stream), pos);
+	return c;
+    }
 }
 
 static int
 mark_ungetc (repv stream, int c)
 {
-    POS_UNGETC(VMARK(stream)->pos, VBUFFER(VMARK(stream)->file));
+    repv pos = mark_pos(VMARK(stream));
+    POS_UNGETC(pos, VBUFFER(VMARK(stream)->file));
+    move_mark(VMARK(stream), pos);
     return 1;
 }
 
@@ -1146,7 +1454,13 @@ mark_putc (repv stream, int c)
 	return EOF;
     }
     else
-	return pos_putc(VBUFFER(VMARK(stream)->file), &VMARK(stream)->pos, c);
+    {
+	repv pos = mark_pos(VMARK(stream));
+	int rc = pos_putc(VBUFFER(VMARK(stream)->file), &pos, c);
+	if(rc != EOF)
+	    move_mark(VMARK(stream), pos);
+	return rc;
+    }
 }
 
 static intptr_t
@@ -1159,8 +1473,13 @@ mark_puts (repv stream, const void *data, intptr_t len, bool is_val)
 	return EOF;
     }
     else
-	return pos_puts(VBUFFER(VMARK(stream)->file),
-			&VMARK(stream)->pos, buf, len);
+    {
+	repv pos = mark_pos(VMARK(stream));
+	intptr_t rc = pos_puts(VBUFFER(VMARK(stream)->file), &pos, buf, len);
+	if(rc != EOF)
+	    move_mark(VMARK(stream), pos);
+	return rc;
+    }
 }
 
 DEFUN("make-mark", Fmake_mark, Smake_mark, (repv pos, repv buffer), rep_Subr2) /*
@@ -1222,9 +1541,12 @@ updated as the file changes -- it will always point to the same character
 	{
 	    if(!BUFFERP(buffer))
 		buffer = rep_VAL(curr_vw->tx);
+	    if(!index_mark(VBUFFER(buffer), VMARK(mk)))
+	    {
+		VMARK(mk)->file = Qnil;
+		return rep_mem_error();
+	    }
 	    VMARK(mk)->file = buffer;
-	    VMARK(mk)->next = VBUFFER(buffer)->mark_chain;
-	    VBUFFER(buffer)->mark_chain = VMARK(mk);
 	}
 	return mk;
     }
@@ -1241,7 +1563,10 @@ Set the position pointed at by MARK to POSITION.
 {
     rep_DECLARE1(mark, MARKP);
     rep_DECLARE2(pos, POSP);
-    VMARK(mark)->pos = pos;
+    if(!MARK_RESIDENT_P(VMARK(mark)))
+	VMARK(mark)->pos = pos;
+    else
+	move_mark(VMARK(mark), pos);
     return pos;
 }
 
@@ -1269,9 +1594,12 @@ Set the file pointed at by MARK to FILE, a buffer or a file name.
     {
 	if(VMARK(mark)->file != file)
 	{
+	    /* Make room first, so that MARK is left where it was if
+	       there's no memory */
+	    if(!reserve_mark_index(VBUFFER(file)))
+		return rep_mem_error();
 	    unchain_mark(VMARK(mark));
-	    VMARK(mark)->next = VBUFFER(file)->mark_chain;
-	    VBUFFER(file)->mark_chain = VMARK(mark);
+	    index_mark(VBUFFER(file), VMARK(mark));
 	}
 	VMARK(mark)->file = file;
 	VMARK(mark)->canon_file = Qnil;
@@ -1283,7 +1611,7 @@ Set the file pointed at by MARK to FILE, a buffer or a file name.
 	rep_PUSHGC(gc_file, file);
 	tem = Fcanonical_file_name(file);
 	rep_POPGC; rep_POPGC;
-	if(!MARK_RESIDENT_P(VMARK(mark)))
+	if(MARK_RESIDENT_P(VMARK(mark)))
 	{
 	    unchain_mark(VMARK(mark));
 	    VMARK(mark)->next = non_resident_mark_chain;
@@ -1302,13 +1630,13 @@ DEFUN("mark-pos", Fmark_pos, Smark_pos, (repv mark), rep_Subr1) /*
 ::doc:mark-pos::
 mark-pos MARK
 
-Returns the position that MARK points to. (note that this is the *same*
+Returns the position that MARK points to. (note that this may be the *same*
 object that the mark stores internally -- so don't modify it unless you're
 really sure you know what you're doing)
 ::end:: */
 {
     rep_DECLARE1(mark, MARKP);
-    return VMARK(mark)->pos;
+    return mark_pos(VMARK(mark));
 }
 
 DEFUN("mark-file", Fmark_file, Smark_file, (repv mark), rep_Subr1) /*
@@ -1378,6 +1706,18 @@ buffers_init(void)
 
     rep_mark_static((void *)&non_resident_mark_chain);
     rep_INTERN(auto_save_function);
+    rep_INTERN(lines);
+    rep_INTERN(text);
+    rep_INTERN(mapped);
+    rep_INTERN(compressed);
+    rep_INTERN(extents);
+    rep_INTERN(marks);
+    rep_INTERN(glyphs);
+    rep_INTERN(buffers);
+    rep_INTERN_SPECIAL(compact_buffer_threshold);
+    Fset(Qcompact_buffer_threshold, Qnil);
+    rep_INTERN_SPECIAL(buffer_compression_delay);
+    Fset(Qbuffer_compression_delay, Qnil);
     rep_ADD_SUBR(Smake_buffer_name);
     rep_ADD_SUBR(Smake_buffer);
     rep_ADD_SUBR(Sget_file_buffer);
@@ -1407,6 +1747,11 @@ buffers_init(void)
     rep_ADD_SUBR(Struncate_lines);
     rep_ADD_SUBR(Sbuffer_status_id);
     rep_ADD_SUBR(Sall_buffers);
+    rep_ADD_SUBR(Scompact_buffer);
+    rep_ADD_SUBR(Scompress_buffer);
+    rep_ADD_SUBR(Sbuffer_compressed_size);
+    rep_ADD_SUBR(Sbuffer_memory_usage);
+    rep_ADD_SUBR(Seditor_memory_usage);
     rep_ADD_SUBR(Smake_mark);
     rep_ADD_SUBR(Sset_mark_pos);
     rep_ADD_SUBR(Sset_mark_file);
@@ -1424,7 +1769,11 @@ buffers_kill(void)
     while(tx)
     {
 	Lisp_Buffer *nxttx = tx->next;
+	if(tx->batch_text != 0)
+	    release_buffer_snapshot(tx->batch_text);
 	kill_line_list(tx);
+	if(tx->marks.marks != 0)
+	    rep_free(tx->marks.marks);
 	rep_free(tx);
 	tx = nxttx;
     }
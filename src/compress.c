@@ -0,0 +1,185 @@
+/* compress.c -- Keeping the text of hidden buffers compressed
+   Copyright (C) 1993, 1994 John Harper <john@dcs.warwick.ac.uk>
+   $Id$
+
+   This file is part of Jade.
+
+   Jade is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   Jade is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Jade; see the file COPYING.	If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* A buffer that nobody is looking at can have its text compressed: the
+   lines are joined into one block, separated by newlines as in a file,
+   the block is deflated, and the line array and all the strings are
+   freed. The LINES of the buffer are then null until thaw_line_list()
+   puts them back. That's done by everything that can get at the text of
+   a buffer which isn't in a view (checking a position in it, making it
+   the current buffer, taking a snapshot of it, ...), before the text is
+   touched, so that running out of memory is just an error.
+
+   Only the text is compressed. Marks, extents, the undo list and so on
+   all refer to positions, which don't change, and the line count is
+   kept so that positions can still be compared with the size of the
+   buffer without restoring it. */
+
+#include "jade.h"
+#include <string.h>
+#include <stddef.h>
+
+#ifdef NEED_MEMORY_H
+# include <memory.h>
+#endif
+
+#if defined (HAVE_ZLIB_H) && defined (HAVE_LIBZ)
+# include <zlib.h>
+# define USE_ZLIB
+#endif
+
+/* Compress the text of TX. Returns false if it can't be compressed,
+   because there's no memory, a snapshot of the buffer is still in use,
+   or Jade was built without zlib. */
+bool
+compress_line_list(Lisp_Buffer *tx)
+{
+#ifdef USE_ZLIB
+    struct compressed_text *c;
+    size_t text_length = 0;
+    uLongf length;
+    char *text, *ptr;
+    intptr_t row;
+
+    if(tx->compressed != 0)
+	return true;
+    if(tx->lines == 0 || tx->line_arena.frozen != 0)
+	return false;
+
+    for(row = 0; row < tx->line_count; row++)
+	text_length += TX_LINE(tx, row).ln_Strlen;
+    text = rep_alloc(text_length);
+    if(text == 0)
+	return false;
+    ptr = text;
+    for(row = 0; row < tx->line_count; row++)
+    {
+	LINE *line = &TX_LINE(tx, row);
+	memcpy(ptr, LINE_TEXT(line), line->ln_Strlen - 1);
+	ptr += line->ln_Strlen - 1;
+	*ptr++ = '\n';
+    }
+
+    /* Buffers are compressed while the editor is idle, one at a time,
+       so favour speed over size. */
+    length = compressBound(text_length);
+    c = rep_alloc(offsetof(struct compressed_text, data) + length);
+    if(c == 0 || compress2(c->data, &length, (Bytef *) text,
+			   text_length, Z_BEST_SPEED) != Z_OK)
+    {
+	if(c != 0)
+	    rep_free(c);
+	rep_free(text);
+	return false;
+    }
+    rep_free(text);
+    c->length = length;
+    c->text_length = text_length;
+    ptr = rep_realloc(c, offsetof(struct compressed_text, data) + length);
+    if(ptr != 0)
+	c = (struct compressed_text *) ptr;
+
+    /* This also drops any mapped file, none of the strings are
+       needed now. */
+    line_arena_kill(&tx->line_arena);
+    drop_offset_tree(tx);
+    rep_free(tx->lines);
+    tx->lines = 0;
+    tx->total_lines = tx->line_count;
+    tx->line_gap = tx->line_count;
+    tx->compressed = c;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* If the text of TX is compressed, uncompress it into a new line
+   array. Returns false if there's no memory for that, after signalling
+   an error; the text is then still compressed. */
+bool
+thaw_line_list(Lisp_Buffer *tx)
+{
+#ifdef USE_ZLIB
+    struct compressed_text *c = tx->compressed;
+    if(c != 0)
+    {
+	LINE *lines = rep_alloc(sizeof(LINE) * tx->line_count);
+	char *text = rep_alloc(c->text_length);
+	uLongf length = c->text_length;
+	char *ptr;
+	intptr_t row;
+
+	if(lines == 0 || text == 0
+	   || uncompress((Bytef *) text, &length, c->data, c->length) != Z_OK)
+	{
+	    goto error;
+	}
+	ptr = text;
+	for(row = 0; row < tx->line_count; row++)
+	{
+	    char *end = memchr(ptr, '\n', text + length - ptr);
+	    intptr_t line_length = end - ptr + 1;
+	    char *copy;
+	    lines[row].ln_Strlen = line_length;
+	    if(line_length <= LINE_INLINE_MAX)
+		copy = lines[row].ln_Text.local;
+	    else
+	    {
+		copy = line_arena_alloc(&tx->line_arena, line_length);
+		if(copy == 0)
+		    goto error;
+		lines[row].ln_Text.heap = copy;
+	    }
+	    memcpy(copy, ptr, line_length - 1);
+	    copy[line_length - 1] = 0;
+	    ptr = end + 1;
+	}
+	rep_free(text);
+	rep_free(c);
+	tx->compressed = 0;
+	tx->lines = lines;
+	tx->last_displayed_time = rep_time();
+	return true;
+
+    error:
+	/* The arena was empty while the text was compressed */
+	line_arena_kill(&tx->line_arena);
+	if(lines != 0)
+	    rep_free(lines);
+	if(text != 0)
+	    rep_free(text);
+	rep_mem_error();
+	return false;
+    }
+#endif
+    return true;
+}
+
+/* Free the compressed text of TX, if it has any. */
+void
+kill_compressed_text(Lisp_Buffer *tx)
+{
+    if(tx->compressed != 0)
+    {
+	rep_free(tx->compressed);
+	tx->compressed = 0;
+    }
+}
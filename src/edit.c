@@ -28,49 +28,312 @@
 # include <memory.h>
 #endif
 
-/* The maximum number of unused line entries at the end of the
-   array of lines in each buffer. 128 == 1k. */
+/* The maximum number of unused line entries in the array of lines
+   in each buffer, unless the buffer itself is larger. 128 == 1k. */
 #define MAX_SPARE_LINES 128
 
 /*  When allocating new line arrays allocate this many extra lines,
-    in case it grows. */
+    in case it grows. Large buffers get an extra eighth of their size
+    so that the cost of growing the array is amortised. */
 #define ALLOC_SPARE_LINES 32
+#define SPARE_LINES(n) MAX(ALLOC_SPARE_LINES, (n) / 8)
 
-/* Strings stored in LINEs are allocated using stringmem.c, this means
-   that small strings are always allocated in chunks of eight bytes.
-   So it makes sense to allocate lines in multiples of this number;
-   allowing many unnecessary re-allocations to be avoided. */
+/* section_length() adds up the lengths of spans of up to this many
+   rows itself, rather than building the offset tree to do it. */
+#define SECTION_LOOP_MAX 64
+
+/* Strings stored in LINEs are allocated from the buffer's line arena
+   (see lines.c), this means that small strings are always rounded up
+   to one of a fixed set of sizes. So it makes sense to compare lengths
+   as the arena sees them; allowing many unnecessary re-allocations to
+   be avoided. */
 
 /* For a piece of memory of size X, this is the number of bytes we'll
-   actually ask to be allocated. */
-#define LINE_BUF_SIZE(x) ROUND_UP_INT(x, 8)
+   actually be given. */
+#define LINE_BUF_SIZE(x) line_buf_size(x)
 
 /* Allocate a chunk of memory to store a string of size X (including
    terminating zero). */
-#define ALLOC_LINE_BUF(tx, x) rep_alloc(LINE_BUF_SIZE(x))
+#define ALLOC_LINE_BUF(tx, x) line_arena_alloc(&(tx)->line_arena, x)
+
+/* Free something of size X allocated with the previous macro. */
+#define FREE_LINE_BUF(tx, p, x) line_arena_free(&(tx)->line_arena, p, x)
+
+/* To convert between positions and character offsets quickly, each
+   buffer may have a Fenwick tree of the lengths of the entries in its
+   line array, with the entries in the gap counting as zero. It's
+   indexed by entry rather than by row, so inserting and deleting rows
+   at the gap doesn't disturb it, only moving the gap does. The tree is
+   built when first needed, kept up to date by the functions in this
+   file, and dropped when the line array is reallocated. */
+
+/* Add DELTA to the length of entry ENTRY in the offset tree of TX. */
+static void
+offset_tree_add(Lisp_Buffer *tx, intptr_t entry, intptr_t delta)
+{
+    for(entry++; entry <= tx->total_lines; entry += entry & -entry)
+	tx->offset_tree[entry] += delta;
+}
+
+/* Build the offset tree of TX from scratch. Returns false if no
+   memory. */
+static bool
+build_offset_tree(Lisp_Buffer *tx)
+{
+    LINE *lines = TX_LINES(tx);
+    intptr_t n = tx->total_lines, gap_end = n - (tx->line_count - tx->line_gap);
+    intptr_t *tree = rep_alloc(sizeof(intptr_t) * (n + 1));
+    intptr_t i;
+    if(tree == 0)
+	return false;
+    tree[0] = 0;
+    for(i = 0; i < n; i++)
+    {
+	tree[i + 1] = ((i < tx->line_gap || i >= gap_end)
+		       ? lines[i].ln_Strlen : 0);
+    }
+    for(i = 1; i <= n; i++)
+    {
+	intptr_t parent = i + (i & -i);
+	if(parent <= n)
+	    tree[parent] += tree[i];
+    }
+    tx->offset_tree = tree;
+    return true;
+}
+
+void
+drop_offset_tree(Lisp_Buffer *tx)
+{
+    if(tx->offset_tree != 0)
+    {
+	rep_free(tx->offset_tree);
+	tx->offset_tree = 0;
+    }
+}
+
+/* Called before the gap in the line array of TX is moved in front of
+   row WHERE, to move the lengths of the entries that will be moved.
+   A short move updates the entries one by one. Otherwise the nodes
+   covering the entries between the old and new places of the gap are
+   all updated in a single pass over those entries: a node covering
+   only such entries is summed from its children again, one covering
+   some of them has the change in their total added, and one covering
+   all of them doesn't change, since they're only rearranged. */
+static void
+move_offset_tree_entries(Lisp_Buffer *tx, intptr_t where)
+{
+    intptr_t *tree = tx->offset_tree;
+    intptr_t gap = tx->total_lines - tx->line_count;
+    intptr_t from, to, count, lo, hi, depth, i, j;
+    intptr_t old_sum = 0, new_sum = 0;
+
+    if(where < tx->line_gap)
+    {
+	from = where;
+	to = where + gap;
+	count = tx->line_gap - where;
+    }
+    else
+    {
+	from = tx->line_gap + gap;
+	to = tx->line_gap;
+	count = where - tx->line_gap;
+    }
+
+    for(depth = 1; ((intptr_t) 1 << depth) <= tx->total_lines; depth++)
+	;
+    if(count * 2 * depth < count + gap)
+    {
+	for(i = 0; i < count; i++)
+	{
+	    intptr_t length = tx->lines[from + i].ln_Strlen;
+	    offset_tree_add(tx, from + i, -length);
+	    offset_tree_add(tx, to + i, length);
+	}
+	return;
+    }
+
+    /* Entries LO to HI-1 change, node J of the tree holds entry J-1. */
+    lo = MIN(from, to);
+    hi = MAX(from, to) + count;
+    for(j = lo + 1; j <= hi; j++)
+    {
+	intptr_t entry = j - 1, low = j & -j, new_length, step;
+	new_length = ((entry >= where && entry < where + gap)
+		      ? 0 : tx->lines[entry - (to - from)].ln_Strlen);
+	old_sum += ((entry >= tx->line_gap && entry < tx->line_gap + gap)
+		    ? 0 : tx->lines[entry].ln_Strlen);
+	new_sum += new_length;
+	if(j - low >= lo)
+	{
+	    tree[j] = new_length;
+	    for(step = 1; step < low; step *= 2)
+		tree[j] += tree[j - step];
+	}
+	else
+	    tree[j] += new_sum - old_sum;
+
+	/* Nodes past HI covering entries from J onwards */
+	for(step = 1; step < low && j < hi; step *= 2)
+	{
+	    if(j + step > hi && j + step <= tx->total_lines)
+		tree[j + step] -= new_sum - old_sum;
+	}
+    }
+}
+
+/* Set the length of line ROW of TX to LENGTH, keeping the offset tree
+   in step. The string itself must already have been changed. */
+static inline void
+set_line_length(Lisp_Buffer *tx, intptr_t row, intptr_t length)
+{
+    LINE *line = &TX_LINE(tx, row);
+    if(tx->offset_tree != 0)
+	offset_tree_add(tx, LINE_INDEX(tx, row), length - line->ln_Strlen);
+    line->ln_Strlen = length;
+}
+
+/* Give line ROW of TX, which has no string yet, a string of LENGTH
+   bytes. Returns the string for the caller to fill in, or a null
+   pointer if no memory. */
+static char *
+alloc_line_text(Lisp_Buffer *tx, intptr_t row, intptr_t length)
+{
+    LINE *line = &TX_LINE(tx, row);
+    if(length > LINE_INLINE_MAX)
+    {
+	char *text = ALLOC_LINE_BUF(tx, length);
+	if(text == NULL)
+	    return NULL;
+	line->ln_Text.heap = text;
+    }
+    set_line_length(tx, row, length);
+    return LINE_TEXT(line);
+}
+
+/* Replace the DELETE bytes at column COL of line ROW in TX by INSERT
+   bytes of garbage, moving the rest of the line (and its terminator)
+   after them. The line must be writable. Returns the string of the
+   line, or a null pointer if no memory. */
+static char *
+splice_line(Lisp_Buffer *tx, intptr_t row, intptr_t col,
+	    intptr_t delete, intptr_t insert)
+{
+    LINE *line = &TX_LINE(tx, row);
+    intptr_t old_length = line->ln_Strlen;
+    intptr_t new_length = old_length - delete + insert;
+    intptr_t rest = old_length - (col + delete);
+    char *old = LINE_TEXT(line);
+
+    if(LINE_BUF_SIZE(new_length) == LINE_BUF_SIZE(old_length))
+    {
+	/* Absorb the change in the current string */
+	memmove(old + col + insert, old + col + delete, rest);
+    }
+    else
+    {
+	char local[LINE_INLINE_MAX];
+	char *new = local;
+	if(new_length > LINE_INLINE_MAX)
+	{
+	    new = ALLOC_LINE_BUF(tx, new_length);
+	    if(new == NULL)
+		return NULL;
+	}
+	memcpy(new, old, col);
+	memcpy(new + col + insert, old + col + delete, rest);
+	if(!LINE_INLINE_P(line))
+	    FREE_LINE_BUF(tx, old, old_length);
+	if(new == local)
+	    memcpy(line->ln_Text.local, local, new_length);
+	else
+	    line->ln_Text.heap = new;
+    }
+    set_line_length(tx, row, new_length);
+    return LINE_TEXT(line);
+}
 
-/* Free something allocated with the previous macro. */
-#define FREE_LINE_BUF(tx, p)  rep_free(p)
+/* Returns the offset of the start of ROW from the start of TX, the
+   total length of all the rows before it. */
+intptr_t
+row_offset(Lisp_Buffer *tx, intptr_t row)
+{
+    intptr_t entry, offset = 0;
+    if(tx->offset_tree == 0 && !build_offset_tree(tx))
+    {
+	/* No memory; do it the slow way */
+	for(entry = 0; entry < row; entry++)
+	    offset += TX_LINE(tx, entry).ln_Strlen;
+	return offset;
+    }
+    for(entry = LINE_INDEX(tx, row); entry > 0; entry -= entry & -entry)
+	offset += tx->offset_tree[entry];
+    return offset;
+}
+
+/* Returns the row of TX containing the character OFFSET characters
+   from its start, and stores the column of that character in *COLP.
+   Offsets outside the buffer give its start or end. */
+intptr_t
+offset_row(Lisp_Buffer *tx, intptr_t offset, intptr_t *colp)
+{
+    intptr_t entry = 0, row, step;
+    if(offset < 0)
+	offset = 0;
+    if(tx->offset_tree == 0 && !build_offset_tree(tx))
+    {
+	for(row = 0; row < tx->line_count - 1; row++)
+	{
+	    if(offset < TX_LINE(tx, row).ln_Strlen)
+		break;
+	    offset -= TX_LINE(tx, row).ln_Strlen;
+	}
+    }
+    else
+    {
+	/* Find the last entry whose start is at or before OFFSET. Entries
+	   in the gap have no length, so this is never one of them. */
+	for(step = 1; step * 2 <= tx->total_lines; step *= 2)
+	    ;
+	for(; step > 0; step /= 2)
+	{
+	    if(entry + step <= tx->total_lines
+	       && tx->offset_tree[entry + step] <= offset)
+	    {
+		entry += step;
+		offset -= tx->offset_tree[entry];
+	    }
+	}
+	if(entry >= tx->total_lines)
+	{
+	    row = tx->line_count - 1;
+	    offset = TX_LINE(tx, row).ln_Strlen;
+	}
+	else
+	{
+	    row = (entry < tx->line_gap
+		   ? entry : entry - (tx->total_lines - tx->line_count));
+	}
+    }
+    *colp = MIN(offset, TX_LINE(tx, row).ln_Strlen - 1);
+    return row;
+}
 
 /* Makes buffer TX empty (null string in first line) */
 bool
 clear_line_list(Lisp_Buffer *tx)
 {
-    if(tx->lines)
+    if(tx->lines || tx->compressed)
 	kill_line_list(tx);
     tx->lines = rep_alloc(sizeof(LINE) * ALLOC_SPARE_LINES);
     if(tx->lines)
     {
-	tx->lines[0].ln_Line = ALLOC_LINE_BUF(tx, 1);
-	if(tx->lines[0].ln_Line)
-	{
-	    tx->lines[0].ln_Line[0] = 0;
-	    tx->lines[0].ln_Strlen = 1;
-	}
-	else
-	    tx->lines[0].ln_Strlen = 0;
 	tx->line_count = 1;
 	tx->total_lines = ALLOC_SPARE_LINES;
+	tx->line_gap = 1;
+	TX_LINE(tx, 0).ln_Strlen = 0;
+	alloc_line_text(tx, 0, 1)[0] = 0;
 	tx->logical_start = 0;
 	tx->logical_end = 1;
 	return(true);
@@ -78,22 +341,22 @@ clear_line_list(Lisp_Buffer *tx)
     return(false);
 }
 
-/* deallocates all lines and their list */
+/* deallocates all lines and their list. The strings all live in the
+   buffer's arena, so there's no need to free them one by one. */
 void
 kill_line_list(Lisp_Buffer *tx)
 {
-    if(tx->lines)
+    line_arena_kill(&tx->line_arena);
+    drop_offset_tree(tx);
+    if(tx->lines || tx->compressed)
     {
-	intptr_t i;
-	for(i = 0; i < tx->line_count; i++)
-	{
-	    if(tx->lines[i].ln_Strlen)
-		FREE_LINE_BUF(tx, tx->lines[i].ln_Line);
-	}
-	rep_free(tx->lines);
+	kill_compressed_text(tx);
+	if(tx->lines)
+	    rep_free(tx->lines);
 	tx->lines = 0;
 	tx->line_count = 0;
 	tx->total_lines = 0;
+	tx->line_gap = 0;
     }
 }
 
@@ -104,19 +367,72 @@ kill_some_lines(Lisp_Buffer *tx, intptr_t start, intptr_t number)
     intptr_t i;
     for(i = start; i < number + start; i++)
     {
-	if(tx->lines[i].ln_Strlen)
+	if(!LINE_INLINE_P(&TX_LINE(tx, i)))
 	{
-	    FREE_LINE_BUF(tx, tx->lines[i].ln_Line);
-	    tx->lines[i].ln_Strlen = 0;
-	    tx->lines[i].ln_Line = NULL;
+	    FREE_LINE_BUF(tx, TX_LINE(tx, i).ln_Text.heap,
+			  TX_LINE(tx, i).ln_Strlen);
 	}
+	set_line_length(tx, i, 0);
     }
 }
 
+/* Move the gap in the line array of TX so that it's in front of row
+   WHERE. Only the lines between the old and new positions of the gap
+   are touched. */
+static void
+move_line_gap(Lisp_Buffer *tx, intptr_t where)
+{
+    intptr_t gap = tx->total_lines - tx->line_count;
+    if(tx->offset_tree != 0 && gap > 0 && where != tx->line_gap)
+	move_offset_tree_entries(tx, where);
+    if(where < tx->line_gap)
+    {
+	memmove(tx->lines + where + gap, tx->lines + where,
+		(tx->line_gap - where) * sizeof(LINE));
+    }
+    else if(where > tx->line_gap)
+    {
+	memmove(tx->lines + tx->line_gap, tx->lines + tx->line_gap + gap,
+		(where - tx->line_gap) * sizeof(LINE));
+    }
+    tx->line_gap = where;
+}
+
+/* Reallocate the line array of TX to hold NEW-TOTAL entries, keeping
+   the gap where it is. Returns false if no memory. */
+static bool
+realloc_line_list(Lisp_Buffer *tx, intptr_t new_total)
+{
+    intptr_t tail = tx->line_count - tx->line_gap;
+    LINE *tem;
+    if(new_total < tx->total_lines)
+    {
+	/* Shrinking, close up the gap first */
+	memmove(tx->lines + new_total - tail,
+		tx->lines + tx->total_lines - tail, tail * sizeof(LINE));
+    }
+    tem = rep_realloc(tx->lines, sizeof(LINE) * new_total);
+    if(tem != 0)
+	tx->lines = tem;
+    else if(new_total > tx->total_lines)
+	return false;
+    /* else a failed shrink just leaves the larger block in place */
+    drop_offset_tree(tx);
+    if(new_total > tx->total_lines)
+    {
+	memmove(tx->lines + new_total - tail,
+		tx->lines + tx->total_lines - tail, tail * sizeof(LINE));
+    }
+    tx->total_lines = new_total;
+    return true;
+}
+
 /* Creates blank entries or removes existing lines starting from line
    WHERE. CHANGE is the number of lines to insert, negative numbers mean
    delete that number of lines starting at the cursor line. If lines are
-   deleted the actual text is also deleted.
+   deleted the actual text is also deleted. The gap in the line array
+   is left at WHERE, so the cost of this depends on the distance from
+   the last change, not on the size of the buffer.
    NOTE: A line list of zero lines is not allowed. */
 LINE *
 resize_line_list(Lisp_Buffer *tx, intptr_t change, intptr_t where)
@@ -124,45 +440,37 @@ resize_line_list(Lisp_Buffer *tx, intptr_t change, intptr_t where)
     intptr_t newsize = tx->line_count + change;
     if(newsize <= 0)
 	return NULL;
+    if(TX_LINES(tx) == 0)
+    {
+	intptr_t actual_size = newsize + SPARE_LINES(newsize);
+	tx->lines = rep_alloc(sizeof(LINE) * actual_size);
+	if(tx->lines == 0)
+	    return 0;
+	tx->total_lines = actual_size;
+	tx->line_count = 0;
+	tx->line_gap = 0;
+    }
     if(change < 0)
     {
-	assert(tx->lines != 0);
 	kill_some_lines(tx, where, -change);
-	memmove(tx->lines + where,
-		tx->lines + where - change,
-		(tx->line_count - where + change) * sizeof(LINE));
+	/* The deleted lines simply become part of the gap */
+	move_line_gap(tx, where);
+	tx->line_count = newsize;
+	if(tx->total_lines - newsize > MAX(MAX_SPARE_LINES, newsize))
+	    realloc_line_list(tx, newsize + SPARE_LINES(newsize));
     }
-    if(tx->lines == 0
-       || newsize > tx->total_lines
-       || (tx->total_lines - newsize) > MAX_SPARE_LINES)
+    else if(change > 0)
     {
-	/* Only reallocate if there's not enough space in the array */
-	intptr_t actual_size = newsize + ALLOC_SPARE_LINES;
-	if(tx->lines != 0)
+	move_line_gap(tx, where);
+	if(newsize > tx->total_lines
+	   && !realloc_line_list(tx, newsize + SPARE_LINES(newsize)))
 	{
-	    LINE *tem = rep_realloc(tx->lines, sizeof(LINE) * actual_size);
-	    if (tem != 0)
-		tx->lines = tem;
-	    else
-	    {
-		rep_free(tx->lines);
-		tx->lines = 0;
-	    }
-	}
-	else
-	    tx->lines = rep_alloc(sizeof(LINE) * actual_size);
-	if(tx->lines == 0)
 	    return 0;
-	tx->total_lines = actual_size;
-    }
-    if(change > 0)
-    {
-	memmove(tx->lines + where + change,
-		tx->lines + where,
-		(tx->line_count - where) * sizeof(LINE));
+	}
 	memset(tx->lines + where, 0, sizeof(LINE) * change);
+	tx->line_gap += change;
+	tx->line_count = newsize;
     }
-    tx->line_count = newsize;
     return tx->lines;
 }
 
@@ -173,49 +481,113 @@ alloc_line_buf(Lisp_Buffer *tx, intptr_t length)
 }
 
 void
-free_line_buf(Lisp_Buffer *tx, char *line)
+free_line_buf(Lisp_Buffer *tx, char *line, intptr_t length)
 {
-    FREE_LINE_BUF(tx, line);
+    FREE_LINE_BUF(tx, line, length);
 }
 
-/* Inserts LEN characters of `space' at pos. The gap will be filled
-   with random garbage. */
+/* If the string of line ROW in TX still points into a mapped file, or
+   is shared with a snapshot, give the line its own copy so that it can
+   be modified in place. Returns false if no memory. */
 bool
-insert_gap(Lisp_Buffer *tx, intptr_t len,
-	   intptr_t col, intptr_t row)
+make_line_writable(Lisp_Buffer *tx, intptr_t row)
 {
-    intptr_t new_length = tx->lines[row].ln_Strlen + len;
-    if(LINE_BUF_SIZE(new_length) == LINE_BUF_SIZE(tx->lines[row].ln_Strlen))
+    LINE *line = &TX_LINE(tx, row);
+    if(LINE_MAPPED_P(tx, line) || LINE_FROZEN_P(tx, line))
     {
-	/* Absorb the insertion in the current buffer */
-	memmove(tx->lines[row].ln_Line + col + len,
-		tx->lines[row].ln_Line + col,
-		tx->lines[row].ln_Strlen - col);
+	char *copy = ALLOC_LINE_BUF(tx, line->ln_Strlen);
+	if(copy == NULL)
+	{
+	    rep_mem_error();
+	    return false;
+	}
+	memcpy(copy, line->ln_Text.heap, line->ln_Strlen - 1);
+	copy[line->ln_Strlen - 1] = 0;
+	/* This doesn't touch the old string, it just stops counting it */
+	FREE_LINE_BUF(tx, line->ln_Text.heap, line->ln_Strlen);
+	line->ln_Text.heap = copy;
     }
-    else
+    return true;
+}
+
+/* Copy every line of TX that still points into its mapped file, then
+   drop the mapping. Needed before the file itself is overwritten.
+   Returns false if no memory (the mapping is left in place). */
+bool
+unmap_line_list(Lisp_Buffer *tx)
+{
+    if(tx->line_arena.map_base != 0)
     {
-	/* Need to allocate a new buffer */
-	char *newline = ALLOC_LINE_BUF(tx, new_length);
-	if(newline != NULL)
+	intptr_t row;
+	for(row = 0; row < tx->line_count; row++)
 	{
-	    if(tx->lines[row].ln_Strlen != 0)
+	    if(LINE_MAPPED_P(tx, &TX_LINE(tx, row))
+	       && !make_line_writable(tx, row))
 	    {
-		memcpy(newline, tx->lines[row].ln_Line, col);
-		memcpy(newline + col + len, tx->lines[row].ln_Line + col,
-		       tx->lines[row].ln_Strlen - col);
-		FREE_LINE_BUF(tx, tx->lines[row].ln_Line);
+		return false;
 	    }
-	    else
-		newline[len] = 0;
-	    tx->lines[row].ln_Line = newline;
 	}
-	else
+	line_arena_unmap(&tx->line_arena);
+    }
+    return true;
+}
+
+/* Copy the strings of all lines in TX into new storage, one after the
+   other in the order of their rows, then free the old storage. After a
+   lot of editing the strings are scattered all over the arena, this
+   puts neighbouring lines back next to each other in memory. Lines in
+   a mapped file are already in order, so they're left alone. Returns
+   false if no memory (TX is unchanged). A compressed buffer is left
+   compressed, there's nothing to compact. */
+bool
+compact_line_list(Lisp_Buffer *tx)
+{
+    struct line_arena fresh;
+    LINE *lines;
+    intptr_t row;
+
+    if(tx->lines == 0)
+	return true;
+    lines = rep_alloc(sizeof(LINE) * tx->total_lines);
+    if(lines == 0)
+	return false;
+    memset(&fresh, 0, sizeof(fresh));
+    memcpy(lines, tx->lines, sizeof(LINE) * tx->total_lines);
+    for(row = 0; row < tx->line_count; row++)
+    {
+	LINE *line = &lines[LINE_INDEX(tx, row)];
+	char *copy;
+	if(LINE_INLINE_P(line) || LINE_MAPPED_P(tx, line))
+	    continue;
+	copy = line_arena_alloc(&fresh, line->ln_Strlen);
+	if(copy == 0)
 	{
-	    rep_mem_error();
+	    line_arena_kill(&fresh);
+	    rep_free(lines);
 	    return false;
 	}
+	memcpy(copy, line->ln_Text.heap, line->ln_Strlen);
+	line->ln_Text.heap = copy;
+    }
+    rep_free(tx->lines);
+    tx->lines = lines;
+    line_arena_replace(&tx->line_arena, &fresh);
+    return true;
+}
+
+/* Inserts LEN characters of `space' at pos. The gap will be filled
+   with random garbage. */
+bool
+insert_gap(Lisp_Buffer *tx, intptr_t len,
+	   intptr_t col, intptr_t row)
+{
+    if(!make_line_writable(tx, row))
+	return false;
+    if(splice_line(tx, row, col, 0, len) == NULL)
+    {
+	rep_mem_error();
+	return false;
     }
-    tx->lines[row].ln_Strlen += len;
     adjust_marks_add_x(tx, len, col, row);
     return true;
 }
@@ -229,7 +601,7 @@ insert_bytes(Lisp_Buffer *tx, const char *text, size_t textLen, repv pos)
 {
     if(insert_gap(tx, textLen, VCOL(pos), VROW(pos)))
     {
-	memcpy(tx->lines[VROW(pos)].ln_Line + VCOL(pos), text, textLen);
+	memcpy(LINE_TEXT(&TX_LINE(tx, VROW(pos))) + VCOL(pos), text, textLen);
 	return make_pos(VCOL(pos) + textLen, VROW(pos));
     }
     else
@@ -237,109 +609,77 @@ insert_bytes(Lisp_Buffer *tx, const char *text, size_t textLen, repv pos)
 }
 
 /* Inserts a string, this routine acts on any '\n' characters that it
-   finds. */
+   finds. The newlines are counted first so that all the new lines can
+   be created in one go, however many there are. */
 repv
 insert_string(Lisp_Buffer *tx, const char *text, size_t textLen, repv pos)
 {
-    const char *eol;
+    const char *eol, *last = 0, *end = text + textLen;
+    intptr_t row = VROW(pos), col = VCOL(pos);
+    intptr_t newlines = 0, i;
     Pos tpos;
-    COPY_VPOS(&tpos, pos);
-    while((eol = memchr(text, '\n', textLen)))
+
+    for(eol = text; (eol = memchr(eol, '\n', end - eol)); eol++)
     {
-	size_t len = eol - text;
-	if(PCOL(&tpos) != 0)
-	{
-	    if(len > 0)
-	    {
-		if(insert_gap(tx, len, PCOL(&tpos), PROW(&tpos)))
-		{
-		    memcpy(tx->lines[PROW(&tpos)].ln_Line + PCOL(&tpos),
-			   text, len);
-		    PCOL(&tpos) += len;
-		}
-		else
-		    goto abort;
-	    }
-	    /* Split line at TPOS */
-	    if(resize_line_list(tx, +1, PROW(&tpos) + 1))
-	    {
-		intptr_t row = PROW(&tpos);
+	last = eol;
+	newlines++;
+    }
 
-		/* First do the new line */
-		tx->lines[row+1].ln_Line
-		    = ALLOC_LINE_BUF(tx, tx->lines[row].ln_Strlen
-				     - PCOL(&tpos));
-		if(tx->lines[row+1].ln_Line != NULL)
-		{
-		    tx->lines[row+1].ln_Strlen
-			= tx->lines[row].ln_Strlen - PCOL(&tpos);
-		    memcpy(tx->lines[row+1].ln_Line,
-			   tx->lines[row].ln_Line + PCOL(&tpos),
-			   tx->lines[row+1].ln_Strlen - 1);
-		    tx->lines[row+1].ln_Line[tx->lines[row+1].ln_Strlen - 1] = 0;
-		}
-		else
-		    goto abort;
+    if(newlines == 0)
+    {
+	if(textLen > 0 && !insert_gap(tx, textLen, col, row))
+	    return 0;
+	memcpy(LINE_TEXT(&TX_LINE(tx, row)) + col, text, textLen);
+	PCOL(&tpos) = col + textLen;
+	PROW(&tpos) = row;
+    }
+    else
+    {
+	intptr_t first_len = (char *) memchr(text, '\n', textLen) - text;
+	intptr_t last_len = end - (last + 1);
+	intptr_t tail_len = TX_LINE(tx, row).ln_Strlen - 1 - col;
+	char *copy;
 
-		/* Then chop the end off the old one */
-		if(LINE_BUF_SIZE(PCOL(&tpos) + 1)
-		   == LINE_BUF_SIZE(tx->lines[row].ln_Strlen))
-		{
-		    /* Use the old buffer */
-		    tx->lines[row].ln_Strlen = PCOL(&tpos) + 1;
-		    tx->lines[row].ln_Line[tx->lines[row].ln_Strlen - 1] = 0;
-		}
-		else
-		{
-		    /* Allocate a new buffer */
-		    char *new = ALLOC_LINE_BUF(tx, PCOL(&tpos) + 1);
-		    if(new != NULL)
-		    {
-			memcpy(new, tx->lines[row].ln_Line, PCOL(&tpos));
-			new[PCOL(&tpos)] = 0;
-			FREE_LINE_BUF(tx, tx->lines[row].ln_Line);
-			tx->lines[row].ln_Line = new;
-			tx->lines[row].ln_Strlen = PCOL(&tpos) + 1;
-		    }
-		    else
-			goto abort;
-		}
-		adjust_marks_split_y(tx, PCOL(&tpos), PROW(&tpos));
-		PCOL(&tpos) = 0;
-		PROW(&tpos)++;
-	    }
-	    else
-		goto abort;
+	if(!make_line_writable(tx, row))
+	    return 0;
+	if(!resize_line_list(tx, newlines, row + 1))
+	{
+	    rep_mem_error();
+	    return 0;
 	}
-	else
+
+	/* Fill in the new lines first, so that nothing has been
+	   changed if any of the allocations fail. The last new line
+	   gets the end of the line that the text is inserted into. */
+	copy = alloc_line_text(tx, row + newlines, last_len + tail_len + 1);
+	if(copy == NULL)
+	    goto abort;
+	memcpy(copy, last + 1, last_len);
+	memcpy(copy + last_len, LINE_TEXT(&TX_LINE(tx, row)) + col, tail_len);
+	copy[last_len + tail_len] = 0;
+
+	eol = text + first_len;
+	for(i = 1; i < newlines; i++)
 	{
-	    char *copy;
-	    if(!resize_line_list(tx, +1, PROW(&tpos)))
-		goto abort;
-	    copy = ALLOC_LINE_BUF(tx, len + 1);
+	    const char *start = eol + 1;
+	    eol = memchr(start, '\n', end - start);
+	    copy = alloc_line_text(tx, row + i, (eol - start) + 1);
 	    if(copy == NULL)
 		goto abort;
-	    memcpy(copy, text, len);
-	    copy[len] = 0;
-	    tx->lines[PROW(&tpos)].ln_Strlen = len + 1;
-	    tx->lines[PROW(&tpos)].ln_Line = copy;
-	    adjust_marks_add_y(tx, +1, PROW(&tpos));
-	    PROW(&tpos)++;
-	}
-	textLen -= len + 1;
-	text = eol + 1;
-    }
-    if(textLen > 0)
-    {
-	if(insert_gap(tx, textLen, PCOL(&tpos), PROW(&tpos)))
-	{
-	    memcpy(tx->lines[PROW(&tpos)].ln_Line + PCOL(&tpos),
-		   text, textLen);
-	    PCOL(&tpos) += textLen;
+	    memcpy(copy, start, eol - start);
+	    copy[eol - start] = 0;
 	}
-	else
-	abort:
-	    return 0;
+
+	/* Then chop the end off the original line and append the
+	   first line of the text to it. */
+	copy = splice_line(tx, row, col, tail_len, first_len);
+	if(copy == NULL)
+	    goto abort;
+	memcpy(copy + col, text, first_len);
+
+	adjust_marks_insert_lines(tx, col, row, newlines, last_len);
+	PCOL(&tpos) = last_len;
+	PROW(&tpos) = row + newlines;
     }
 
     {
@@ -348,6 +688,13 @@ insert_string(Lisp_Buffer *tx, const char *text, size_t textLen, repv pos)
 	flag_insertion(tx, pos, end);
 	return end;
     }
+
+abort:
+    /* Throw away the lines that were created (and any strings that
+       were allocated for them) */
+    resize_line_list(tx, -newlines, row + 1);
+    rep_mem_error();
+    return 0;
 }
 
 /* Deletes some SIZE bytes from line at (COL,ROW). Returns true if okay.
@@ -356,38 +703,17 @@ bool
 delete_chars(Lisp_Buffer *tx, intptr_t col,
 	     intptr_t row, intptr_t size)
 {
-    if(tx->lines[row].ln_Strlen)
+    if(TX_LINE(tx, row).ln_Strlen)
     {
-	intptr_t new_length;
-	if(size >= tx->lines[row].ln_Strlen - col)
-	    size = tx->lines[row].ln_Strlen - col - 1;
-	if(size <= 0)
+	if(size >= TX_LINE(tx, row).ln_Strlen - col)
+	    size = TX_LINE(tx, row).ln_Strlen - col - 1;
+	if(size <= 0 || !make_line_writable(tx, row))
 	    return false;
-	new_length = tx->lines[row].ln_Strlen - size;
-	if(LINE_BUF_SIZE(new_length)
-	   == LINE_BUF_SIZE(tx->lines[row].ln_Strlen))
-	{
-	    /* Absorb the deletion */
-	    memmove(tx->lines[row].ln_Line + col,
-		    tx->lines[row].ln_Line + col + size,
-		    tx->lines[row].ln_Strlen - (col + size));
-	}
-	else
+	if(splice_line(tx, row, col, size, 0) == NULL)
 	{
-	    /* Allocate a new line */
-	    char *new_line = ALLOC_LINE_BUF(tx, new_length);
-	    if(new_line == NULL)
-	    {
-		rep_mem_error();
-		return false;
-	    }
-            memcpy(new_line, tx->lines[row].ln_Line, col);
-            memcpy(new_line + col, tx->lines[row].ln_Line + col + size,
-		   tx->lines[row].ln_Strlen - col - size);
-	    FREE_LINE_BUF(tx, tx->lines[row].ln_Line);
-	    tx->lines[row].ln_Line = new_line;
+	    rep_mem_error();
+	    return false;
 	}
-	tx->lines[row].ln_Strlen -= size;
 	adjust_marks_sub_x(tx, size, col, row);
 	return true;
     }
@@ -413,7 +739,7 @@ delete_section(Lisp_Buffer *tx, repv start, repv end)
 	COPY_VPOS(&tstart, start); COPY_VPOS(&tend, end);
 	if(PCOL(&tstart) != 0)
 	{
-	    intptr_t start_col = (tx->lines[PROW(&tstart)].ln_Strlen
+	    intptr_t start_col = (TX_LINE(tx, PROW(&tstart)).ln_Strlen
 				      - PCOL(&tstart) - 1);
 	    if(start_col != 0)
 		delete_chars(tx, PCOL(&tstart), PROW(&tstart), start_col);
@@ -434,48 +760,41 @@ delete_section(Lisp_Buffer *tx, repv start, repv end)
 	if(joinflag && PROW(&tstart) != 0)
 	{
 	    PROW(&tstart)--;
-	    PCOL(&tstart) = tx->lines[PROW(&tstart)].ln_Strlen - 1;
+	    PCOL(&tstart) = TX_LINE(tx, PROW(&tstart)).ln_Strlen - 1;
 
 	    /* Join the two lines at TSTART */
 	    if((PROW(&tstart) + 1) < tx->logical_end)
 	    {
 		intptr_t row = PROW(&tstart);
 
-		if(tx->lines[row].ln_Strlen == 1
-		   || tx->lines[row+1].ln_Strlen == 1)
+		if(TX_LINE(tx, row).ln_Strlen == 1
+		   || TX_LINE(tx, row+1).ln_Strlen == 1)
 		{
 		    /* One (or both) of the lines being joined is
 		       empty; so just use the other line */
-		    if(tx->lines[row+1].ln_Strlen == 1)
+		    if(TX_LINE(tx, row+1).ln_Strlen == 1)
 		    {
-			char *tem = tx->lines[row].ln_Line;
-			tx->lines[row].ln_Line = tx->lines[row+1].ln_Line;
-			tx->lines[row+1].ln_Line = tem;
-			tx->lines[row+1].ln_Strlen = tx->lines[row].ln_Strlen;
-			tx->lines[row].ln_Strlen = 1;
+			LINE tem = TX_LINE(tx, row);
+			TX_LINE(tx, row).ln_Text = TX_LINE(tx, row+1).ln_Text;
+			TX_LINE(tx, row+1).ln_Text = tem.ln_Text;
+			set_line_length(tx, row+1, TX_LINE(tx, row).ln_Strlen);
+			set_line_length(tx, row, 1);
 		    }
 		}
 		else
 		{
-		    /* Allocate a new line;
-		       TODO: see if the join can be absorbed into one
-		       of the existing lines.. */
-		    int new_length = (tx->lines[row].ln_Strlen
-				      + tx->lines[row+1].ln_Strlen - 1);
-		    char *new_line = ALLOC_LINE_BUF(tx, new_length);
+		    /* Prepend the first line to the second */
+		    intptr_t first_len = TX_LINE(tx, row).ln_Strlen - 1;
+		    char *new_line;
+		    if(!make_line_writable(tx, row+1))
+			return 0;
+		    new_line = splice_line(tx, row+1, 0, 0, first_len);
 		    if(new_line == NULL)
 		    {
 			rep_mem_error();
 			return 0;
 		    }
-		    memcpy(new_line, tx->lines[row].ln_Line,
-			   tx->lines[row].ln_Strlen - 1);
-		    memcpy(new_line + (tx->lines[row].ln_Strlen - 1),
-			   tx->lines[row+1].ln_Line,
-			   tx->lines[row+1].ln_Strlen);
-		    FREE_LINE_BUF(tx, tx->lines[row+1].ln_Line);
-		    tx->lines[row+1].ln_Line = new_line;
-		    tx->lines[row+1].ln_Strlen = new_length;
+		    memcpy(new_line, LINE_TEXT(&TX_LINE(tx, row)), first_len);
 		}
 		resize_line_list(tx, -1, PROW(&tstart));
 		adjust_marks_join_y(tx, PCOL(&tstart), PROW(&tstart));
@@ -492,17 +811,18 @@ delete_section(Lisp_Buffer *tx, repv start, repv end)
 bool
 pad_pos(Lisp_Buffer *tx, repv pos)
 {
-    if(VROW(pos) < tx->logical_end && !read_only_pos(tx, pos))
+    if(VROW(pos) < tx->logical_end && THAW_LINES(tx)
+       && !read_only_pos(tx, pos))
     {
-	if(tx->lines[VROW(pos)].ln_Strlen < (VCOL(pos) + 1))
+	if(TX_LINE(tx, VROW(pos)).ln_Strlen < (VCOL(pos) + 1))
 	{
-	    repv point = make_pos(tx->lines[VROW(pos)].ln_Strlen - 1,
+	    repv point = make_pos(TX_LINE(tx, VROW(pos)).ln_Strlen - 1,
 				   VROW(pos));
 	    if(insert_gap(tx, VCOL(pos) - VCOL(point),
 			  VCOL(point), VROW(point)))
 	    {
 		undo_record_insertion(tx, point, pos);
-		memset(tx->lines[VROW(pos)].ln_Line + VCOL(point), ' ',
+		memset(LINE_TEXT(&TX_LINE(tx, VROW(pos))) + VCOL(point), ' ',
 		       VCOL(pos) - VCOL(point));
 		return true;
 	    }
@@ -554,11 +874,13 @@ check_section(Lisp_Buffer *tx, repv *start, repv *end)
 	Fsignal(Qinvalid_area, rep_list_3(rep_VAL(tx), *start, *end));
 	return(false);
     }
-    if(VCOL(*start) >= tx->lines[VROW(*start)].ln_Strlen)
-	*start = make_pos(tx->lines[VROW(*start)].ln_Strlen - 1,
+    if(!THAW_LINES(tx))
+	return false;
+    if(VCOL(*start) >= TX_LINE(tx, VROW(*start)).ln_Strlen)
+	*start = make_pos(TX_LINE(tx, VROW(*start)).ln_Strlen - 1,
 			  VROW(*start));
-    if(VCOL(*end) >= tx->lines[VROW(*end)].ln_Strlen)
-	*end = make_pos(tx->lines[VROW(*end)].ln_Strlen - 1, VROW(*end));
+    if(VCOL(*end) >= TX_LINE(tx, VROW(*end)).ln_Strlen)
+	*end = make_pos(TX_LINE(tx, VROW(*end)).ln_Strlen - 1, VROW(*end));
     return true;
 }
 
@@ -576,8 +898,10 @@ check_pos(Lisp_Buffer *tx, repv pos)
 	Fsignal(Qinvalid_pos, rep_list_2(rep_VAL(tx), pos));
 	return 0;
     }
-    if(VCOL(pos) >= tx->lines[VROW(pos)].ln_Strlen)
-	pos = make_pos(tx->lines[VROW(pos)].ln_Strlen - 1, VROW(pos));
+    if(!THAW_LINES(tx))
+	return 0;
+    if(VCOL(pos) >= TX_LINE(tx, VROW(pos)).ln_Strlen)
+	pos = make_pos(TX_LINE(tx, VROW(pos)).ln_Strlen - 1, VROW(pos));
     return pos;
 }
 
@@ -593,7 +917,7 @@ check_line(Lisp_Buffer *tx, repv pos)
 	Fsignal(Qinvalid_pos, rep_list_2(rep_VAL(tx), pos));
 	return false;
     }
-    return true;
+    return THAW_LINES(tx);
 }
 
 /* Check that row LINE is in the current restriction of buffer TX.
@@ -607,7 +931,7 @@ check_row(Lisp_Buffer *tx, intptr_t line)
 	return false;
     }
     else
-	return true;
+	return THAW_LINES(tx);
 }
 
 /* Returns the number of bytes needed to store a section, doesn't include
@@ -619,11 +943,17 @@ section_length(Lisp_Buffer *tx, repv startPos, repv endPos)
     intptr_t length;
     if(VROW(startPos) == VROW(endPos))
 	length = VCOL(endPos) - VCOL(startPos);
+    else if(tx->offset_tree != 0
+	    || VROW(endPos) - VROW(startPos) > SECTION_LOOP_MAX)
+    {
+	length = (row_offset(tx, VROW(endPos)) + VCOL(endPos)
+		  - (row_offset(tx, VROW(startPos)) + VCOL(startPos)));
+    }
     else
     {
-	length = tx->lines[linenum++].ln_Strlen - VCOL(startPos);
-	while(linenum < VROW(endPos))
-	    length += tx->lines[linenum++].ln_Strlen;
+	length = TX_LINE(tx, linenum).ln_Strlen - VCOL(startPos);
+	while(++linenum < VROW(endPos))
+	    length += TX_LINE(tx, linenum).ln_Strlen;
 	length += VCOL(endPos);
     }
     return length;
@@ -639,25 +969,25 @@ copy_section(Lisp_Buffer *tx, repv startPos, repv endPos, char *buff)
     if(VROW(startPos) == VROW(endPos))
     {
 	copylen = VCOL(endPos) - VCOL(startPos);
-	memcpy(buff, tx->lines[linenum].ln_Line + VCOL(startPos), copylen);
+	memcpy(buff, LINE_TEXT(&TX_LINE(tx, linenum)) + VCOL(startPos), copylen);
 	buff[copylen] = 0;
     }
     else
     {
-	copylen = tx->lines[linenum].ln_Strlen - VCOL(startPos) - 1;
-	memcpy(buff, tx->lines[linenum].ln_Line + VCOL(startPos), copylen);
+	copylen = TX_LINE(tx, linenum).ln_Strlen - VCOL(startPos) - 1;
+	memcpy(buff, LINE_TEXT(&TX_LINE(tx, linenum)) + VCOL(startPos), copylen);
 	buff[copylen] = '\n';
 	buff += copylen + 1;
 	linenum++;
 	while(linenum < VROW(endPos))
 	{
-	    copylen = tx->lines[linenum].ln_Strlen - 1;
-	    memcpy(buff, tx->lines[linenum].ln_Line, copylen);
+	    copylen = TX_LINE(tx, linenum).ln_Strlen - 1;
+	    memcpy(buff, LINE_TEXT(&TX_LINE(tx, linenum)), copylen);
 	    buff[copylen] = '\n';
 	    buff += copylen + 1;
 	    linenum++;
 	}
-	memcpy(buff, tx->lines[linenum].ln_Line, VCOL(endPos));
+	memcpy(buff, LINE_TEXT(&TX_LINE(tx, linenum)), VCOL(endPos));
     }
 }
 
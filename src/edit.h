@@ -50,6 +50,32 @@
    while those accessed through Pos * pointers (and PCOL, PROW macros)
    are _read_write_, probably allocated on the stack. */
 
+#if INTPTR_MAX > 0x7fffffffL
+
+/* Where fixnums are wide enough a position is a single fixnum, so that
+   making one allocates nothing. The row is in the high bits and the
+   column, offset by POS_COL_BIAS so that it's never negative, in the
+   low POS_COL_BITS, which means that comparing two positions as numbers
+   orders them row-major, as the conses below do.
+
+   Only fixnums whose row and column are both non-negative count as
+   positions. Any other integer smaller than POS_COL_BIAS in magnitude
+   has a negative row or column, so characters, counts and prefix
+   arguments are never taken for positions. */
+
+#define POS_COL_BITS 32
+#define POS_COL_BIAS ((intptr_t) 1 << (POS_COL_BITS - 1))
+#define POS_COL_MASK (((intptr_t) 1 << POS_COL_BITS) - 1)
+
+#define POSP(v) (rep_INTP(v) && VROW(v) >= 0 && VCOL(v) >= 0)
+#define MAKE_POS(col, row)					\
+    rep_MAKE_INT((intptr_t) (row) * ((intptr_t) 1 << POS_COL_BITS)	\
+		 + ((intptr_t) (col) + POS_COL_BIAS))
+#define VCOL(v) ((rep_INT(v) & POS_COL_MASK) - POS_COL_BIAS)
+#define VROW(v) (rep_INT(v) >> POS_COL_BITS)
+
+#else
+
 #define POSP(v) (rep_CONSP(v) && rep_INTP(rep_CAR(v)) && rep_INTP(rep_CDR(v)))
 
 /* We define the column in the cdr and the row in the car, so that
@@ -60,11 +86,7 @@
 #define VCOL(v) (rep_INT(rep_CDR(v)))
 #define VROW(v) (rep_INT(rep_CAR(v)))
 
-/* These should never be used unless it's clear there can be
-   no other references to V. */
-
-#define VSETCOL(v,c) (rep_CDR(v) = rep_MAKE_INT(c))
-#define VSETROW(v,r) (rep_CAR(v) = rep_MAKE_INT(r))
+#endif
 
 /* These all want repv pointers */
 
@@ -113,25 +135,120 @@ typedef struct {
 
 /* Line structure -- an array of these is in the TX->lines */
 
+/* Strings of up to this many bytes (including the terminator) are
+   stored in the LINE itself, in place of the pointer to the string.
+   It's also the smallest size that the line arena allocates, so a
+   string that's resized without changing its LINE_BUF_SIZE never moves
+   between the two. */
+#define LINE_INLINE_MAX 8
+
 typedef struct LINE {
-    char	   *ln_Line;
-    intptr_t    ln_Strlen;	/* includes '\0' */
+    union {
+	char *heap;
+	char local[LINE_INLINE_MAX];
+    }		ln_Text;	/* always use LINE_TEXT */
+    intptr_t    ln_Strlen;	/* includes '\0' (or '\n' if mapped) */
 } LINE;
 
+/* True if the string of LINE is stored in the LINE itself. */
+#define LINE_INLINE_P(line) ((line)->ln_Strlen <= LINE_INLINE_MAX)
+
+/* The string of LINE. If it's stored inline this is only valid until
+   the line array of the buffer is next resized or its gap moved. */
+#define LINE_TEXT(line)							\
+    (LINE_INLINE_P(line) ? (line)->ln_Text.local : (line)->ln_Text.heap)
+
+/* The array of lines in each buffer is a gap buffer; the unused
+   entries form a gap in front of row TX->line_gap, normally the row
+   of the last insertion or deletion. Always use TX_LINE to get at a
+   row. */
+#define LINE_INDEX(tx, row)					\
+    ((row) < (tx)->line_gap					\
+     ? (row) : (row) + ((tx)->total_lines - (tx)->line_count))
+#define TX_LINE(tx, row) (TX_LINES(tx)[LINE_INDEX(tx, row)])
+
+/* The line array of TX. While the text of a buffer is compressed (see
+   compress.c) it has no line array; THAW_LINES must restore it before
+   the text is used. */
+#define TX_LINES(tx) ((tx)->lines)
+
+/* Make sure the text of TX isn't compressed. False if it couldn't be
+   uncompressed, with an error signalled. */
+#define THAW_LINES(tx) ((tx)->lines != 0 || thaw_line_list(tx))
+
+/* Strings longer than this are allocated individually, anything
+   shorter is rounded up to one of LINE_SIZE_CLASSES sizes. */
+#define LINE_MAX_SMALL 2048
+#define LINE_SIZE_CLASSES 32
+
+struct line_arena_stats {
+    intptr_t line_count;		/* strings currently allocated */
+    intptr_t block_count, block_bytes;	/* blocks of small strings */
+    intptr_t small_bytes;		/*  the part of them in use */
+    intptr_t large_bytes;		/* separately allocated strings */
+    intptr_t mapped_bytes;		/* length of mapped file */
+};
+
+/* Per-buffer storage for line strings, see lines.c */
+
+struct line_arena {
+    struct line_block *blocks;		/* newest first */
+    char *block_ptr, *block_end;	/* unused part of newest block */
+    char *free_list[LINE_SIZE_CLASSES];
+    struct line_large *large;
+    struct line_arena_stats stats;
+
+    /* True while the arena belongs to another thread; its allocations
+       are only added to line_arena_totals by line_arena_merge(). */
+    bool detached;
+
+    /* When non-null, a read-only private mapping of the file that
+       was loaded; lines that haven't been modified point into it. */
+    char *map_base;
+    size_t map_length;
+    dev_t map_dev;
+    ino_t map_ino;
+    bool map_frozen;			/* owned by a line store */
+
+    /* Newest store of strings shared with snapshots, or null */
+    struct line_store *frozen;
+};
+
+/* True if string PTR is part of the file mapped by arena A. Such strings
+   are terminated by the file's newline, not by a zero byte. */
+#define LINE_ARENA_MAPPED_P(a, ptr) \
+    ((uintptr_t) (ptr) - (uintptr_t) (a)->map_base < (a)->map_length)
+
+/* True if the string of LINE in buffer TX mustn't be modified in place,
+   call make_line_writable() before changing it. */
+#define LINE_MAPPED_P(tx, line)						\
+    (!LINE_INLINE_P(line)						\
+     && LINE_ARENA_MAPPED_P(&(tx)->line_arena, (line)->ln_Text.heap))
+
+/* True if the string of LINE in buffer TX is shared with a snapshot,
+   so mustn't be modified in place either. */
+#define LINE_FROZEN_P(tx, line)						\
+    ((tx)->line_arena.frozen != 0 && !LINE_INLINE_P(line)		\
+     && line_arena_frozen_p(&(tx)->line_arena, (line)->ln_Text.heap,	\
+			    (line)->ln_Strlen))
+
 
 /* Each bookmark has one of these */
 
 typedef struct lisp_mark {
     repv car;
 
-    /* When the file is resident this node is linked into its tx_Marks list,
-       otherwise it's in a list of all non-resident marks.  */
+    /* When the file is resident this node is in its buffer's mark
+       index, in slot INDEX of its array, otherwise it's in a list of
+       all non-resident marks.  */
     struct lisp_mark *next;
+    intptr_t index;
 
     /* Linked into the list of all allocated marks */
     struct lisp_mark *next_alloc;
 
-    /* The position of the marked character. */
+    /* The position of the marked character. When resident this may be
+       out of date, see mark_pos() in housekeeping.c */
     repv pos;
 
     /* The file. Either a buffer, or the name of the file. */
@@ -143,9 +260,34 @@ typedef struct lisp_mark {
 
 #define MARK_RESIDENT_P(m) BUFFERP((m)->file)
 
+/* The resident marks of a buffer, sorted by position. Like the line
+   array, MARKS is a gap buffer, with the unused entries in front of
+   index GAP. The rows of the marks from SHIFT_START onwards are all
+   SHIFT_ROWS less than they should be, see housekeeping.c */
+struct mark_index {
+    Lisp_Mark **marks;
+    intptr_t count, allocated;
+    intptr_t gap;
+    intptr_t shift_start, shift_rows;
+};
+
+/* The slot in MI->marks of the mark at index I */
+#define MARK_SLOT(mi, i)					    ((i) < (mi)->gap ? (i) : (i) + ((mi)->allocated - (mi)->count))
+#define MARK_AT(mi, i) ((mi)->marks[MARK_SLOT(mi, i)])
+
 
 /* Extents -- plists for buffer regions */
 
+/* Properties looked up for every extent during redisplay and key
+   lookup, whose values are cached in each extent. */
+enum extent_hot_prop {
+    EXTENT_FACE = 0,
+    EXTENT_MOUSE_FACE,
+    EXTENT_KEYMAP,
+    EXTENT_MOUSE_KEYMAP,
+    EXTENT_HOT_PROPS
+};
+
 typedef struct lisp_extent {
     repv car;
     struct lisp_extent *next;		/* list of allocations */
@@ -157,6 +299,21 @@ typedef struct lisp_extent {
     struct lisp_extent *left_sibling, *right_sibling;
     struct lisp_extent *first_child, *last_child;
 
+    /* The children of each extent are also held in a treap (a randomly
+       balanced binary tree) ordered by position, rooted at CHILD_ROOT,
+       so that the child containing a position can be found without
+       walking the list of siblings. TREE_LEFT, TREE_RIGHT and TREE_UP
+       link the nodes of the treap that this fragment is in.
+
+       TREE_SHIFT is a number of rows still to be added to the positions
+       of this fragment and of every other fragment in its subtree of
+       the treap, so that an edit can move all the children following
+       a row without visiting each one. */
+    struct lisp_extent *child_root;
+    struct lisp_extent *tree_left, *tree_right, *tree_up;
+    uint32_t priority;
+    intptr_t tree_shift;
+
     /* The doubly-linked list of extent fragments making up one ``extent''. */
     struct lisp_extent *frag_next, *frag_pred;
 
@@ -167,9 +324,16 @@ typedef struct lisp_extent {
     repv plist;
     repv locals;			/* alist of (SYMBOL . repv) */
 
+    /* The values `extent-get' returns for the hot properties (so
+       including values inherited from parents). Only valid while
+       HOT_CLOCK matches the clock in extent.c. */
+    repv hot_values[EXTENT_HOT_PROPS];
+    unsigned long hot_clock;
+
     /* The start and end positions of the fragment. Note that the ``row''
        components are relative to the row in which the parent of this
-       fragment begins. */
+       fragment begins, and are only correct after sync_extent() has
+       applied any shifts pending above the fragment in its treap. */
     Pos start, end;
 
 } Lisp_Extent;
@@ -184,14 +348,32 @@ typedef struct lisp_extent {
    set its value in _this_ extent. */
 #define EXTFF_CATCH_VARIABLES	(1 << (rep_CELL16_TYPE_BITS + 2))
 
-#define EXTENT_CACHE_SIZE 4
+#define EXTENT_CACHE_SIZE 16
+
+/* Slots in each view's extent cache kept for lookups at the cursor and
+   at the start of the first displayed line. The others are reused in
+   least-recently-used order. */
+#define EXTENT_CACHE_CURSOR 0
+#define EXTENT_CACHE_ORIGIN 1
 
 struct cached_extent {
     Pos pos;
     Lisp_Extent *extent;
+    uint32_t stamp;			/* tx->extent_stamp when stored */
     uint32_t lru_clock;
 };
 
+/* Each buffer caches recent lookups of buffer-local variables, see
+   extent.c */
+#define LOCAL_VAR_CACHE_SIZE 32
+
+struct cached_local_var {
+    repv symbol;
+    Lisp_Extent *extent;
+    repv cell;				/* (SYMBOL . VALUE) or zero */
+    unsigned long clock;
+};
+
 /* Each window has a list of the extents that are in the current
    contents of the window, and their positions in the character
    grid of the window. */
@@ -250,9 +432,21 @@ typedef struct lisp_buffer {
     repv car;
     struct lisp_buffer *next;
 
-    Lisp_Mark *mark_chain;
+    struct mark_index marks;
     LINE *lines;
     intptr_t line_count, total_lines;	/* text-lines, array-length */
+    intptr_t line_gap;			/* row following the gap */
+
+    /* When non-null the text of the buffer is compressed and LINES is
+       null; LINE_GAP and TOTAL_LINES are then both equal to LINE_COUNT */
+    struct compressed_text *compressed;
+
+    /* Fenwick tree of the lengths of the entries in LINES, or null
+       until it's next needed (see edit.c) */
+    intptr_t *offset_tree;
+
+    /* Where the strings in LINES are allocated from */
+    struct line_arena line_arena;
 
     /* line numbers of `narrowed' region */
     intptr_t logical_start, logical_end;
@@ -273,19 +467,37 @@ typedef struct lisp_buffer {
     int change_count;
     int last_saved_change_count;	/* count at last save */
     int proper_saved_changed_count;	/* at last `proper' save */
+    int compacted_change_count;		/* at last compaction while idle */
     int auto_save_interval;		/* seconds between saves */
     intptr_t last_saved_time;	/* time at last save (auto or user) */
+    intptr_t last_displayed_time;	/* time last shown in a view */
 
     int tab_size;
 
     /* This is an extent covering the _whole_ buffer. */
     Lisp_Extent *global_extent;
-    struct cached_extent extent_cache[EXTENT_CACHE_SIZE];
+    intptr_t extent_count;		/* fragments linked beneath it */
+    uint32_t extent_stamp;		/* advanced when the tree changes */
+
+    /* Recent lookups of local variables in its extents */
+    struct cached_local_var local_var_cache[LOCAL_VAR_CACHE_SIZE];
 
     /* Undo information */
     repv undo_list;
     repv pending_undo_list;
     repv did_undo_list;
+    intptr_t undo_bytes;		/* roughly, see undo.c */
+
+    /* While edits are batched (see undo.c) the text as it was when the
+       batch began, and the rows changed since then: from BATCH_FIRST_ROW
+       up to the last BATCH_TAIL_ROWS rows of the buffer, whose original
+       text is roughly BATCH_BYTES long. BATCH_PENDING is set when the
+       next edit should start a new snapshot. */
+    int batch_depth;
+    int batch_change_count;
+    struct buffer_snapshot *batch_text;
+    intptr_t batch_first_row, batch_tail_rows, batch_bytes;
+    bool batch_pending;
 
     /* Saved state for buffers which are not being displayed.  */
     repv saved_cursor_pos;
@@ -294,6 +506,27 @@ typedef struct lisp_buffer {
     int saved_block_state;
 } Lisp_Buffer;
 
+/* The compressed text of a buffer, see compress.c */
+struct compressed_text {
+    size_t length;			/* bytes of DATA */
+    size_t text_length;			/* bytes once uncompressed */
+    unsigned char data[1];
+};
+
+/* The text of a buffer as it was at one moment, see snapshot.c. Any
+   thread may read it. */
+typedef struct buffer_snapshot {
+    LINE *lines;
+    intptr_t line_count;
+    int change_count;			/* of the buffer when taken */
+    struct line_store *store;		/* holds the strings */
+    char *map_base;			/* the buffer's mapped file, */
+    size_t map_length;			/*  kept alive by STORE */
+    dev_t map_dev;
+    ino_t map_ino;
+    char *map_copy;			/* or our own copy of its lines */
+} Buffer_Snapshot;
+
 /* No recording of undo information */
 #define TXFF_NO_UNDO		(1 << (rep_CELL16_TYPE_BITS + 0))
 
@@ -336,6 +569,9 @@ typedef struct lisp_view {
     Lisp_Extent *pointer_extents[MAX_POINTER_EXTENTS];
     int pointer_extents_count;
 
+    /* Recent lookups of the innermost extent in TX, see extent.c */
+    struct cached_extent extent_cache[EXTENT_CACHE_SIZE];
+
     /* This pane of window starts at glyph (FirstX, FirstY), for
        (MaxX, MaxY) glyphs (not including status line) */
     int min_x, min_y;
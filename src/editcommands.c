@@ -61,11 +61,16 @@ DEFUN("pos", Fpos, Spos, (repv x, repv y), rep_Subr2) /*
 ::doc:pos::
 pos COLUMN ROW
 
-Returns a new position object with coordinates (COLUMN , ROW).
+Returns a new position object with coordinates (COLUMN , ROW). Neither
+may be negative.
 ::end:: */
 {
     intptr_t col = rep_INTP(x) ? rep_INT(x) : VCOL(curr_vw->cursor_pos);
     intptr_t row = rep_INTP(y) ? rep_INT(y) : VROW(curr_vw->cursor_pos);
+    if(col < 0)
+	return rep_signal_arg_error(x, 1);
+    if(row < 0)
+	return rep_signal_arg_error(y, 2);
     return MAKE_POS(col ,row);
 }
 
@@ -343,9 +348,11 @@ unchanged.
 	flag_modification(VBUFFER(tx), start, end);
 	while(linenum < VROW(end))
 	{
-	    int llen = VBUFFER(tx)->lines[linenum].ln_Strlen - 1;
+	    int llen = TX_LINE(VBUFFER(tx), linenum).ln_Strlen - 1;
+	    if(!make_line_writable(VBUFFER(tx), linenum))
+		return 0;
 	    col = (linenum == VROW(start) ? VCOL(start) : 0);
-	    str = VBUFFER(tx)->lines[linenum].ln_Line + col;
+	    str = LINE_TEXT(&TX_LINE(VBUFFER(tx), linenum)) + col;
 	    while(col++ < llen)
 	    {
 		uint8_t c = *str;
@@ -353,8 +360,10 @@ unchanged.
 	    }
 	    linenum++;
 	}
+	if(!make_line_writable(VBUFFER(tx), linenum))
+	    return 0;
 	col = (linenum == VROW(start) ? VCOL(start) : 0);
-	str = VBUFFER(tx)->lines[linenum].ln_Line + col;
+	str = LINE_TEXT(&TX_LINE(VBUFFER(tx), linenum)) + col;
 	while(col++ < VCOL(end))
 	{
 	    uint8_t c = *str;
@@ -379,9 +388,9 @@ at that position, nil is returned.
 	pos = get_buffer_cursor(VBUFFER(tx));
     if(!check_line(VBUFFER(tx), pos))
 	return(Qnil);
-    if(VCOL(pos) >= VBUFFER(tx)->lines[VROW(pos)].ln_Strlen)
+    if(VCOL(pos) >= TX_LINE(VBUFFER(tx), VROW(pos)).ln_Strlen)
 	return(Qnil);
-    else if(VCOL(pos) == VBUFFER(tx)->lines[VROW(pos)].ln_Strlen - 1)
+    else if(VCOL(pos) == TX_LINE(VBUFFER(tx), VROW(pos)).ln_Strlen - 1)
     {
 	if(VROW(pos) == VBUFFER(tx)->logical_end - 1)
 	    return(Qnil);
@@ -389,7 +398,10 @@ at that position, nil is returned.
 	    return(rep_intern_char('\n'));
     }
     else
-	return(rep_intern_char(VBUFFER(tx)->lines[VROW(pos)].ln_Line[VCOL(pos)]));
+    {
+	LINE *line = &TX_LINE(VBUFFER(tx), VROW(pos));
+	return(rep_intern_char(LINE_TEXT(line)[VCOL(pos)]));
+    }
 }
 
 DEFUN_INT("set-char", Fset_char, Sset_char, (repv ch, repv pos, repv tx), rep_Subr3, "cCharacter:") /*
@@ -409,10 +421,11 @@ Sets the character at position POS in BUFFER to CHARACTER.
     if(!check_line(VBUFFER(tx), pos))
 	return(Qnil);
     end = make_pos(VCOL(pos) + 1, VROW(pos));
-    if(pad_pos(VBUFFER(tx), end))
+    if(pad_pos(VBUFFER(tx), end) && make_line_writable(VBUFFER(tx), VROW(pos)))
     {
+	LINE *line = &TX_LINE(VBUFFER(tx), VROW(pos));
 	undo_record_modification(VBUFFER(tx), pos, end);
-	VBUFFER(tx)->lines[VROW(pos)].ln_Line[VCOL(pos)] = rep_CHAR_VALUE(ch);
+	LINE_TEXT(line)[VCOL(pos)] = rep_CHAR_VALUE(ch);
 	flag_modification(VBUFFER(tx), pos, end);
 	return(ch);
     }
@@ -431,6 +444,28 @@ Returns t if ARG is a position object.
     return(Qnil);
 }
 
+DEFUN("pos-col", Fpos_col, Spos_col, (repv pos), rep_Subr1) /*
+::doc:pos-col::
+pos-col POS
+
+Returns the column that the position POS points to.
+::end:: */
+{
+    rep_DECLARE1(pos, POSP);
+    return rep_MAKE_INT(VCOL(pos));
+}
+
+DEFUN("pos-line", Fpos_line, Spos_line, (repv pos), rep_Subr1) /*
+::doc:pos-line::
+pos-line POS
+
+Returns the line number that the position POS points to.
+::end:: */
+{
+    rep_DECLARE1(pos, POSP);
+    return rep_MAKE_INT(VROW(pos));
+}
+
 DEFUN("cursor-pos", Fcursor_pos, Scursor_pos, (void), rep_Subr0) /*
 ::doc:cursor-pos::
 cursor-pos
@@ -455,14 +490,15 @@ empty, ie, blank or only containing spaces.
 	pos = get_buffer_cursor(VBUFFER(tx));
     if(check_line(VBUFFER(tx), pos))
     {
-	if(VBUFFER(tx)->lines[VROW(pos)].ln_Strlen == 1)
+	if(TX_LINE(VBUFFER(tx), VROW(pos)).ln_Strlen == 1)
 	    return(Qt);
 	else
 	{
-	    char *s = VBUFFER(tx)->lines[VROW(pos)].ln_Line;
-	    while(*s && isspace(*s))
+	    char *s = LINE_TEXT(&TX_LINE(VBUFFER(tx), VROW(pos)));
+	    char *end = s + TX_LINE(VBUFFER(tx), VROW(pos)).ln_Strlen - 1;
+	    while(s < end && *s && isspace(*s))
 		s++;
-	    if(!(*s))
+	    if(s == end || !(*s))
 		return(Qt);
 	}
 	return(Qnil);
@@ -480,16 +516,19 @@ pointed to by POS (or the cursor), in BUFFER.
 ::end:: */
 {
     Lisp_View *vw = curr_vw;
-    intptr_t len;
+    intptr_t len, max_len;
     char *line;
     if(!BUFFERP(tx))
 	tx = rep_VAL(vw->tx);
+    if(!THAW_LINES(VBUFFER(tx)))
+	return 0;
     if(POSP(pos) && check_line(VBUFFER(tx), pos))
 	;
     else
 	pos = vw->cursor_pos;
-    line = VBUFFER(tx)->lines[VROW(pos)].ln_Line;
-    for(len = 0; *line && isspace(*line); len++, line++)
+    line = LINE_TEXT(&TX_LINE(VBUFFER(tx), VROW(pos)));
+    max_len = TX_LINE(VBUFFER(tx), VROW(pos)).ln_Strlen - 1;
+    for(len = 0; len < max_len && *line && isspace(*line); len++, line++)
 	;
     len = glyph_col(VBUFFER(tx), len, VROW(pos));
     return make_pos(len, VROW(pos));
@@ -513,13 +552,14 @@ If ONLY-SPACES in non-nil no tab characters are used.
     if(!read_only_pos(VBUFFER(tx), indpos) && check_line(VBUFFER(tx), indpos))
     {
 	intptr_t row = VROW(indpos);
-	char *s = VBUFFER(tx)->lines[row].ln_Line;
+	char *s = LINE_TEXT(&TX_LINE(VBUFFER(tx), row));
+	char *end = s + TX_LINE(VBUFFER(tx), row).ln_Strlen - 1;
 	repv pos = indpos;
 	intptr_t oldind, diff;
 	intptr_t tabs, spaces;
-	while(*s && isspace(*s))
+	while(s < end && *s && isspace(*s))
 	    s++;
-	oldind = s - VBUFFER(tx)->lines[row].ln_Line;
+	oldind = s - LINE_TEXT(&TX_LINE(VBUFFER(tx), row));
 	if(rep_NILP(spaces_p))
 	{
 	    tabs = VCOL(pos) / VBUFFER(tx)->tab_size;
@@ -540,8 +580,9 @@ If ONLY-SPACES in non-nil no tab characters are used.
 	    flag_deletion(VBUFFER(tx), pos, end);
 	    end = make_pos(tabs + spaces, VROW(end));
 	    undo_record_modification(VBUFFER(tx), pos, end);
-	    memset(VBUFFER(tx)->lines[row].ln_Line, '\t', tabs);
-	    memset(VBUFFER(tx)->lines[row].ln_Line + tabs, ' ', spaces);
+	    memset(LINE_TEXT(&TX_LINE(VBUFFER(tx), row)), '\t', tabs);
+	    memset(LINE_TEXT(&TX_LINE(VBUFFER(tx), row)) + tabs,
+			   ' ', spaces);
 	    flag_modification(VBUFFER(tx), pos, end);
 	}
 	else if(diff < 0)
@@ -555,22 +596,26 @@ If ONLY-SPACES in non-nil no tab characters are used.
 	    pos = make_pos(diff, VROW(pos));
 	    end = make_pos(tabs + spaces, VROW(end));
 	    undo_record_modification(VBUFFER(tx), pos, end);
-	    memset(VBUFFER(tx)->lines[row].ln_Line, '\t', tabs);
-	    memset(VBUFFER(tx)->lines[row].ln_Line + tabs, ' ', spaces);
+	    memset(LINE_TEXT(&TX_LINE(VBUFFER(tx), row)), '\t', tabs);
+	    memset(LINE_TEXT(&TX_LINE(VBUFFER(tx), row)) + tabs,
+			   ' ', spaces);
 	    flag_modification(VBUFFER(tx), pos, end);
 	}
 	else
 	{
-	    char *s = VBUFFER(tx)->lines[row].ln_Line;
+	    char *s = LINE_TEXT(&TX_LINE(VBUFFER(tx), row));
 	    intptr_t i;
 	    repv end = make_pos(tabs + spaces, VROW(pos));
 	    for(i = 0; i < tabs; i++)
 	    {
 		if(*s++ != '\t')
 		{
+		    if(!make_line_writable(VBUFFER(tx), row))
+			return 0;
 		    undo_record_modification(VBUFFER(tx), pos, end);
-		    memset(VBUFFER(tx)->lines[row].ln_Line, '\t', tabs);
-		    memset(VBUFFER(tx)->lines[row].ln_Line + tabs, ' ', spaces);
+		    memset(LINE_TEXT(&TX_LINE(VBUFFER(tx), row)), '\t', tabs);
+		    memset(LINE_TEXT(&TX_LINE(VBUFFER(tx), row)) + tabs,
+			   ' ', spaces);
 		    flag_modification(VBUFFER(tx), pos, end);
 		    return indpos;
 		}
@@ -579,9 +624,12 @@ If ONLY-SPACES in non-nil no tab characters are used.
 	    {
 		if(*s++ != ' ')
 		{
+		    if(!make_line_writable(VBUFFER(tx), row))
+			return 0;
 		    pos = make_pos(tabs, VROW(pos));
 		    undo_record_modification(VBUFFER(tx), pos, end);
-		    memset(VBUFFER(tx)->lines[row].ln_Line + tabs, ' ', spaces);
+		    memset(LINE_TEXT(&TX_LINE(VBUFFER(tx), row)) + tabs,
+			   ' ', spaces);
 		    flag_modification(VBUFFER(tx), pos, end);
 		    return indpos;
 		}
@@ -631,7 +679,7 @@ COLUMN counts from zero.
 	    repv tmp = vw->cursor_pos;
 	    if(insert_gap(tx, spaces + tabs, VCOL(tmp), VROW(tmp)))
 	    {
-		char *line = tx->lines[VROW(tmp)].ln_Line;
+		char *line = LINE_TEXT(&TX_LINE(tx, VROW(tmp)));
 		memset(line + VCOL(tmp), '\t', tabs);
 		memset(line + VCOL(tmp) + tabs, ' ', spaces);
 		undo_record_insertion(tx, tmp, vw->cursor_pos);
@@ -655,6 +703,8 @@ any restriction on the buffer.
     repv start, end;
     if(!BUFFERP(tx))
 	tx = rep_VAL(curr_vw->tx);
+    if(!THAW_LINES(VBUFFER(tx)))
+	return 0;
     Funrestrict_buffer(tx);
     start = make_pos(0, 0);
     end = Fend_of_buffer(rep_VAL(tx), Qt);
@@ -676,19 +726,12 @@ Returns the number of characters (counting from zero) that POS (or the cursor)
 is from the beginning of the buffer.
 ::end:: */
 {
-    intptr_t offset, line_num;
     if(!BUFFERP(tx))
 	tx = rep_VAL(curr_vw->tx);
     if(!POSP(pos))
 	pos = get_buffer_cursor(VBUFFER(tx));
     if(check_pos(VBUFFER(tx), pos))
-    {
-	offset = 0;
-	for(line_num = 0; line_num < VROW(pos); line_num++)
-	    offset += VBUFFER(tx)->lines[line_num].ln_Strlen;
-	offset += VCOL(pos);
-	return rep_MAKE_INT(offset);
-    }
+	return rep_MAKE_INT(row_offset(VBUFFER(tx), VROW(pos)) + VCOL(pos));
     else
 	return 0;
 }
@@ -698,18 +741,16 @@ DEFUN("offset-to-pos", Foffset_to_pos, Soffset_to_pos, (repv voffset, repv tx),
 offset-to-pos OFFSET [BUFFER]
 
 Returns the position which is OFFSET characters from the start of the buffer.
+Offsets outside the buffer give its start or end.
 ::end:: */
 {
-    intptr_t offset;
     intptr_t col, row;
     rep_DECLARE1(voffset, rep_INTP);
-    offset = rep_INT(voffset);
     if(!BUFFERP(tx))
 	tx = rep_VAL(curr_vw->tx);
-    row = 0;
-    while(offset >= VBUFFER(tx)->lines[row].ln_Strlen)
-	offset -= VBUFFER(tx)->lines[row++].ln_Strlen;
-    col = offset;
+    if(!THAW_LINES(VBUFFER(tx)))
+	return 0;
+    row = offset_row(VBUFFER(tx), rep_INT(voffset), &col);
     return make_pos(col, row);
 }
 
@@ -808,6 +849,8 @@ edit_init(void)
     rep_ADD_SUBR(Sget_char);
     rep_ADD_SUBR_INT(Sset_char);
     rep_ADD_SUBR(Sposp);
+    rep_ADD_SUBR(Spos_col);
+    rep_ADD_SUBR(Spos_line);
     rep_ADD_SUBR(Scursor_pos);
     rep_ADD_SUBR(Sempty_line_p);
     rep_ADD_SUBR(Sindent_pos);
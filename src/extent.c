@@ -23,6 +23,7 @@
 #include <setjmp.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 #ifdef NEED_MEMORY_H
 # include <memory.h>
 #endif
@@ -38,6 +39,14 @@ int extent_type;
 
 static Lisp_Extent *allocated_extents;
 
+/* Advanced whenever the cached hot property values of any extent may
+   have changed, see extent_hot_property(). */
+static unsigned long hot_props_clock = 1;
+
+/* Advanced whenever the binding that a lookup of a local variable in
+   an extent would find may have changed, see local_variable_cell(). */
+static unsigned long local_vars_clock = 1;
+
 #ifdef DEBUG
 static void
 assert_invariants (Lisp_Extent *e)
@@ -50,6 +59,9 @@ assert_invariants (Lisp_Extent *e)
     assert (e->last_child == 0 || e->last_child->parent == e);
     assert (e->frag_pred == 0 || e->frag_pred->frag_next == e);
     assert (e->frag_next == 0 || e->frag_next->frag_pred == e);
+    assert (e->tree_left == 0 || e->tree_left->tree_up == e);
+    assert (e->tree_right == 0 || e->tree_right->tree_up == e);
+    assert (e->child_root == 0 || e->child_root->tree_up == 0);
 }
 #else
 # define assert_invariants(e) do { } while (0)
@@ -62,14 +74,29 @@ clean_node(Lisp_Extent *e)
     e->parent = 0;
     e->left_sibling = e->right_sibling = 0;
     e->first_child = e->last_child = 0;
+    e->child_root = 0;
+    e->tree_left = e->tree_right = e->tree_up = 0;
+    e->tree_shift = 0;
     e->frag_next = e->frag_pred = 0;
 }
 
+/* Return a pseudo-random priority for a new treap node. */
+static uint32_t
+extent_priority(void)
+{
+    static uint32_t seed = 2463534242U;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
 /* Create a new extent. All links are null. If CLONEE is non-null, copy
    the START, END, TX and PLIST fields from it. */
 static Lisp_Extent *
 alloc_extent(Lisp_Extent *clonee)
 {
+    int i;
     Lisp_Extent *x = rep_alloc(sizeof(Lisp_Extent));
     if(x == 0)
     {
@@ -81,6 +108,10 @@ alloc_extent(Lisp_Extent *clonee)
     x->next = allocated_extents;
     allocated_extents = x;
     clean_node(x);
+    x->priority = extent_priority();
+    x->hot_clock = 0;
+    for(i = 0; i < EXTENT_HOT_PROPS; i++)
+	x->hot_values[i] = Qnil;
 
     if(clonee != 0)
     {
@@ -127,25 +158,261 @@ find_last_frag(Lisp_Extent *e)
     return e;
 }
 
+
+/* Treaps of children. Siblings never overlap, so their start and end
+   positions both increase from left to right, and the treap can be
+   searched by either. Nodes are only ever placed relative to each
+   other, never by comparing positions, so zero-length fragments are
+   no problem.
+
+   Inserting or deleting rows moves every child after the edit by the
+   same number of rows. Instead of rewriting each of them, the shift is
+   added to the TREE_SHIFT fields of the O(log n) treap nodes whose
+   subtrees hold those children, and pushed down towards the leaves as
+   the treap is searched or rebalanced. The START and END of a fragment
+   may only be used once no shift is pending above it, i.e. after
+   searching down to it with find_child() or calling sync_extent(). */
+
+/* Apply the row shift pending at treap node E to E, leaving the rest
+   of it with E's subtrees. */
+static inline void
+push_tree_shift(Lisp_Extent *e)
+{
+    intptr_t shift = e->tree_shift;
+    if(shift != 0)
+    {
+	e->start.row += shift;
+	e->end.row += shift;
+	if(e->tree_left != 0)
+	    e->tree_left->tree_shift += shift;
+	if(e->tree_right != 0)
+	    e->tree_right->tree_shift += shift;
+	e->tree_shift = 0;
+    }
+}
+
+/* Bring the position of fragment E (which may be null) up to date by
+   applying the shifts pending above it in the treap of its siblings.
+   Returns E. */
+Lisp_Extent *
+sync_extent(Lisp_Extent *e)
+{
+    if(e != 0)
+    {
+	if(e->tree_up != 0)
+	    sync_extent(e->tree_up);
+	push_tree_shift(e);
+    }
+    return e;
+}
+
+/* Apply every shift pending in the treap rooted at X. */
+static void
+flush_tree_shifts(Lisp_Extent *x)
+{
+    while(x != 0)
+    {
+	push_tree_shift(x);
+	flush_tree_shifts(x->tree_left);
+	x = x->tree_right;
+    }
+}
+
+/* Move X, and every sibling following X, by DELTA rows. */
+static void
+shift_extents(Lisp_Extent *x, intptr_t delta)
+{
+    Lisp_Extent *up;
+    x->start.row += delta;
+    x->end.row += delta;
+    if(x->tree_right != 0)
+	x->tree_right->tree_shift += delta;
+    for(up = x->tree_up; up != 0; x = up, up = up->tree_up)
+    {
+	if(up->tree_left == x)
+	{
+	    /* UP and its right subtree follow X */
+	    up->start.row += delta;
+	    up->end.row += delta;
+	    if(up->tree_right != 0)
+		up->tree_right->tree_shift += delta;
+	}
+    }
+}
+
+/* Make NEW take the place of OLD, the child of UP, in the treap of
+   PARENT's children. UP is null if OLD is the root of the treap. */
+static inline void
+replace_tree_node(Lisp_Extent *parent, Lisp_Extent *up,
+		  Lisp_Extent *old, Lisp_Extent *new)
+{
+    if(up == 0)
+	parent->child_root = new;
+    else if(up->tree_left == old)
+	up->tree_left = new;
+    else
+	up->tree_right = new;
+    if(new != 0)
+	new->tree_up = up;
+}
+
+/* Rotate X above its parent node in the treap of PARENT's children. */
+static void
+rotate_up(Lisp_Extent *parent, Lisp_Extent *x)
+{
+    Lisp_Extent *up = x->tree_up;
+    /* The subtrees of X and UP are about to change. */
+    push_tree_shift(up);
+    push_tree_shift(x);
+    replace_tree_node(parent, up->tree_up, up, x);
+    if(up->tree_left == x)
+    {
+	up->tree_left = x->tree_right;
+	if(up->tree_left != 0)
+	    up->tree_left->tree_up = up;
+	x->tree_right = up;
+    }
+    else
+    {
+	up->tree_right = x->tree_left;
+	if(up->tree_right != 0)
+	    up->tree_right->tree_up = up;
+	x->tree_left = up;
+    }
+    up->tree_up = x;
+}
+
+/* Add E to the treap of PARENT's children, immediately before the
+   child BEFORE, or after all other children if BEFORE is null. */
+static void
+tree_link(Lisp_Extent *parent, Lisp_Extent *e, Lisp_Extent *before)
+{
+    Lisp_Extent *x;
+    e->tree_left = e->tree_right = 0;
+    if(before != 0 && before->tree_left == 0)
+    {
+	x = sync_extent(before);
+	x->tree_left = e;
+    }
+    else
+    {
+	x = (before != 0) ? before->tree_left : parent->child_root;
+	if(x == 0)
+	{
+	    parent->child_root = e;
+	    e->tree_up = 0;
+	    return;
+	}
+	while(x->tree_right != 0)
+	    x = x->tree_right;
+	/* No shifts may be pending above E. */
+	sync_extent(x);
+	x->tree_right = e;
+    }
+    e->tree_up = x;
+    while(e->tree_up != 0 && e->tree_up->priority < e->priority)
+	rotate_up(parent, e);
+}
+
+/* Remove E from the treap of PARENT's children. */
+static void
+tree_unlink(Lisp_Extent *parent, Lisp_Extent *e)
+{
+    sync_extent(e);
+    while(e->tree_left != 0 && e->tree_right != 0)
+    {
+	rotate_up(parent, (e->tree_left->priority > e->tree_right->priority
+			   ? e->tree_left : e->tree_right));
+    }
+    replace_tree_node(parent, e->tree_up, e,
+		      e->tree_left != 0 ? e->tree_left : e->tree_right);
+    e->tree_left = e->tree_right = e->tree_up = 0;
+}
+
+/* Return the first child of PARENT that ends after POS, or null. The
+   row of POS is relative to the first row of PARENT. */
+static Lisp_Extent *
+find_child(Lisp_Extent *parent, Pos *pos)
+{
+    Lisp_Extent *x = parent->child_root, *found = 0;
+    while(x != 0)
+    {
+	push_tree_shift(x);
+	if(PPOS_GREATER_P(&x->end, pos))
+	{
+	    found = x;
+	    x = x->tree_left;
+	}
+	else
+	    x = x->tree_right;
+    }
+    return found;
+}
+
+/* Return the first child of PARENT whose last row is ROW or later,
+   where ROW is relative to the first row of PARENT. */
+static inline Lisp_Extent *
+find_child_row(Lisp_Extent *parent, intptr_t row)
+{
+    Pos pos;
+    pos.col = -1;
+    pos.row = row;
+    return find_child(parent, &pos);
+}
+
 /* For two adjacent fragments at the same level, LEFT and RIGHT, attempt
    to join them into a single fragment. Always absorbs RIGHT into LEFT,
    never LEFT into RIGHT. */
 static void
 try_to_coalesce(Lisp_Extent *left, Lisp_Extent *right)
 {
+    sync_extent(left);
+    sync_extent(right);
     if(left->frag_next == right
        && left->parent == right->parent
        && PPOS_GREATER_EQUAL_P(&left->end, &right->start))
     {
 	/* Yep. These two can be united. */
 
+	Lisp_Extent *x;
+
+	tree_unlink(left->parent, right);
+	hot_props_clock++;
+	local_vars_clock++;
 	left->right_sibling = right->right_sibling;
+	if(left->right_sibling != 0)
+	    left->right_sibling->left_sibling = left;
 	left->end = right->end;
+	left->car = ((left->car & ~EXTFF_OPEN_END)
+		     | (right->car & EXTFF_OPEN_END));
 	if(left->parent->last_child == right)
 	    left->parent->last_child = left;
 	left->frag_next = right->frag_next;
+	if(left->frag_next != 0)
+	    left->frag_next->frag_pred = left;
+
+	/* RIGHT's children follow LEFT's */
+	flush_tree_shifts(right->child_root);
+	for(x = right->first_child; x != 0; x = x->right_sibling)
+	{
+	    x->start.row += right->start.row - left->start.row;
+	    x->end.row += right->start.row - left->start.row;
+	    x->parent = left;
+	    tree_link(left, x, 0);
+	}
+	if(right->first_child != 0)
+	{
+	    right->first_child->left_sibling = left->last_child;
+	    if(left->last_child != 0)
+		left->last_child->right_sibling = right->first_child;
+	    else
+		left->first_child = right->first_child;
+	    left->last_child = right->last_child;
+	}
 
 	clean_node(right);
+	right->tx->extent_count--;
+	right->tx->extent_stamp++;
 	
 	assert_invariants (left);
 	assert_invariants (right);
@@ -167,6 +434,13 @@ unlink_extent_fragment(Lisp_Extent *e)
     assert_invariants (e->frag_next);
     assert_invariants (e->frag_pred);
 
+    tree_unlink(e->parent, e);
+
+    /* Properties and variables cached in E and its children may have
+       been inherited through E's parent. */
+    hot_props_clock++;
+    local_vars_clock++;
+
     if(e->first_child != 0)
     {
 	/* Replace E by its children. */
@@ -174,11 +448,13 @@ unlink_extent_fragment(Lisp_Extent *e)
 	Lisp_Extent *x;
 
 	/* Fix positions and parents.. */
+	flush_tree_shifts(e->child_root);
 	for(x = e->first_child; x != 0; x = x->right_sibling)
 	{
 	    x->start.row += e->start.row;
 	    x->end.row += e->start.row;
 	    x->parent = e->parent;
+	    tree_link(e->parent, x, e->right_sibling);
 	    assert_invariants (x);
 	}
 
@@ -227,6 +503,8 @@ unlink_extent_fragment(Lisp_Extent *e)
 	assert_invariants (e->last_child);
     }
     clean_node(e);
+    e->tx->extent_count--;
+    e->tx->extent_stamp++;
 }
 
 /* Unlink extent E (and all fragments chained off it). */
@@ -273,7 +551,8 @@ insert_extent(Lisp_Extent *e, Lisp_Extent *root)
 {
     Lisp_Extent *x;
 top:
-    x = root->first_child;
+    /* Children that end before E starts can be skipped. */
+    x = find_child(root, &e->start);
     while(x != 0)
     {
 	if(PPOS_LESS_EQUAL_P(&e->end, &x->start))
@@ -281,6 +560,9 @@ top:
 	    /* Insert E before X */
 
 	    e->parent = root;
+	    e->tx->extent_count++;
+	    e->tx->extent_stamp++;
+	    tree_link(root, e, x);
 	    e->left_sibling = x->left_sibling;
 	    if(e->left_sibling != 0)
 		e->left_sibling->right_sibling = e;
@@ -369,11 +651,14 @@ top:
 	{
 	    /* X ends before E starts, keep going.. */
 	}
-	x = x->right_sibling;
+	x = sync_extent(x->right_sibling);
     }
 
     /* Insert e at the end of the root. */
     e->parent = root;
+    e->tx->extent_count++;
+    e->tx->extent_stamp++;
+    tree_link(root, e, 0);
     e->left_sibling = root->last_child;
     if(root->last_child != 0)
 	root->last_child->right_sibling = e;
@@ -385,106 +670,160 @@ top:
     assert_invariants (root);
 }
 
-/* Find the global offset of the first row of extent E. */
+/* Find the global offset of the first row of the parent of extent E.
+   Also brings the positions of E and its parents up to date. */
 static intptr_t
 row_delta(Lisp_Extent *e)
 {
     intptr_t delta = 0;
     if(e != 0)
     {
+	sync_extent(e);
 	e = e->parent;
 	while(e != 0)
 	{
-	    delta += e->start.row;
+	    delta += sync_extent(e)->start.row;
 	    e = e->parent;
 	}
     }
     return delta;
 }
 
+/* Return the innermost extent containing POS, searching downwards
+   from ROOT, which should contain POS. */
 Lisp_Extent *
 find_extent_forwards(Lisp_Extent *root, Pos *pos)
 {
-    Lisp_Extent *x = root;
+    Lisp_Extent *x;
     Pos copy = *pos;
     copy.row -= row_delta(root);
-    while(x != 0)
+    copy.row -= root->start.row;
+    while((x = find_child(root, &copy)) != 0
+	  && PPOS_GREATER_EQUAL_P(&copy, &x->start))
     {
-	if(PPOS_GREATER_EQUAL_P(&copy, &x->start)
-	   && PPOS_LESS_P(&copy, &x->end))
-	{
-	    /* POS in X somewhere. */
-	    root = x;
-	    copy.row -= x->start.row;
-	    x = x->first_child;
-	    continue;
-	}
-	x = x->right_sibling;
+	/* POS in X somewhere. */
 	assert_invariants (x);
+	root = x;
+	copy.row -= x->start.row;
     }
     return root;
 }
 
+/* Return the first child of E that ends after POS (an absolute
+   position), or null if no children end after POS. */
+Lisp_Extent *
+find_extent_child(Lisp_Extent *e, Pos *pos)
+{
+    Pos copy = *pos;
+    copy.row -= row_delta(e);
+    copy.row -= e->start.row;
+    return find_child(e, &copy);
+}
+
+/* Each view caches the results of recent lookups in its buffer, as
+   pairs (POS, EXTENT) where EXTENT was the innermost extent containing
+   POS. Each entry also records the buffer's extent_stamp, which is
+   advanced whenever an extent is linked or unlinked, so an entry whose
+   stamp is current is used directly.
+
+   Edits move the cached positions along with the text and the extents
+   (see housekeeping.c), so they don't change which extent contains a
+   cached position, except for positions in or at the end of deleted
+   text. Housekeeping marks those entries stale.
+
+   A stale entry is only a place to start searching from: if the
+   extent of any entry is still linked and still contains POS, the
+   search carries on downwards from the innermost of them. The cache is
+   emptied when the view shows another buffer. */
+
 /* Cache stats */
-static int extent_cache_misses, extent_cache_hits, extent_cache_near_misses;
+static unsigned long extent_cache_misses, extent_cache_hits;
+static unsigned long extent_cache_near_misses;
+static uint32_t lru_time;
+
+/* Return the view whose extent cache is used for lookups in TX, or
+   null if TX isn't in any view. */
+static Lisp_View *
+extent_cache_view(Lisp_Buffer *tx)
+{
+    Lisp_View *vw;
+    if(curr_vw != 0 && curr_vw->tx == tx)
+	return curr_vw;
+    for(vw = view_chain; vw != 0; vw = vw->next)
+    {
+	if(vw->tx == tx)
+	    return vw;
+    }
+    return 0;
+}
 
-/* Return the innermost extent containing position POS. */
+/* If the extent of cache entry CE is still in the tree of TX and
+   contains POS, return its depth in the tree, otherwise -1. */
+static int
+cached_extent_depth(Lisp_Buffer *tx, struct cached_extent *ce, Pos *pos)
+{
+    Lisp_Extent *e = ce->extent, *x;
+    Pos copy;
+    int depth = 0;
+
+    if(e == 0 || e->tx != tx
+       || (e->parent == 0 && e != tx->global_extent))
+	return -1;
+
+    copy = *pos;
+    copy.row -= row_delta(e);
+    for(x = e->parent; x != 0; x = x->parent)
+	depth++;
+    if(PPOS_LESS_P(&copy, &e->start) || PPOS_GREATER_EQUAL_P(&copy, &e->end))
+	return -1;
+    return depth;
+}
+
+/* Return the innermost extent containing position POS in the buffer
+   of view VW, using VW's extent cache. */
 Lisp_Extent *
-find_extent(Lisp_Extent *root, Pos *pos)
+find_view_extent(Lisp_View *vw, Pos *pos)
 {
-    Lisp_Buffer *tx = root->tx;
-    int i, out = -1, oldest = 0;
-    uint32_t oldest_lru = UINT32_MAX;
-    static uint32_t lru_time;
+    Lisp_Buffer *tx = vw->tx;
+    struct cached_extent *ce, *best = 0, *slot = 0;
+    int i, depth, best_depth = -1;
     Lisp_Extent *x;
 
-    /* First check the cache. */
-    for(i = 0; i < EXTENT_CACHE_SIZE; i++)
+    for(i = 0, ce = vw->extent_cache; i < EXTENT_CACHE_SIZE; i++, ce++)
     {
-	struct cached_extent *ce = &tx->extent_cache[i];
-	if(ce->extent)
+	if(ce->extent != 0 && PPOS_EQUAL_P(pos, &ce->pos))
 	{
-	    if(PPOS_EQUAL_P(pos, &ce->pos))
-	    {
-		/* Bingo! direct hit */
-		extent_cache_hits++;
-		ce->lru_clock = ++lru_time;
-		return ce->extent;
-	    }
-	    else
-	    {
-		intptr_t delta = row_delta(ce->extent);
-		if((pos->row > ce->extent->start.row + delta
-		    || (pos->row == ce->extent->start.row + delta
-			&& pos->col >= ce->extent->start.col))
-		   && (pos->row < ce->extent->end.row + delta
-		       || (pos->row == ce->extent->end.row + delta
-			   && pos->col < ce->extent->end.col)))
-		{
-		    /* Not direct. But ce[i] contains POS. If this isn't
-		       the only item containing POS, use the innermost. */
-		    if(out == -1)
-			out = i;
-		    /* FIXME: check which is innermost.. */
-		}
-		if(ce->lru_clock < oldest_lru)
-		{
-		    oldest = i;
-		    oldest_lru = ce->lru_clock;
-		}
-	    }
+	    slot = ce;
+	    break;
 	}
-	else
+    }
+
+    if(slot != 0 && slot->stamp == tx->extent_stamp)
+    {
+	/* Bingo! direct hit */
+	extent_cache_hits++;
+	slot->lru_clock = ++lru_time;
+	return slot->extent;
+    }
+
+    for(i = 0, ce = vw->extent_cache; i < EXTENT_CACHE_SIZE; i++, ce++)
+    {
+	if(ce->extent == 0 || (best != 0 && ce->extent == best->extent))
+	    continue;
+	depth = cached_extent_depth(tx, ce, pos);
+	if(depth > best_depth)
 	{
-	    oldest = i;
-	    oldest_lru = 0;
+	    best = ce;
+	    best_depth = depth;
 	}
     }
-    /* No direct hits. Any containing POS. */
-    if(out >= 0)
+
+    if(best != 0)
     {
+	/* Not direct, but the search starts from the innermost
+	   cached extent containing POS. */
 	extent_cache_near_misses++;
-	x = find_extent_forwards(tx->extent_cache[out].extent, pos);
+	x = find_extent_forwards(best->extent, pos);
     }
     else
     {
@@ -492,15 +831,71 @@ find_extent(Lisp_Extent *root, Pos *pos)
 	x = find_extent_forwards(tx->global_extent, pos);
     }
 
-    /* Add X to the cache in place of OLDEST. */
-    tx->extent_cache[oldest].extent = x;
-    tx->extent_cache[oldest].pos = *pos;
-    tx->extent_cache[oldest].lru_clock = ++lru_time;
+    /* Store X in the entry already keyed on POS, or in the slot kept
+       for the cursor or display origin, or else in place of the
+       least recently used entry. */
+    if(slot == 0)
+    {
+	if(pos->row == VROW(vw->cursor_pos)
+	   && pos->col == VCOL(vw->cursor_pos))
+	    slot = &vw->extent_cache[EXTENT_CACHE_CURSOR];
+	else if(pos->row == VROW(vw->display_origin) && pos->col == 0)
+	    slot = &vw->extent_cache[EXTENT_CACHE_ORIGIN];
+	else
+	{
+	    for(i = EXTENT_CACHE_ORIGIN + 1; i < EXTENT_CACHE_SIZE; i++)
+	    {
+		ce = &vw->extent_cache[i];
+		if(ce->extent == 0)
+		{
+		    slot = ce;
+		    break;
+		}
+		if(slot == 0 || ce->lru_clock < slot->lru_clock)
+		    slot = ce;
+	    }
+	}
+    }
+    slot->extent = x;
+    slot->pos = *pos;
+    slot->stamp = tx->extent_stamp;
+    slot->lru_clock = ++lru_time;
 
     assert_invariants (x);
     return x;
 }
 
+/* Return the innermost extent containing position POS. */
+Lisp_Extent *
+find_extent(Lisp_Extent *root, Pos *pos)
+{
+    Lisp_View *vw = extent_cache_view(root->tx);
+    if(vw != 0 && root == root->tx->global_extent)
+	return find_view_extent(vw, pos);
+    else
+	return find_extent_forwards(root, pos);
+}
+
+/* Empty the extent cache of view VW, when it's about to show a
+   different buffer. */
+void
+clear_extent_cache(Lisp_View *vw)
+{
+    int i;
+    for(i = 0; i < EXTENT_CACHE_SIZE; i++)
+	vw->extent_cache[i].extent = 0;
+}
+
+/* Mark the extents in the cache of view VW. Entries may refer to
+   extents that have been unlinked from the view's buffer. */
+void
+mark_extent_cache(Lisp_View *vw)
+{
+    int i;
+    for(i = 0; i < EXTENT_CACHE_SIZE; i++)
+	rep_MARKVAL(rep_VAL(vw->extent_cache[i].extent));
+}
+
 /* Map the function MAP_FUNC(E, DATA) over all innermost extents E
    containing part of the section of TX specified by START, END.
    This function can be (and is) safely longjmp'd through. */
@@ -508,9 +903,9 @@ void
 map_section_extents(void (*map_func)(Lisp_Extent *x, void *data),
 		    Lisp_Extent *root, Pos *start, Pos *end, void *data)
 {
-    Lisp_Extent *x = find_extent(root, start);
+    Lisp_Extent *x = find_extent(root, start), *child;
     Pos s_copy = *start, e_copy = *end;
-    intptr_t delta = row_delta(x->parent);
+    intptr_t delta = row_delta(x);
     s_copy.row -= delta; e_copy.row -= delta;
 
     while(x != 0 && PPOS_LESS_P(&x->start, &e_copy))
@@ -523,37 +918,32 @@ map_section_extents(void (*map_func)(Lisp_Extent *x, void *data),
 	    map_func(x, data);
 	}
 
-	/* Try to work downwards and rightwards as much as possible */
-	if(x->first_child != 0)
+	/* Try to work downwards and rightwards as much as possible.
+	   Children of X that end before the section starts needn't be
+	   visited at all. */
+	s_copy.row -= x->start.row;
+	child = find_child(x, &s_copy);
+	if(child != 0)
 	{
 	    /* Map though X's children as well. */
-	    s_copy.row -= x->start.row;
 	    e_copy.row -= x->start.row;
-	    x = x->first_child;
+	    x = child;
 	}
-	else if(x->right_sibling != 0)
-	    x = x->right_sibling;
-	else if(x->parent != 0)
+	else
 	{
-	    s_copy.row += x->parent->start.row;
-	    e_copy.row += x->parent->start.row;
-	    x = x->parent->right_sibling;
+	    s_copy.row += x->start.row;
+	    while(x->right_sibling == 0 && x->parent != 0)
+	    {
+		x = x->parent;
+		s_copy.row += x->start.row;
+		e_copy.row += x->start.row;
+	    }
+	    x = sync_extent(x->right_sibling);
 	}
-	else
-	    break;
 	assert_invariants (x);
     }
 }
 
-/* Notify the cache that some extents in TX were changed. */
-static inline void
-invalidate_extent_cache(Lisp_Buffer *tx)
-{
-    int i;
-    for(i = 0; i < EXTENT_CACHE_SIZE; i++)
-	tx->extent_cache[i].extent = 0;
-}
-
 /* Create the all-encompassing root extent for buffer TX. */
 void
 make_global_extent(Lisp_Buffer *tx)
@@ -572,9 +962,9 @@ reset_global_extent(Lisp_Buffer *tx)
     e->start.row = 0;
     e->start.col = 0;
     e->end.row = tx->line_count;
-    e->end.col = tx->lines[tx->line_count-1].ln_Strlen - 1;
+    e->end.col = TX_LINE(tx, tx->line_count-1).ln_Strlen - 1;
     e->car = extent_type | EXTFF_OPEN_START | EXTFF_OPEN_END;
-    invalidate_extent_cache(tx);
+    tx->extent_stamp++;
 }
 
 
@@ -614,11 +1004,110 @@ will work reliably however.
     extent->locals = Qnil;
 
     insert_extent(extent, tx->global_extent);
-    invalidate_extent_cache(tx);
 
     return rep_VAL(extent);
 }
 
+/* Used by make-extents to sort the new extents. */
+struct new_extent {
+    Lisp_Extent *extent;
+    intptr_t index;
+};
+
+/* Order new extents by their start positions, putting the longer of
+   two extents with the same start first, so that extents are always
+   inserted before the extents they contain. */
+static int
+compare_new_extents(const void *a, const void *b)
+{
+    const struct new_extent *x = a, *y = b;
+    if(PPOS_LESS_P(&x->extent->start, &y->extent->start))
+	return -1;
+    else if(PPOS_GREATER_P(&x->extent->start, &y->extent->start))
+	return 1;
+    else if(PPOS_GREATER_P(&x->extent->end, &y->extent->end))
+	return -1;
+    else if(PPOS_LESS_P(&x->extent->end, &y->extent->end))
+	return 1;
+    else
+	return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+DEFUN("make-extents", Fmake_extents, Smake_extents,
+      (repv entries), rep_Subr1) /*
+::doc:make-extents::
+make-extents ENTRIES
+
+Create an extent in the current buffer for each element of the vector
+ENTRIES, a list (START END [PLIST]), and return a vector of the new
+extents in the same order.
+
+This is much faster than calling `make-extent' for each region. The
+extents are added outermost first, so that an extent lying within
+another always becomes its child, whatever the order of ENTRIES.
+::end:: */
+{
+    Lisp_Buffer *tx = curr_vw->tx;
+    struct new_extent *sorted;
+    intptr_t i, n;
+    repv ret;
+
+    rep_DECLARE1(entries, rep_VECTORP);
+    n = rep_VECTOR_LEN(entries);
+
+    /* Check everything before changing anything. */
+    for(i = 0; i < n; i++)
+    {
+	repv entry = rep_VECTI(entries, i), start, end;
+	if(!rep_CONSP(entry) || !rep_CONSP(rep_CDR(entry)))
+	    return rep_signal_arg_error(entries, 1);
+	start = rep_CAR(entry);
+	end = rep_CAR(rep_CDR(entry));
+	if(!POSP(start) || !POSP(end))
+	    return rep_signal_arg_error(entries, 1);
+	if(VROW(start) < 0 || VROW(start) >= tx->line_count
+	   || VROW(end) < 0 || VROW(end) >= tx->line_count
+	   || POS_GREATER_P(start, end))
+	    return Fsignal(Qinvalid_pos, rep_list_2(start, end));
+    }
+
+    ret = Fmake_vector(rep_MAKE_INT(n), Qnil);
+    if(ret == 0 || n == 0)
+	return ret;
+    sorted = rep_alloc(sizeof(struct new_extent) * n);
+    if(sorted == 0)
+	return rep_mem_error();
+
+    for(i = 0; i < n; i++)
+    {
+	repv entry = rep_VECTI(entries, i);
+	Lisp_Extent *extent = alloc_extent(0);
+	if(extent == 0)
+	{
+	    rep_free(sorted);
+	    return 0;
+	}
+	COPY_VPOS(&extent->start, rep_CAR(entry));
+	COPY_VPOS(&extent->end, rep_CAR(rep_CDR(entry)));
+	extent->tx = tx;
+	entry = rep_CDR(rep_CDR(entry));
+	extent->plist = rep_CONSP(entry) ? rep_CAR(entry) : Qnil;
+	extent->locals = Qnil;
+	rep_VECTI(ret, i) = rep_VAL(extent);
+	sorted[i].extent = extent;
+	sorted[i].index = i;
+    }
+
+    /* Inserting the extents outermost first nests the inner ones
+       in them, instead of splitting the outer ones into fragments. */
+    qsort(sorted, n, sizeof(struct new_extent), compare_new_extents);
+    for(i = 0; i < n; i++)
+	insert_extent(sorted[i].extent, tx->global_extent);
+
+    rep_free(sorted);
+    return ret;
+}
+
 DEFSTRING(no_delete_root, "Deleting root extent");
 DEFUN("delete-extent", Fdelete_extent, Sdelete_extent,
       (repv extent), rep_Subr1) /*
@@ -635,7 +1124,6 @@ EXTENT is the root extent covering the entire buffer.
 	return Fsignal(Qerror, rep_list_2(rep_VAL(&no_delete_root), extent));
 
     unlink_extent(VEXTENT(extent));
-    invalidate_extent_cache(VEXTENT(extent)->tx);
     return extent;
 }
 
@@ -651,7 +1139,6 @@ Note that it's not possible to delete the global extent of a buffer itself.
     if(!EXTENTP(extent))
 	extent = rep_VAL(curr_vw->tx->global_extent);
     unlink_extent_recursively(VEXTENT(extent));
-    invalidate_extent_cache(VEXTENT(extent)->tx);
     return extent;
 }
 
@@ -672,7 +1159,6 @@ without changing the buffer that EXTENT refers to.
     COPY_VPOS(&VEXTENT(extent)->start, start);
     COPY_VPOS(&VEXTENT(extent)->end, end);
     insert_extent(VEXTENT(extent), VEXTENT(extent)->tx->global_extent);
-    invalidate_extent_cache(VEXTENT(extent)->tx);
 
     return extent;
 }
@@ -701,6 +1187,28 @@ position of the current buffer).
     return (e != 0) ? rep_VAL(e) : Qnil;
 }
 
+DEFUN("extent-cache-statistics", Fextent_cache_statistics,
+      Sextent_cache_statistics, (repv reset), rep_Subr1) /*
+::doc:extent-cache-statistics::
+extent-cache-statistics [RESET]
+
+Return a list (HITS NEAR-MISSES MISSES) counting the lookups of the
+innermost extent at a position since the counts were last reset. HITS
+were answered directly from a view's cache of recent lookups,
+NEAR-MISSES searched downwards from a cached extent containing the
+position, and MISSES searched from the root extent of the buffer.
+
+If RESET is non-nil, set the counts to zero afterwards.
+::end:: */
+{
+    repv ret = rep_list_3(rep_make_long_uint(extent_cache_hits),
+			  rep_make_long_uint(extent_cache_near_misses),
+			  rep_make_long_uint(extent_cache_misses));
+    if(!rep_NILP(reset))
+	extent_cache_hits = extent_cache_near_misses = extent_cache_misses = 0;
+    return ret;
+}
+
 struct map_extents_data {
     repv fun;
     jmp_buf exit;
@@ -759,10 +1267,12 @@ extent-start EXTENT
 Return the position of the first character in EXTENT.
 ::end:: */
 {
+    intptr_t delta;
     rep_DECLARE1(extent, EXTENTP);
     extent = rep_VAL(find_first_frag(VEXTENT(extent)));
+    delta = row_delta(VEXTENT(extent));
     return make_pos(VEXTENT(extent)->start.col,
-		    VEXTENT(extent)->start.row + row_delta(VEXTENT(extent)));
+		    VEXTENT(extent)->start.row + delta);
 }
 
 DEFUN("extent-end", Fextent_end, Sextent_end, (repv extent), rep_Subr1) /*
@@ -772,10 +1282,12 @@ extent-end EXTENT
 Return the position of the character following EXTENT.
 ::end:: */
 {
+    intptr_t delta;
     rep_DECLARE1(extent, EXTENTP);
     extent = rep_VAL(find_last_frag(VEXTENT(extent)));
+    delta = row_delta(VEXTENT(extent));
     return make_pos(VEXTENT(extent)->end.col,
-		    VEXTENT(extent)->end.row + row_delta(VEXTENT(extent)));
+		    VEXTENT(extent)->end.row + delta);
 }
 
 DEFUN("extent-parent", Fextent_parent, Sextent_parent, (repv extent), rep_Subr1) /*
@@ -828,6 +1340,7 @@ this extent) to PLIST.
 
     /* Update all fragments of the extent. TODO: don't need to
        call fff, just go backwards then forwards. */
+    hot_props_clock++;
     e = find_first_frag(VEXTENT(extent));
     while(e != 0)
     {
@@ -838,9 +1351,55 @@ this extent) to PLIST.
     return plist;
 }
 
+/* Return the value of the hot property PROP in extent E, as `extent-get'
+   would. The values of all hot properties of E are found together and
+   kept until the next call to `set-extent-plist' or `extent-put' on
+   any extent, or until any fragment is unlinked from its parent.
+   Values inherited from parents come from the parents' own caches. */
+repv
+extent_hot_property(Lisp_Extent *e, enum extent_hot_prop prop)
+{
+    if(e->hot_clock != hot_props_clock)
+    {
+	repv *syms[EXTENT_HOT_PROPS];
+	repv plist;
+	int i;
+
+	syms[EXTENT_FACE] = &Qface;
+	syms[EXTENT_MOUSE_FACE] = &Qmouse_face;
+	syms[EXTENT_KEYMAP] = &Qkeymap;
+	syms[EXTENT_MOUSE_KEYMAP] = &Qmouse_keymap;
+
+	for(i = 0; i < EXTENT_HOT_PROPS; i++)
+	    e->hot_values[i] = 0;
+	plist = e->plist;
+	while(rep_CONSP(plist) && rep_CONSP(rep_CDR(plist)))
+	{
+	    for(i = 0; i < EXTENT_HOT_PROPS; i++)
+	    {
+		if(rep_CAR(plist) == *syms[i] && e->hot_values[i] == 0)
+		    e->hot_values[i] = rep_CAR(rep_CDR(plist));
+	    }
+	    plist = rep_CDR(rep_CDR(plist));
+	}
+	for(i = 0; i < EXTENT_HOT_PROPS; i++)
+	{
+	    if(e->hot_values[i] == 0)
+	    {
+		e->hot_values[i] = (e->parent != 0
+				    ? extent_hot_property(e->parent, i)
+				    : Qnil);
+	    }
+	}
+	e->hot_clock = hot_props_clock;
+    }
+    return e->hot_values[prop];
+}
+
 static void
 set_extent_locals(Lisp_Extent *e, repv value)
 {
+    local_vars_clock++;
     e = find_first_frag(e);
     while(e != 0)
     {
@@ -881,6 +1440,14 @@ The special properties `front-sticky', `rear-sticky', `local-variables', and
     }
     else if(prop == Qlocal_variables)
 	return VEXTENT(extent)->locals;
+    else if(prop == Qface)
+	return extent_hot_property(inner, EXTENT_FACE);
+    else if(prop == Qmouse_face)
+	return extent_hot_property(inner, EXTENT_MOUSE_FACE);
+    else if(prop == Qkeymap)
+	return extent_hot_property(inner, EXTENT_KEYMAP);
+    else if(prop == Qmouse_keymap)
+	return extent_hot_property(inner, EXTENT_MOUSE_KEYMAP);
 
     while(inner != 0)
     {
@@ -958,6 +1525,7 @@ function.
 	    if(rep_CAR(plist) == prop)
 	    {
 		rep_CAR(rep_CDR(plist)) = val;
+		hot_props_clock++;
 		return val;
 	    }
 	    plist = rep_CDR(rep_CDR(plist));
@@ -985,6 +1553,39 @@ Get the value of PROPERTY (a symbol) at POSITION in BUFFER.
     return Fextent_get(e, prop);
 }
 
+/* Return the cell (SYMBOL . VALUE) of the innermost binding of SYMBOL
+   in extent E or its parents, or zero if it has none. Bindings are
+   cached per buffer, keyed on SYMBOL and E, until local_vars_clock
+   moves on. The cell itself is cached, so setting the value of an
+   existing binding needn't advance the clock. */
+static repv
+local_variable_cell(Lisp_Extent *e, repv symbol)
+{
+    struct cached_local_var *c;
+    Lisp_Extent *x;
+
+    c = &e->tx->local_var_cache[((((uintptr_t) symbol) >> 3)
+				 ^ (((uintptr_t) e) >> 4))
+				% LOCAL_VAR_CACHE_SIZE];
+    if(c->clock == local_vars_clock && c->symbol == symbol && c->extent == e)
+	return c->cell;
+
+    c->cell = 0;
+    for(x = e; x != 0; x = x->parent)
+    {
+	repv cell = Fassq(symbol, x->locals);
+	if(cell && rep_CONSP(cell))
+	{
+	    c->cell = cell;
+	    break;
+	}
+    }
+    c->symbol = symbol;
+    c->extent = e;
+    c->clock = local_vars_clock;
+    return c->cell;
+}
+
 DEFUN("buffer-variable-ref", Fbuffer_symbol_value, Sbuffer_symbol_value,
       (repv symbol, repv pos, repv tx, repv no_err), rep_Subr4) /*
 ::doc:buffer-variable-ref::
@@ -1009,14 +1610,9 @@ is signalled.
 	    e = pos;
 	if(!rep_NILP(e))
 	{
-	    Lisp_Extent *inner = VEXTENT(e);
-	    while(inner != 0)
-	    {
-		repv cell = Fassq(symbol, inner->locals);
-		if(cell && rep_CONSP(cell))
-		    return rep_CDR(cell);
-		inner = inner->parent;
-	    }
+	    repv cell = local_variable_cell(VEXTENT(e), symbol);
+	    if(cell != 0)
+		return rep_CDR(cell);
 	}
     }
     if(rep_NILP(no_err))
@@ -1072,7 +1668,7 @@ buffer_set_if_bound(repv symbol, repv value)
     Pos tem;
     Lisp_Extent *e;
     COPY_VPOS(&tem, curr_vw->cursor_pos);
-    e = find_extent(curr_vw->tx->global_extent, &tem);
+    e = find_view_extent(curr_vw, &tem);
     while(e != 0)
     {
 	repv cell = Fassq(symbol, e->locals);
@@ -1106,6 +1702,7 @@ set_local_symbol (repv sym, repv value)
 	/* Create a new buffer-local value */
 	tx->global_extent->locals = Fcons(Fcons(sym, value),
 					    tx->global_extent->locals);
+	local_vars_clock++;
 	return value;
     }
     else
@@ -1136,6 +1733,7 @@ Returns SYMBOL.
 	repv value = Fsymbol_value (sym, Qt);
 	tx->global_extent->locals = Fcons(Fcons(sym, value),
 					    tx->global_extent->locals);
+	local_vars_clock++;
     }
     return sym;
 }
@@ -1198,6 +1796,7 @@ permanent (i.e. their `permanent-local' property is unset or non-nil.)
 	    list = next;
 	}
     }
+    local_vars_clock++;
     kill_buffer_local_variables(VBUFFER(tx));
     return tx;
 }
@@ -1219,13 +1818,14 @@ Remove the buffer-local value of the symbol SYMBOL in the specified buffer.
     while(rep_CONSP(list))
     {
 	repv nxt = rep_CDR(list);
-	if(rep_CAR(list) != sym)
+	if(rep_CAR(rep_CAR(list)) != sym)
 	{
 	    rep_CDR(list) = VBUFFER(tx)->global_extent->locals;
 	    VBUFFER(tx)->global_extent->locals = list;
 	}
 	list = nxt;
     }
+    local_vars_clock++;
     return sym;
 }
 
@@ -1236,13 +1836,15 @@ void
 adjust_extents_add_cols(Lisp_Extent *x, intptr_t add_x,
 			intptr_t col, intptr_t row)
 {
-    if(x->parent == 0)
-	invalidate_extent_cache(x->tx);
     for(; x != 0; x = x->right_sibling)
     {
+	sync_extent(x);
 	if(x->first_child != 0 && x->start.row <= row && x->end.row >= row)
-	    adjust_extents_add_cols(x->first_child, add_x,
-				    col, row - x->start.row);
+	{
+	    Lisp_Extent *c = find_child_row(x, row - x->start.row);
+	    if(c != 0)
+		adjust_extents_add_cols(c, add_x, col, row - x->start.row);
+	}
 	if(x->start.row == row
 	   && (x->start.col > col
 	       || (!(x->car & EXTFF_OPEN_START)
@@ -1267,14 +1869,16 @@ void
 adjust_extents_sub_cols(Lisp_Extent *x, intptr_t sub_x,
 			intptr_t col, intptr_t row)
 {
-    if(x->parent == 0)
-	invalidate_extent_cache(x->tx);
     for(; x != 0; x = x->right_sibling)
     {
     top:
+	sync_extent(x);
 	if(x->first_child != 0 && x->start.row <= row && x->end.row >= row)
-	    adjust_extents_sub_cols(x->first_child, sub_x,
-				    col, row - x->start.row);
+	{
+	    Lisp_Extent *c = find_child_row(x, row - x->start.row);
+	    if(c != 0)
+		adjust_extents_sub_cols(c, sub_x, col, row - x->start.row);
+	}
 	if(x->start.row == row && x->start.col > col)
 	    x->start.col = MAX(col, x->start.col - sub_x);
 	if(x->end.row == row && x->end.col > col)
@@ -1302,20 +1906,27 @@ adjust_extents_sub_cols(Lisp_Extent *x, intptr_t sub_x,
 void
 adjust_extents_add_rows(Lisp_Extent *x, intptr_t add_y, intptr_t row)
 {
-    if(x->parent == 0)
-	invalidate_extent_cache(x->tx);
     for(; x != 0; x = x->right_sibling)
     {
-	if(x->start.row > row
-	   || (x->start.row == row
-	       && (x->start.col > 0
-		   || !(x->car & EXTFF_OPEN_START))))
+	sync_extent(x);
+	if(x->start.row > row)
+	{
+	    /* X and everything after it just moves down. */
+	    shift_extents(x, add_y);
+	    break;
+	}
+	if(x->start.row == row
+	   && (x->start.col > 0
+	       || !(x->car & EXTFF_OPEN_START)))
 	{
 	    x->start.row += add_y;
 	}
 	else if(x->first_child != 0 && row <= x->end.row)
-	    adjust_extents_add_rows(x->first_child, add_y,
-				    row - x->start.row);
+	{
+	    Lisp_Extent *c = find_child_row(x, row - x->start.row);
+	    if(c != 0)
+		adjust_extents_add_rows(c, add_y, row - x->start.row);
+	}
 	if(x->end.row > row
 	   || (x->end.row == row
 	       && (x->end.col > 0
@@ -1329,22 +1940,34 @@ adjust_extents_add_rows(Lisp_Extent *x, intptr_t add_y, intptr_t row)
 void
 adjust_extents_sub_rows(Lisp_Extent *x, intptr_t sub_y, intptr_t row)
 {
-    if(x->parent == 0)
-	invalidate_extent_cache(x->tx);
     for(; x != 0; x = x->right_sibling)
     {
     top:
+	sync_extent(x);
+	if(x->start.row >= row + sub_y)
+	{
+	    /* X and everything after it just moves up. */
+	    shift_extents(x, -sub_y);
+	    break;
+	}
 	if(x->first_child != 0 && row >= x->start.row && row <= x->end.row)
-	    adjust_extents_sub_rows(x->first_child, sub_y, row - x->start.row);
+	{
+	    Lisp_Extent *c = find_child_row(x, row - x->start.row);
+	    if(c != 0)
+		adjust_extents_sub_rows(c, sub_y, row - x->start.row);
+	}
+	else if(x->first_child != 0
+		&& x->start.row > row && x->start.row < row + sub_y)
+	{
+	    /* X will start on ROW, so the rows of its children that
+	       follow it in the deleted section have gone as well. */
+	    adjust_extents_sub_rows(x->first_child,
+				    sub_y - (x->start.row - row), 0);
+	}
 	if(x->start.row >= row)
 	{
-	    if(x->start.row >= row + sub_y)
-		x->start.row -= sub_y;
-	    else
-	    {
-		x->start.row = row;
-		x->start.col = 0;
-	    }
+	    x->start.row = row;
+	    x->start.col = 0;
 	}
 	if(x->end.row >= row)
 	{
@@ -1376,24 +1999,31 @@ adjust_extents_sub_rows(Lisp_Extent *x, intptr_t sub_y, intptr_t row)
 void
 adjust_extents_split_row(Lisp_Extent *x, intptr_t col, intptr_t row)
 {
-    if(x->parent == 0)
-	invalidate_extent_cache(x->tx);
     for(; x != 0; x = x->right_sibling)
     {
+	sync_extent(x);
 	if(x->start.row > row)
-	    x->start.row++;
-	else if(x->start.row == row
-		&& (x->start.col > col
-		    || (x->start.col == col
-			&& !(x->car & EXTFF_OPEN_START))))
+	{
+	    /* X and everything after it just moves down. */
+	    shift_extents(x, 1);
+	    break;
+	}
+	if(x->start.row == row
+	   && (x->start.col > col
+	       || (x->start.col == col
+		   && !(x->car & EXTFF_OPEN_START))))
 	{
 	    if(x->first_child != 0)
 		adjust_extents_sub_cols(x->first_child, col, 0, 0);
 	    x->start.row++;
 	    x->start.col -= col;
 	}
-	else if(x->first_child != 0)
-	    adjust_extents_split_row(x->first_child, col, row - x->start.row);
+	else if(x->first_child != 0 && row <= x->end.row)
+	{
+	    Lisp_Extent *c = find_child_row(x, row - x->start.row);
+	    if(c != 0)
+		adjust_extents_split_row(c, col, row - x->start.row);
+	}
 
 	if(x->end.row > row)
 	    x->end.row++;
@@ -1411,20 +2041,36 @@ adjust_extents_split_row(Lisp_Extent *x, intptr_t col, intptr_t row)
 void
 adjust_extents_join_rows(Lisp_Extent *x, intptr_t col, intptr_t row)
 {
-    if(x->parent == 0)
-	invalidate_extent_cache(x->tx);
     for(; x != 0; x = x->right_sibling)
     {
+	sync_extent(x);
+	if(x->start.row > row + 1)
+	{
+	    /* X and everything after it just moves up. */
+	    shift_extents(x, -1);
+	    break;
+	}
 	if(x->first_child != 0)
-	    adjust_extents_join_rows(x->first_child, col, row - x->start.row);
+	{
+	    if(x->start.row <= row && x->end.row > row)
+	    {
+		Lisp_Extent *c = find_child_row(x, row - x->start.row);
+		if(c != 0)
+		    adjust_extents_join_rows(c, col, row - x->start.row);
+	    }
+	    else if(x->start.row == row + 1)
+	    {
+		/* X moves up a row, so only the columns of its children
+		   on its first row change. */
+		adjust_extents_add_cols(x->first_child, col, -1, 0);
+	    }
+	}
 
 	if(x->start.row == row + 1)
 	{
 	    x->start.row--;
 	    x->start.col += col;
 	}
-	else if(x->start.row > row + 1)
-	    x->start.row--;
 
 	if(x->end.row == row + 1)
 	{
@@ -1591,9 +2237,12 @@ static void
 extent_mark(repv val)
 {
     Lisp_Extent *e = VEXTENT(val);
+    int i;
     rep_GC_SET_CELL(val);
     rep_MARKVAL(e->plist);
     rep_MARKVAL(e->locals);
+    for(i = 0; i < EXTENT_HOT_PROPS; i++)
+	rep_MARKVAL(e->hot_values[i]);
     rep_MARKVAL(rep_VAL(e->tx));
     /* This is a bit naive. It could probably be done w/o recursion.. */
     rep_MARKVAL(rep_VAL(e->parent));
@@ -1627,6 +2276,7 @@ static void
 extent_prin(repv strm, repv e)
 {
     char buf[128];
+    sync_extent(VEXTENT(e));
     sprintf(buf, "#<extent (%ld,%ld)->(%ld,%ld)",
 	    VEXTENT(e)->start.row, VEXTENT(e)->start.col,
 	    VEXTENT(e)->end.row, VEXTENT(e)->end.col);
@@ -1675,10 +2325,12 @@ extent_init(void)
     extent_type = rep_define_type(&extent);
 
     rep_ADD_SUBR(Smake_extent);
+    rep_ADD_SUBR(Smake_extents);
     rep_ADD_SUBR(Sdelete_extent);
     rep_ADD_SUBR(Sdelete_all_extents);
     rep_ADD_SUBR(Smove_extent);
     rep_ADD_SUBR(Sget_extent);
+    rep_ADD_SUBR(Sextent_cache_statistics);
     rep_ADD_SUBR(Smap_extents);
     rep_ADD_SUBR(Sextent_start);
     rep_ADD_SUBR(Sextent_end);
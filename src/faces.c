@@ -355,11 +355,11 @@ merge_faces(Lisp_View *vw, Lisp_Extent *e, int in_block, int on_cursor)
 	}
 	if (pointer_extent)
 	{
-	    face = Fextent_get (rep_VAL(x), Qmouse_face);
+	    face = extent_hot_property (x, EXTENT_MOUSE_FACE);
 	    if (face && FACEP (face))
 		union_face (&c, VFACE (face));
 	}
-	face = Fextent_get(rep_VAL(x), Qface);
+	face = extent_hot_property(x, EXTENT_FACE);
 	if(face && FACEP(face))
 	    union_face(&c, VFACE(face));
     }
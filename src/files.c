@@ -18,23 +18,49 @@
    along with Jade; see the file COPYING.	If not, write to
    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.  */
 
-/* Define this symbol to disable the code that tries to predict how many
-   lines a file of length N will contain. */
-/* #define NO_ADAPTIVE_LOADING */
+/* For F_SETLEASE and F_SETSIG */
+#define _GNU_SOURCE
 
-/* When loading files into buffers, read this many lines before trying to
-   predict how many lines the file actually contains, based on the average
-   line length up to this point. This prediction is re-calibrated each time
-   new lines subsequently need to be allocated. */
-#define ADAPTIVE_INITIAL_SAMPLES 64
+/* Files are read into buffers in blocks of this many bytes. */
+#define LOAD_BLOCK_SIZE (256 * 1024)
+
+/* Large files are loaded by up to this many threads, each given at
+   least MIN_LOAD_CHUNK bytes of the file. */
+#define MAX_LOAD_THREADS 32
+#define MIN_LOAD_CHUNK (8 * 1024 * 1024)
+
+/* Buffers are written out in batches of at most WRITE_BATCH pieces.
+   Lines shorter than WRITE_COPY_MAX bytes are gathered into a staging
+   area of WRITE_STAGE_SIZE bytes instead of being pieces of their own. */
+#define WRITE_BATCH 1024
+#define WRITE_COPY_MAX 1024
+#define WRITE_STAGE_SIZE (256 * 1024)
 
 #include "jade.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
 #ifdef NEED_MEMORY_H
 # include <memory.h>
 #endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#include <signal.h>
+#if defined (HAVE_PTHREAD_H) && defined (HAVE_LIBPTHREAD)
+# include <pthread.h>
+# define USE_THREADS
+#endif
 
 /* List of operations. If there's a file handler defined for the file
    being manipulated it will be called to execute the operation.
@@ -46,150 +72,1065 @@
 DEFSYM(write_buffer_contents, "write-buffer-contents");
 DEFSYM(read_file_contents, "read-file-contents");
 DEFSYM(insert_file_contents, "insert-file-contents");
+DEFSYM(mmap_file_threshold, "mmap-file-threshold"); /*
+::doc:mmap-file-threshold::
+When an integer, files at least this many bytes long are mapped into
+memory when read into a buffer, instead of being copied. Lines are only
+copied when they are first modified, so huge files can be opened quickly
+and cheaply. When nil, files are always copied.
+
+A file is only mapped if no other program has it open for writing and
+the editor can hold a lease on it, so that it's told when a program
+opens the file to write it or truncates it; the text is copied before
+the program is allowed to carry on. Where leases aren't supported only
+files that nobody has permission to write are mapped.
+::end:: */
+DEFSYM(save_file_durability, "save-file-durability"); /*
+::doc:save-file-durability::
+Controls how hard write-buffer-contents tries to make sure that a file it
+saves survives a system crash. Files are always written under a temporary
+name which is then renamed over the original, so that a failed save never
+leaves the original half-written.
+
+When nil, the new file is left for the operating system to write to disk
+in its own time. When the symbol `fsync', the file is synchronized to disk
+before it replaces the original. Any other value also synchronizes the
+directory containing the file afterwards, so that its new name is safe
+as well.
+::end:: */
+DEFSYM(fsync, "fsync");
 
 
 /* Low level stuff */
 
-/* Read a file into a tx structure, the line list should have been
-   killed. FILE-LENGTH is the length of the file to be loaded, or -1
-   if the length is unknown. */
+/* Store the offsets of the newline characters in the LEN bytes at BUF
+   in EOLS, in order. Returns the number of newlines. */
+static size_t
+find_newlines(const char *buf, size_t len, unsigned int *eols)
+{
+    const char *ptr = buf, *end = buf + len;
+    size_t count = 0;
+#if defined (__SSE2__) && defined (__GNUC__)
+    /* Compare sixteen bytes at a time. Each newline sets a bit of the
+       mask, so the lines in a block of short lines are split without
+       calling memchr() for each one. */
+    const __m128i newline = _mm_set1_epi8('\n');
+    for(; end - ptr >= 16; ptr += 16)
+    {
+	__m128i x = _mm_loadu_si128((const __m128i *) ptr);
+	unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, newline));
+	while(mask != 0)
+	{
+	    eols[count++] = (ptr - buf) + __builtin_ctz(mask);
+	    mask &= mask - 1;
+	}
+    }
+#endif
+    while((ptr = memchr(ptr, '\n', end - ptr)) != 0)
+    {
+	eols[count++] = ptr - buf;
+	ptr++;
+    }
+    return count;
+}
+
+/* Give LINE a new string of LEN bytes from arena A, the contents are
+   undefined apart from the terminator. Returns the string, or a null
+   pointer if no memory. */
+static char *
+make_loaded_line(LINE *line, struct line_arena *a, intptr_t len)
+{
+    line->ln_Strlen = len + 1;
+    if(!LINE_INLINE_P(line))
+    {
+	line->ln_Text.heap = line_arena_alloc(a, len + 1);
+	if(line->ln_Text.heap == NULL)
+	{
+	    line->ln_Strlen = 0;
+	    return 0;
+	}
+    }
+    LINE_TEXT(line)[len] = 0;
+    return LINE_TEXT(line);
+}
+
+/* A part of a regular file being loaded by load_file(). Each chunk is
+   read, and the lines wholly inside it made, independently of the
+   others, by a thread of its own when possible. The worker threads
+   touch nothing but their chunk and never call into the Lisp system;
+   their memory comes from malloc(). */
+struct load_chunk {
+    int fd;
+    off_t start, end;		/* the bytes of the file in this chunk */
+    intptr_t newlines;		/* number of newlines in them */
+    char *head, *tail;		/* the text before the first newline, */
+    size_t head_len, tail_len;	/*  and after the last */
+    LINE *lines;		/* the lines between the two */
+    intptr_t line_count, lines_size;
+    struct line_arena arena;	/*  and their strings */
+    int rc, error;		/* result as for load_file(), and errno */
+#ifdef USE_THREADS
+    pthread_t thread;
+#endif
+};
+
+/* Add a line holding the LEN bytes at TEXT to chunk C. Returns false
+   if no memory. */
 static bool
-read_file_into_tx(Lisp_Buffer *tx, FILE *fh, intptr_t file_length)
+add_chunk_line(struct load_chunk *c, const char *text, size_t len)
 {
-    bool rc = false;
-    char buf[BUFSIZ];
-    intptr_t len, row, alloced_lines, chars_read = 0;
+    char *copy;
+    if(c->line_count == c->lines_size)
+    {
+	intptr_t size = MAX(c->lines_size * 2, 1024);
+	LINE *tem = realloc(c->lines, sizeof(LINE) * size);
+	if(tem == 0)
+	    return false;
+	c->lines = tem;
+	c->lines_size = size;
+    }
+    copy = make_loaded_line(&c->lines[c->line_count], &c->arena, len);
+    if(copy == 0)
+	return false;
+    memcpy(copy, text, len);
+    c->line_count++;
+    return true;
+}
 
-    /* For the first N allocations, use the standard resize_line_list method,
-       even if we know the length of the file.. */
-    if(!resize_line_list(tx, 1, 0))
-	goto abortmem;
-    alloced_lines = 1;
-    row = 0;
+/* Read chunk ARG, reading each of its blocks once. The lines ending in
+   a block are copied straight from it. The unfinished line at the end
+   of a block is moved to the start of the buffer and the next block
+   read after it; the buffer grows when a line won't fit. */
+static void *
+read_chunk(void *arg)
+{
+    struct load_chunk *c = arg;
+    size_t size = 2 * LOAD_BLOCK_SIZE, kept = 0;
+    char *buf = malloc(size);
+    unsigned int *eols = malloc(sizeof(unsigned int) * LOAD_BLOCK_SIZE);
+    off_t pos;
+    ssize_t len;
 
-    while((len = fread(buf, 1, BUFSIZ, fh)) > 0)
+    c->rc = 0;
+    if(buf == 0 || eols == 0)
+	goto out;
+    for(pos = c->start; pos < c->end; pos += len)
     {
-	char *new;
-	intptr_t newlen;
-	char *eol, *cur = buf;
-	while((eol = memchr(cur, '\n', (buf + len) - cur)))
+	size_t i, n, from = 0;
+	if(size - kept < LOAD_BLOCK_SIZE)
 	{
-	    if(tx->lines[row].ln_Strlen != 0)
-	    {
-		newlen = tx->lines[row].ln_Strlen + (eol - cur);
-		new = alloc_line_buf(tx, newlen);
-		memcpy(new, tx->lines[row].ln_Line,
-		       tx->lines[row].ln_Strlen);
-		memcpy(new + tx->lines[row].ln_Strlen - 1, cur, eol - cur);
-		new[newlen-1] = 0;
-		free_line_buf(tx, tx->lines[row].ln_Line);
-		tx->lines[row].ln_Line = new;
-		tx->lines[row].ln_Strlen = newlen;
-	    }
-	    else
+	    char *tem = realloc(buf, size * 2);
+	    if(tem == 0)
+		goto out;
+	    buf = tem;
+	    size *= 2;
+	}
+	len = pread(c->fd, buf + kept, MIN(LOAD_BLOCK_SIZE, c->end - pos),
+		    pos);
+	if(len <= 0)
+	{
+	    c->rc = (len < 0) ? -1 : -2;
+	    c->error = errno;
+	    goto out;
+	}
+	n = find_newlines(buf + kept, len, eols);
+	for(i = 0; i < n; i++)
+	{
+	    size_t eol = kept + eols[i];
+	    if(c->newlines + i == 0)
 	    {
-		newlen = eol - cur;
-		new = alloc_line_buf(tx, newlen + 1);
-		if(new == NULL)
-		    goto abortmem;
-		memcpy(new, cur, newlen);
-		new[newlen] = 0;
-		tx->lines[row].ln_Line = new;
-		tx->lines[row].ln_Strlen = newlen+1;
+		/* The end of a line that started in an earlier chunk */
+		c->head = malloc(MAX(eol, 1));
+		if(c->head == 0)
+		    goto out;
+		memcpy(c->head, buf, eol);
+		c->head_len = eol;
 	    }
-	    chars_read += tx->lines[row].ln_Strlen;
+	    else if(!add_chunk_line(c, buf + from, eol - from))
+		goto out;
+	    from = eol + 1;
+	}
+	c->newlines += n;
+	kept += len - from;
+	if(from > 0)
+	    memmove(buf, buf + from, kept);
+    }
 
-	    if(++row >= alloced_lines)
-	    {
-		/* Need to grow the line list. */
-#ifndef NO_ADAPTIVE_LOADING
-		if(file_length >= 0 && row > ADAPTIVE_INITIAL_SAMPLES)
-		{
-		    /* We know the file_length, and the average bytes-per-line
-		       so far. Re-calibrate our prediction of the total
-		       number of lines. */
-		    intptr_t predicted_lines = file_length * row / chars_read;
-		    /* Ensure that at least some new lines are going
-		       to be allocated.. */
-		    if(predicted_lines < row + 32)
-			predicted_lines = row + 32;
-		    if(!resize_line_list(tx, predicted_lines - alloced_lines,
-					 row))
-			goto abortmem;
-		    alloced_lines = predicted_lines;
-		}
-		else
+    /* What's left follows the last newline, or if there wasn't one,
+       it's all of the chunk. */
+    if(c->newlines > 0)
+    {
+	c->tail = buf;
+	c->tail_len = kept;
+    }
+    else
+    {
+	c->head = buf;
+	c->head_len = kept;
+    }
+    buf = 0;
+    c->rc = 1;
+out:
+    free(buf);
+    free(eols);
+    return 0;
+}
+
+/* Call FN on each of the N CHUNKS, all at once if threads are
+   available. Returns the worst of their results, with errno set to
+   match. */
+static int
+run_chunks(struct load_chunk *chunks, int n, void *(*fn)(void *))
+{
+    int i, rc = 1;
+#ifdef USE_THREADS
+    bool started[MAX_LOAD_THREADS];
+    sigset_t all, old;
+
+    /* The editor's signals must only ever be handled by this thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for(i = 1; i < n; i++)
+	started[i] = (pthread_create(&chunks[i].thread, 0,
+				     fn, &chunks[i]) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+
+    fn(&chunks[0]);
+    for(i = 1; i < n; i++)
+    {
+	if(started[i])
+	    pthread_join(chunks[i].thread, 0);
+	else
+	    fn(&chunks[i]);
+    }
+#else
+    for(i = 0; i < n; i++)
+	fn(&chunks[i]);
 #endif
-		{
-		    /*  We don't know the size of the file;
-		        just pass it off to resize_line_list().. */
-		    if(!resize_line_list(tx, 1, row))
-			goto abortmem;
-		    alloced_lines++;
-		}
-	    }
+    for(i = 0; i < n; i++)
+    {
+	if(chunks[i].rc < rc)
+	{
+	    rc = chunks[i].rc;
+	    errno = chunks[i].error;
+	}
+    }
+    return rc;
+}
+
+/* Return the number of chunks to split a file of LENGTH bytes into. */
+static int
+load_chunk_count(off_t length)
+{
+    long n = 1;
+#if defined (USE_THREADS) && defined (_SC_NPROCESSORS_ONLN)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    n = MIN(n, MAX_LOAD_THREADS);
+    n = MIN(n, length / MIN_LOAD_CHUNK);
+#endif
+    return MAX(n, 1);
+}
+
+/* Make line ROW of TX from the text following the last newline of chunk
+   FIRST, then all of each chunk after it up to and including the text
+   before the first newline of chunk LAST. When FIRST is -1 the line
+   starts at the beginning of the file. Returns false if no memory. */
+static bool
+join_chunk_text(Lisp_Buffer *tx, intptr_t row,
+		struct load_chunk *chunks, int first, int last)
+{
+    size_t len = (first >= 0) ? chunks[first].tail_len : 0;
+    char *text;
+    int i;
+
+    for(i = first + 1; i <= last; i++)
+	len += chunks[i].head_len;
+    text = make_loaded_line(&TX_LINE(tx, row), &tx->line_arena, len);
+    if(text == 0)
+	return false;
+    if(first >= 0)
+    {
+	memcpy(text, chunks[first].tail, chunks[first].tail_len);
+	text += chunks[first].tail_len;
+    }
+    for(i = first + 1; i <= last; i++)
+    {
+	memcpy(text, chunks[i].head, chunks[i].head_len);
+	text += chunks[i].head_len;
+    }
+    return true;
+}
+
+/* Read the regular file open on FD into TX. The file is split into
+   chunks which are read in parallel, each block being read only once;
+   the lines inside each chunk are made as it's read, into an array of
+   the chunk's own since their rows aren't known until all chunks have
+   been counted. The lines are then moved into place, and the lines
+   that cross from one chunk to the next joined together. Returns 1 if
+   okay, 0 if no memory, -1 if an I/O error (with errno set), -2 if the
+   file changed while it was being read. */
+static int
+load_file(Lisp_Buffer *tx, int fd)
+{
+    struct load_chunk chunks[MAX_LOAD_THREADS];
+    struct stat st;
+    intptr_t lines = 1, row = 0, j;
+    int i, n, rc, last = -1;
+
+    if(fstat(fd, &st) != 0)
+	return -1;
+    n = load_chunk_count(st.st_size);
+    for(i = 0; i < n; i++)
+    {
+	struct load_chunk *c = &chunks[i];
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	c->start = st.st_size * i / n;
+	c->end = st.st_size * (i + 1) / n;
+	c->arena.detached = true;
+    }
+
+    rc = run_chunks(chunks, n, read_chunk);
+    for(i = 0; i < n; i++)
+    {
+	line_arena_merge(&tx->line_arena, &chunks[i].arena);
+	lines += chunks[i].newlines;
+    }
+    if(rc > 0 && !resize_line_list(tx, lines, 0))
+	rc = 0;
+
+    /* LAST is the chunk containing the most recent newline. */
+    for(i = 0; i < n && rc > 0; i++)
+    {
+	struct load_chunk *c = &chunks[i];
+	if(c->newlines > 0)
+	{
+	    if(!join_chunk_text(tx, row++, chunks, last, i))
+		rc = 0;
+	    for(j = 0; j < c->line_count; j++)
+		TX_LINE(tx, row + j) = c->lines[j];
+	    row += c->line_count;
+	    last = i;
+	}
+    }
+    if(rc > 0 && !join_chunk_text(tx, row, chunks, last, n - 1))
+	rc = 0;
+
+    for(i = 0; i < n; i++)
+    {
+	free(chunks[i].head);
+	free(chunks[i].tail);
+	free(chunks[i].lines);
+    }
+    return rc;
+}
+
+/* Read the stream FH into TX, for when it isn't a regular file. Lines
+   that span blocks are collected in a separate buffer that doubles in
+   size as needed. Returns as for load_file(). */
+static int
+load_stream(Lisp_Buffer *tx, FILE *fh)
+{
+    char *buf = rep_alloc(LOAD_BLOCK_SIZE), *text;
+    char *partial = 0;
+    size_t partial_len = 0, partial_size = 0, len;
+    int rc = 0;
+
+    if(buf == 0)
+	return 0;
+
+    while((len = fread(buf, 1, LOAD_BLOCK_SIZE, fh)) > 0)
+    {
+	char *cur = buf, *eol;
+	while((eol = memchr(cur, '\n', (buf + len) - cur)) != 0)
+	{
+	    if(!resize_line_list(tx, +1, tx->line_count))
+		goto out;
+	    text = make_loaded_line(&TX_LINE(tx, tx->line_count - 1),
+				    &tx->line_arena, partial_len + (eol - cur));
+	    if(text == 0)
+		goto out;
+	    if(partial_len > 0)
+		memcpy(text, partial, partial_len);
+	    memcpy(text + partial_len, cur, eol - cur);
+	    partial_len = 0;
 	    cur = eol + 1;
 	}
-	if(cur < buf + len)
+	if(partial_len + ((buf + len) - cur) > partial_size)
 	{
-            if(tx->lines[row].ln_Strlen)
-	    {
-                /* Only way we can get here is if there were *no* newlines in
-                   the chunk we just read. */
-		newlen = tx->lines[row].ln_Strlen + len;
-		new = alloc_line_buf(tx, newlen);
-		if(!new)
-		    goto abortmem;
-		memcpy(new, tx->lines[row].ln_Line,
-		       tx->lines[row].ln_Strlen - 1);
-		memcpy(new + (tx->lines[row].ln_Strlen - 1), buf, len);
-		new[newlen-1] = 0;
-		free_line_buf(tx, tx->lines[row].ln_Line);
-		tx->lines[row].ln_Line = new;
-		tx->lines[row].ln_Strlen = newlen;
-	    }
-            else
-	    {
-		newlen = (buf + len) - cur;
-		tx->lines[row].ln_Line = alloc_line_buf(tx, newlen + 1);
-		if(!tx->lines[row].ln_Line)
-		    goto abortmem;
-		memcpy(tx->lines[row].ln_Line, cur, newlen);
-		tx->lines[row].ln_Line[newlen] = 0;
-		tx->lines[row].ln_Strlen = newlen + 1;
-	    }
+	    size_t new_size = MAX(partial_size * 2,
+				  partial_len + ((buf + len) - cur));
+	    char *tem = rep_realloc(partial, new_size);
+	    if(tem == 0)
+		goto out;
+	    partial = tem;
+	    partial_size = new_size;
+	}
+	memcpy(partial + partial_len, cur, (buf + len) - cur);
+	partial_len += (buf + len) - cur;
+    }
+    if(ferror(fh))
+    {
+	rc = -1;
+	goto out;
+    }
+
+    if(!resize_line_list(tx, +1, tx->line_count))
+	goto out;
+    text = make_loaded_line(&TX_LINE(tx, tx->line_count - 1),
+			    &tx->line_arena, partial_len);
+    if(text == 0)
+	goto out;
+    if(partial_len > 0)
+	memcpy(text, partial, partial_len);
+    rc = 1;
+
+out:
+    if(partial != 0)
+	rep_free(partial);
+    rep_free(buf);
+    return rc;
+}
+
+/* Read a file into a tx structure, the line list should have been
+   killed. FILE is the file object or name that FH was opened from.
+   Returns false (with an error signalled) if it couldn't be read. */
+static bool
+read_file_into_tx(Lisp_Buffer *tx, repv file, FILE *fh)
+{
+    struct stat st;
+    int rc;
+
+    if(!rep_FILEP(file) && fstat(fileno(fh), &st) == 0
+       && S_ISREG(st.st_mode))
+    {
+	rc = load_file(tx, fileno(fh));
+	if(rc == -2)
+	{
+	    /* It changed under our feet; settle for whatever a single
+	       sequential read sees. */
+	    kill_line_list(tx);
+	    rc = load_stream(tx, fh);
 	}
     }
-    if(tx->lines[row].ln_Strlen == 0)
+    else
+	rc = load_stream(tx, fh);
+
+    if(rc > 0)
     {
-	tx->lines[row].ln_Line = alloc_line_buf(tx, 1);
-	if(tx->lines[row].ln_Line == NULL)
-	    goto abortmem;
-	tx->lines[row].ln_Line[0] = 0;
-	tx->lines[row].ln_Strlen = 1;
+	tx->logical_start = 0;
+	tx->logical_end = tx->line_count;
+	tx->change_count++;
+	return true;
     }
     else
-	chars_read += tx->lines[row].ln_Strlen;
-    row++;
+    {
+	if(rc < 0)
+	    rep_signal_file_error(file);
+	else
+	    rep_mem_error();
+	kill_line_list(tx);
+	return false;
+    }
+}
+
+/* Mapped files
+
+   Lines pointing into a mapped file would fault if another program
+   truncated the file, so a file is only mapped while a read lease is
+   held on it (see fcntl(2)). No lease is granted while anyone has the
+   file open for writing; once granted, a program opening the file to
+   write or truncate it is held up while the editor is sent a signal.
+   The signal handler passes the leased descriptor to the event loop
+   through a pipe, and lease_broken() copies everything out of the
+   mapping before giving up the lease. */
+
+struct file_lease {
+    struct file_lease *next;
+    char *map_base;
+    int fd;				/* holds the lease */
+    dev_t dev;
+    ino_t ino;
+};
+
+static struct file_lease *file_leases;
+
+#ifdef F_SETLEASE
+static int lease_pipe[2] = { -1, -1 };
+
+static bool copy_mapped_file(struct stat *st);
+
+static void
+lease_break_signal(int sig, siginfo_t *info, void *context)
+{
+    int saved_errno = errno;
+    int fd = info->si_fd;
+    if(write(lease_pipe[1], &fd, sizeof(fd)) < 0)
+	;
+    errno = saved_errno;
+}
+
+/* Called from the event loop when a program wants to write a file that
+   we've mapped. If there's no memory to copy the text, the lease is
+   kept until the system breaks it anyway. */
+static void
+lease_broken(int pipe_fd)
+{
+    struct file_lease *l;
+    struct stat st;
+    int fd;
+    if(read(pipe_fd, &fd, sizeof(fd)) != sizeof(fd))
+	return;
+    for(l = file_leases; l != 0; l = l->next)
+    {
+	if(l->fd == fd)
+	{
+	    st.st_dev = l->dev;
+	    st.st_ino = l->ino;
+	    copy_mapped_file(&st);
+	    break;
+	}
+    }
+}
+#endif
+
+/* Returns a lease on the file open on FD for mapping its first LENGTH
+   bytes, or a null pointer if it mustn't be mapped. */
+static struct file_lease *
+lease_file(int fd, intptr_t length)
+{
+    struct file_lease *l;
+    struct stat st;
+    int lease_fd;
+
+#ifdef F_SETLEASE
+    if(lease_pipe[0] < 0)
+    {
+	struct sigaction sa;
+	if(pipe(lease_pipe) != 0)
+	    return 0;
+	fcntl(lease_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(lease_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(lease_pipe[1], F_SETFL, O_NONBLOCK);
+	rep_register_input_fd(lease_pipe[0], lease_broken);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = lease_break_signal;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGIO, &sa, 0);
+    }
+#endif
+
+    lease_fd = dup(fd);
+    if(lease_fd < 0)
+	return 0;
+    fcntl(lease_fd, F_SETFD, FD_CLOEXEC);
+#ifdef F_SETLEASE
+    /* With F_SETSIG the handler is told which descriptor it was */
+    if(fcntl(lease_fd, F_SETSIG, SIGIO) != 0
+       || fcntl(lease_fd, F_SETLEASE, F_RDLCK) != 0)
+    {
+	close(lease_fd);
+	return 0;
+    }
+#endif
+    /* It may have been truncated before the lease was taken. */
+    if(fstat(lease_fd, &st) != 0 || st.st_size < length
+#ifndef F_SETLEASE
+       || (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0
+#endif
+       )
+    {
+	close(lease_fd);
+	return 0;
+    }
+    l = rep_alloc(sizeof(struct file_lease));
+    if(l == 0)
+    {
+	close(lease_fd);
+	return 0;
+    }
+    l->map_base = 0;
+    l->fd = lease_fd;
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+    return l;
+}
+
+/* Called when the mapping at BASE has been dropped, to give up the
+   lease on its file. */
+void
+forget_file_lease(char *base)
+{
+    struct file_lease **ptr = &file_leases;
+    while(*ptr != 0)
+    {
+	if((*ptr)->map_base == base)
+	{
+	    struct file_lease *l = *ptr;
+	    *ptr = l->next;
+	    close(l->fd);
+	    rep_free(l);
+	    return;
+	}
+	ptr = &(*ptr)->next;
+    }
+}
+
+/* Try to load the file open on FD, FILE-LENGTH bytes long, by mapping
+   it into memory. Each line points straight into the mapping until it's
+   modified, when it gets copied (see make_line_writable()). Only done
+   for files at least `mmap-file-threshold' bytes long. Returns false
+   if the file wasn't loaded, leaving the line list killed. */
+static bool
+map_file_into_tx(Lisp_Buffer *tx, int fd, intptr_t file_length)
+{
+    repv threshold = Fsymbol_value(Qmmap_file_threshold, Qt);
+    char *base, *cur, *end, *eol, *copy;
+    intptr_t row, lines = 1;
+    LINE *line;
+    struct file_lease *l;
+
+    if(!rep_INTP(threshold) || file_length <= 0
+       || file_length < rep_INT(threshold))
+	return false;
+    l = lease_file(fd, file_length);
+    if(l == 0)
+	return false;
+    base = line_arena_map(&tx->line_arena, fd, file_length);
+    if(base == 0)
+    {
+	close(l->fd);
+	rep_free(l);
+	return false;
+    }
+    l->map_base = base;
+    l->next = file_leases;
+    file_leases = l;
+    end = base + file_length;
 
-    if(!resize_line_list(tx, row - alloced_lines, row))
-	goto abortmem;
+    for(cur = base; (eol = memchr(cur, '\n', end - cur)); cur = eol + 1)
+	lines++;
+    if(!resize_line_list(tx, lines, 0))
+	goto abort;
+
+    row = 0;
+    for(cur = base; (eol = memchr(cur, '\n', end - cur)); cur = eol + 1)
+    {
+	line = &TX_LINE(tx, row);
+	line->ln_Strlen = (eol - cur) + 1;
+	if(LINE_INLINE_P(line))
+	{
+	    memcpy(line->ln_Text.local, cur, eol - cur);
+	    line->ln_Text.local[eol - cur] = 0;
+	}
+	else
+	    line->ln_Text.heap = cur;
+	row++;
+    }
+
+    /* The last line has no newline to stand in for its terminator,
+       so it always gets its own copy. */
+    copy = make_loaded_line(&TX_LINE(tx, row), &tx->line_arena, end - cur);
+    if(copy == NULL)
+	goto abort;
+    memcpy(copy, cur, end - cur);
 
     tx->logical_start = 0;
     tx->logical_end = tx->line_count;
-
     tx->change_count++;
-    rc = true;
+    return true;
+
+abort:
+    kill_line_list(tx);
+    return false;
+}
 
-    if(0)
+/* True if some lines of snapshot SNAP point into a mapping of the file
+   described by ST. */
+#define SNAPSHOT_MAPS_P(snap, st)					\
+    ((snap)->map_base != 0 && (snap)->map_copy == 0			\
+     && (snap)->map_dev == (st)->st_dev && (snap)->map_ino == (st)->st_ino)
+
+static void finish_background_saves(struct stat *st);
+
+/* Stop using mappings of the file described by ST. Any buffers whose
+   lines still point into one get their own copies of the text, as do
+   their snapshots; background saves reading such snapshots are allowed
+   to finish. Then the leases on the file are given up, nothing will
+   read the mappings again. Returns false if no memory. */
+static bool
+copy_mapped_file(struct stat *st)
+{
+    Lisp_Buffer *tx;
+#ifdef F_SETLEASE
+    struct file_lease *l;
+#endif
+    finish_background_saves(st);
+    for(tx = buffer_chain; tx != 0; tx = tx->next)
+    {
+	if(tx->line_arena.map_base != 0
+	   && tx->line_arena.map_dev == st->st_dev
+	   && tx->line_arena.map_ino == st->st_ino
+	   && !unmap_line_list(tx))
+	{
+	    return false;
+	}
+	if(tx->batch_text != 0 && SNAPSHOT_MAPS_P(tx->batch_text, st)
+	   && !unmap_buffer_snapshot(tx->batch_text))
+	{
+	    return false;
+	}
+    }
+#ifdef F_SETLEASE
+    for(l = file_leases; l != 0; l = l->next)
     {
-	/* This only gets executed if we aborted while reading the file. */
-abortmem:
-	rep_mem_error();
-	clear_line_list(tx);
+	if(l->dev == st->st_dev && l->ino == st->st_ino)
+	    fcntl(l->fd, F_SETLEASE, F_UNLCK);
     }
+#endif
+    return true;
+}
+
+/* Called before the file called FILE-NAME is overwritten in place, see
+   copy_mapped_file(). Our own lease would hold up opening it too. */
+static bool
+release_mapped_file(repv file_name)
+{
+    struct stat st;
+    if(stat(rep_STR(file_name), &st) != 0)
+	return true;
+    return copy_mapped_file(&st);
+}
 
-    return(rc);
+/* Add the LEN bytes at BASE to the COUNT pieces in IOV, joining them
+   onto the last piece if they follow on from it in memory (as the lines
+   of a mapped file do). Returns the new count. */
+static inline int
+add_write_piece(struct iovec *iov, int count, char *base, size_t len)
+{
+    if(count > 0
+       && (char *) iov[count-1].iov_base + iov[count-1].iov_len == base)
+    {
+	iov[count-1].iov_len += len;
+	return count;
+    }
+    iov[count].iov_base = base;
+    iov[count].iov_len = len;
+    return count + 1;
+}
+
+/* Write all COUNT pieces in IOV to FD. Returns false if an error
+   occurred, with errno set. */
+static bool
+write_pieces(int fd, struct iovec *iov, int count)
+{
+    while(count > 0)
+    {
+#ifdef HAVE_WRITEV
+	ssize_t done = writev(fd, iov, count);
+#else
+	ssize_t done = write(fd, iov->iov_base, iov->iov_len);
+#endif
+	if(done < 0)
+	{
+	    if(errno == EINTR)
+		continue;
+	    return false;
+	}
+	while(count > 0 && (size_t) done >= iov->iov_len)
+	{
+	    done -= iov->iov_len;
+	    iov++;
+	    count--;
+	}
+	if(count > 0)
+	{
+	    iov->iov_base = (char *) iov->iov_base + done;
+	    iov->iov_len -= done;
+	}
+    }
+    return true;
+}
+
+/* State while writing text to a file descriptor. Text is sent in
+   batches of up to WRITE_BATCH pieces; short lines are copied together
+   into a staging area first, the kernel copes much better with a few big
+   pieces than with lots of little ones. */
+struct write_state {
+    int fd;
+    struct iovec iov[WRITE_BATCH];
+    int count;
+    char *stage, *stage_ptr;
+};
+
+/* Start writing to FD using W. Returns false if no memory. This and
+   the other writing functions may be called by any thread, so use
+   malloc() rather than rep_alloc(). */
+static bool
+start_writing(struct write_state *w, int fd)
+{
+    w->fd = fd;
+    w->count = 0;
+    w->stage = w->stage_ptr = malloc(WRITE_STAGE_SIZE);
+    return w->stage != 0;
+}
+
+/* Write the LEN bytes at TEXT using W, followed by a newline if EOL.
+   MAPPED is true if TEXT is part of a mapped file, so is already
+   followed by its newline. Returns false if an error occurred, with
+   errno set. */
+static bool
+write_text(struct write_state *w, char *text, intptr_t len,
+	   bool eol, bool mapped)
+{
+    static char newline[] = "\n";
+    if(mapped)
+    {
+	/* A mapped line is followed by its own newline, and by the
+	   next line, so they join into one piece. */
+	w->count = add_write_piece(w->iov, w->count, text, len + eol);
+    }
+    else if(len < WRITE_COPY_MAX)
+    {
+	memcpy(w->stage_ptr, text, len);
+	if(eol)
+	    w->stage_ptr[len] = '\n';
+	w->count = add_write_piece(w->iov, w->count, w->stage_ptr, len + eol);
+	w->stage_ptr += len + eol;
+    }
+    else
+    {
+	w->count = add_write_piece(w->iov, w->count, text, len);
+	if(eol)
+	    w->count = add_write_piece(w->iov, w->count, newline, 1);
+    }
+    if(w->count > WRITE_BATCH - 2
+       || w->stage_ptr + WRITE_COPY_MAX > w->stage + WRITE_STAGE_SIZE)
+    {
+	int count = w->count;
+	w->count = 0;
+	w->stage_ptr = w->stage;
+	return write_pieces(w->fd, w->iov, count);
+    }
+    return true;
+}
+
+/* Finish writing using W, flushing anything not yet written if OK is
+   true. Returns OK, or false if an error occurred flushing, with errno
+   set. */
+static bool
+finish_writing(struct write_state *w, bool ok)
+{
+    if(ok)
+	ok = write_pieces(w->fd, w->iov, w->count);
+    if(w->stage != 0)
+    {
+	int error = errno;
+	free(w->stage);
+	errno = error;
+    }
+    return ok;
+}
+
+/* Write the text of TX between START and END to FD. Returns false if an
+   error occurred, with errno set. */
+static bool
+write_section(Lisp_Buffer *tx, int fd, repv start, repv end)
+{
+    struct write_state w;
+    intptr_t row = VROW(start);
+    intptr_t col = MIN(VCOL(start), TX_LINE(tx, row).ln_Strlen - 1);
+    bool rc = start_writing(&w, fd);
+
+    if(!rc)
+	errno = ENOMEM;
+    for(; row <= VROW(end) && rc; row++, col = 0)
+    {
+	LINE *line = &TX_LINE(tx, row);
+	intptr_t len = (((row == VROW(end))
+			 ? MIN(VCOL(end), line->ln_Strlen - 1)
+			 : line->ln_Strlen - 1) - col);
+	rc = write_text(&w, LINE_TEXT(line) + col, len, row != VROW(end),
+			LINE_MAPPED_P(tx, line));
+    }
+    return finish_writing(&w, rc);
+}
+
+/* Write all the text in SNAP to FD. This may be called by any thread.
+   Returns false if an error occurred, with errno set. */
+static bool
+write_snapshot(Buffer_Snapshot *snap, int fd)
+{
+    struct write_state w;
+    intptr_t row;
+    bool rc = start_writing(&w, fd);
+
+    if(!rc)
+	errno = ENOMEM;
+    for(row = 0; row < snap->line_count && rc; row++)
+    {
+	LINE *line = &snap->lines[row];
+	rc = write_text(&w, LINE_TEXT(line), line->ln_Strlen - 1,
+			row < snap->line_count - 1,
+			(!LINE_INLINE_P(line)
+			 && ((uintptr_t) line->ln_Text.heap
+			     - (uintptr_t) snap->map_base < snap->map_length)));
+    }
+    return finish_writing(&w, rc);
+}
+
+/* A file being saved. */
+struct save_target {
+    char *name;
+    char *temp;				/* name being written, or null if
+					   overwriting NAME in place */
+    int fd;
+    bool sync_file, sync_dir;		/* from save-file-durability */
+};
+
+/* Synchronize the directory containing the file called NAME to disk,
+   so that a rename in it is durable. Errors are ignored, some systems
+   can't synchronize directories at all. */
+static void
+sync_directory_of(const char *name)
+{
+#ifdef HAVE_FSYNC
+    const char *slash = strrchr(name, '/');
+    const char *dir = (slash == 0) ? "." : (slash == name) ? "/" : 0;
+    char *copy = 0;
+    int fd;
+    if(dir == 0)
+    {
+	copy = malloc(slash - name + 1);
+	if(copy == 0)
+	    return;
+	memcpy(copy, name, slash - name);
+	copy[slash - name] = 0;
+	dir = copy;
+    }
+    fd = open(dir, O_RDONLY);
+    if(fd >= 0)
+    {
+	fsync(fd);
+	close(fd);
+    }
+    if(copy != 0)
+	free(copy);
+#endif
+}
+
+/* Open T to save the file called FILE. Normally a new file is created
+   in the same directory, to be renamed over FILE once it's complete, so
+   a failure never leaves FILE half-written. Files which that would
+   change in other ways (symbolic links, files with several links, files
+   owned by someone else) are overwritten in place instead. Must be
+   called by the main thread. Returns 1 if okay, 0 if no memory, -1 if
+   an I/O error (with errno set). */
+static int
+open_save_target(struct save_target *t, repv file)
+{
+    repv durability = Fsymbol_value(Qsave_file_durability, Qt);
+    struct stat st;
+    bool exists;
+
+    t->name = rep_STR(file);
+    t->temp = 0;
+    t->sync_file = !rep_NILP(durability);
+    t->sync_dir = t->sync_file && durability != Qfsync;
+    exists = (lstat(t->name, &st) == 0);
+
+#if defined (HAVE_MKSTEMP) && defined (HAVE_UNISTD_H)
+    if(!exists || (S_ISREG(st.st_mode) && st.st_nlink == 1
+		   && st.st_uid == geteuid()))
+    {
+	t->temp = malloc(strlen(t->name) + sizeof(".XXXXXX"));
+	if(t->temp == 0)
+	    return 0;
+	strcpy(t->temp, t->name);
+	strcat(t->temp, ".XXXXXX");
+	t->fd = mkstemp(t->temp);
+	if(t->fd >= 0)
+	{
+	    mode_t mode;
+	    if(exists)
+		mode = st.st_mode & 07777;
+	    else
+	    {
+		mode = umask(0);
+		umask(mode);
+		mode = 0666 & ~mode;
+	    }
+	    if(fchmod(t->fd, mode) == 0
+	       && (!exists || st.st_gid == getegid()
+		   || fchown(t->fd, -1, st.st_gid) == 0))
+	    {
+		return 1;
+	    }
+	    /* Couldn't give the new file the same attributes as the
+	       old one, so it'll have to be overwritten. */
+	    close(t->fd);
+	    unlink(t->temp);
+	}
+	free(t->temp);
+	t->temp = 0;
+    }
+#endif
+
+    if(!release_mapped_file(file))
+	return 0;
+    t->fd = open(t->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    return (t->fd < 0) ? -1 : 1;
+}
+
+/* Finish saving T, whose contents have been written if OK is true. The
+   file is synchronized to disk as save-file-durability asks, then put
+   in place; if not OK, a new file is deleted. This may be called by any
+   thread. Returns false if the save failed, with errno set. */
+static bool
+close_save_target(struct save_target *t, bool ok)
+{
+#ifdef HAVE_FSYNC
+    if(ok && t->sync_file && fsync(t->fd) != 0)
+	ok = false;
+#endif
+    if(ok)
+	ok = (close(t->fd) == 0);
+    else
+    {
+	int error = errno;
+	close(t->fd);
+	errno = error;
+    }
+    if(t->temp != 0)
+    {
+	if(ok)
+	    ok = (rename(t->temp, t->name) == 0);
+	if(!ok)
+	{
+	    int error = errno;
+	    unlink(t->temp);
+	    errno = error;
+	}
+	free(t->temp);
+	t->temp = 0;
+	if(ok && t->sync_dir)
+	    sync_directory_of(t->name);
+    }
+    return ok;
+}
+
+/* Write the text of TX between START and END to the file called FILE.
+   Returns 1 if okay, 0 if no memory, -1 if an I/O error (with errno
+   set). */
+static int
+save_section(Lisp_Buffer *tx, repv file, repv start, repv end)
+{
+    struct save_target t;
+    int rc = open_save_target(&t, file);
+    if(rc <= 0)
+	return rc;
+    return close_save_target(&t, write_section(tx, t.fd, start, end)) ? 1 : -1;
 }
 
 
@@ -227,42 +1168,28 @@ the buffer (ignoring the current restriction).
 
     if(rep_NILP(handler))
     {
-	intptr_t row, col;
-	FILE *fh;
-
 	/* Don't call check_section() since that looks at the restriction. */
 	if(POS_LESS_P(end, start) || VROW(start) < 0
-	   || VROW(end) > tx->line_count)
+	   || VROW(end) >= tx->line_count)
 	    return(Fsignal(Qinvalid_area, rep_list_3(rep_VAL(tx), start, end)));
 
 	if(rep_FILEP(file))
-	    fh = rep_FILE(file)->file.fh;
-	else
 	{
-	    fh = fopen(rep_STR(file), "w");
-	    if(fh == 0)
+	    FILE *fh = rep_FILE(file)->file.fh;
+	    if(fflush(fh) != 0
+	       || !write_section(tx, fileno(fh), start, end))
+	    {
 		return rep_signal_file_error(file);
+	    }
 	}
-
-	row = VROW(start);
-	col = MIN(VCOL(start), tx->lines[row].ln_Strlen - 1);
-
-	while(row <= VROW(end))
+	else
 	{
-	    int len = (((row == VROW(end))
-			? VCOL(end) : tx->lines[row].ln_Strlen - 1) - col);
-	    if(len > 0
-	       && fwrite(tx->lines[row].ln_Line + col, 1, len, fh) != len) 
-	    {
+	    int rc = save_section(tx, file, start, end);
+	    if(rc < 0)
 		return rep_signal_file_error(file);
-	    }
-	    if(row != VROW(end))
-		fputc('\n', fh);
-	    col = 0;
-	    row++;
+	    else if(rc == 0)
+		return rep_mem_error();
 	}
-	if(!rep_FILEP(file))
-	    fclose(fh);
 	return file;
     }
     else
@@ -300,7 +1227,7 @@ object to be used. Also removes any restriction on BUFFER.
 	if(rep_FILEP(file))
 	{
 	    fh = rep_FILE(file)->file.fh;
-	    file_length = rep_file_length(rep_FILE(file)->handler_data);
+	    file_length = -1;
 	}
 	else
 	{
@@ -313,7 +1240,9 @@ object to be used. Also removes any restriction on BUFFER.
 	start = make_pos(0, 0);
 	undo_record_deletion(tx, start, Fend_of_buffer(rep_VAL(tx), Qt));
 	kill_line_list(tx);
-	if(read_file_into_tx(tx, fh, file_length))
+	if((!rep_FILEP(file)
+	    && map_file_into_tx(tx, fileno(fh), file_length))
+	   || read_file_into_tx(tx, file, fh))
 	{
 	    undo_record_insertion(tx, start, Fend_of_buffer(rep_VAL(tx), Qt));
 	    res = rep_VAL(tx);
@@ -377,6 +1306,208 @@ before the cursor in the current buffer.
 				     Qinsert_file_contents, 1, file);
 }
 
+
+/* Saving in the background
+
+   A background save writes a snapshot of a buffer (see snapshot.c) from
+   its own thread, so the editor carries on while even a huge buffer is
+   written out. When the thread finishes it writes the address of its
+   save to a pipe; the event loop then calls background_save_done() in
+   the main thread, which runs the save's callback. */
+
+struct background_save {
+    struct background_save *next;
+    repv entry;				/* (BUFFER FILE CALLBACK) */
+    Buffer_Snapshot *snap;
+    struct save_target target;
+    bool ok;
+    int error;
+#ifdef USE_THREADS
+    pthread_t thread;
+    bool started;
+#endif
+};
+
+static struct background_save *background_saves;
+
+/* The entries of all unfinished saves, to protect them from the GC. */
+static repv background_save_entries;
+
+/* Finished saves are announced by writing their address to this pipe. */
+static int background_save_pipe[2] = { -1, -1 };
+
+/* Write the snapshot of save ARG to its file. */
+static void *
+write_in_background(void *arg)
+{
+    struct background_save *s = arg;
+    s->ok = close_save_target(&s->target,
+			      write_snapshot(s->snap, s->target.fd));
+    s->error = errno;
+    while(write(background_save_pipe[1], &s, sizeof(s)) < 0
+	  && errno == EINTR)
+	;
+    return 0;
+}
+
+/* Called from the event loop when a background save has finished. */
+static void
+background_save_done(int fd)
+{
+    struct background_save *s, **ptr;
+    repv entry, status;
+    rep_GC_root gc_entry, gc_status;
+
+    if(read(fd, &s, sizeof(s)) != sizeof(s))
+	return;
+#ifdef USE_THREADS
+    if(s->started)
+	pthread_join(s->thread, 0);
+#endif
+    for(ptr = &background_saves; *ptr != s; ptr = &(*ptr)->next)
+	;
+    *ptr = s->next;
+
+    entry = s->entry;
+    background_save_entries = Fdelq(entry, background_save_entries);
+    status = s->ok ? Qt : rep_string_copy(strerror(s->error));
+    release_buffer_snapshot(s->snap);
+    rep_free(s);
+
+    rep_PUSHGC(gc_entry, entry);
+    rep_PUSHGC(gc_status, status);
+    if(!rep_NILP(rep_CAR(rep_CDDR(entry))))
+	rep_call_lisp2(rep_CAR(rep_CDDR(entry)), rep_CAR(entry), status);
+    rep_POPGC; rep_POPGC;
+}
+
+/* Wait until no background save is reading a snapshot that points into
+   the mapped file described by ST. Their callbacks are still called from
+   the event loop as normal. */
+static void
+finish_background_saves(struct stat *st)
+{
+#ifdef USE_THREADS
+    struct background_save *s;
+    for(s = background_saves; s != 0; s = s->next)
+    {
+	if(s->started && SNAPSHOT_MAPS_P(s->snap, st))
+	{
+	    pthread_join(s->thread, 0);
+	    s->started = false;
+	}
+    }
+#endif
+}
+
+/* Wait for all background saves to finish. */
+void
+wait_for_background_saves(void)
+{
+    while(background_saves != 0)
+	background_save_done(background_save_pipe[0]);
+}
+
+DEFUN("write-buffer-contents-in-background",
+      Fwrite_buffer_contents_in_background,
+      Swrite_buffer_contents_in_background,
+      (repv file, repv callback), rep_Subr2) /*
+::doc:write-buffer-contents-in-background::
+write-buffer-contents-in-background FILE-NAME [CALLBACK]
+
+Starts writing all the text in the current buffer (ignoring the current
+restriction) to the file called FILE-NAME, then returns without waiting
+for it to be written. The text is saved as it was when this function was
+called, later changes to the buffer don't affect it.
+
+When the file has been written, CALLBACK is called with two arguments,
+the buffer and either t, or a string describing why the file couldn't
+be saved.
+
+Returns nil if the buffer is already being saved in the background,
+otherwise t. Files which need a file handler are written immediately,
+any errors being signalled as by write-buffer-contents.
+::end:: */
+{
+    Lisp_Buffer *tx = curr_vw->tx;
+    struct background_save *s;
+    repv handler, tem;
+    int rc;
+
+    rep_DECLARE1(file, rep_STRINGP);
+    for(s = background_saves; s != 0; s = s->next)
+    {
+	if(rep_CAR(s->entry) == rep_VAL(tx))
+	    return Qnil;
+    }
+
+    handler = rep_get_handler_from_file_or_name(&file,
+						rep_op_write_buffer_contents);
+    if(handler == 0)
+	return handler;
+    if(rep_NILP(handler) && background_save_pipe[0] < 0)
+    {
+	if(pipe(background_save_pipe) != 0)
+	    return rep_signal_file_error(file);
+	fcntl(background_save_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(background_save_pipe[1], F_SETFD, FD_CLOEXEC);
+	rep_register_input_fd(background_save_pipe[0], background_save_done);
+    }
+    if(!rep_NILP(handler))
+    {
+	rep_GC_root gc_callback;
+	rep_PUSHGC(gc_callback, callback);
+	tem = Fwrite_buffer_contents(file, Qnil, Qnil);
+	rep_POPGC;
+	if(tem == 0)
+	    return 0;
+	if(!rep_NILP(callback))
+	    rep_call_lisp2(callback, rep_VAL(tx), Qt);
+	return Qt;
+    }
+
+    s = rep_alloc(sizeof(struct background_save));
+    if(s == 0)
+	return rep_mem_error();
+    rc = open_save_target(&s->target, file);
+    if(rc <= 0)
+    {
+	rep_free(s);
+	return (rc < 0) ? rep_signal_file_error(file) : rep_mem_error();
+    }
+    /* The file is opened first, in case it was mapped by the buffer. */
+    s->snap = make_buffer_snapshot(tx);
+    if(s->snap == 0)
+    {
+	errno = ENOMEM;
+	close_save_target(&s->target, false);
+	rep_free(s);
+	return rep_mem_error();
+    }
+    s->entry = rep_list_3(rep_VAL(tx), file, callback);
+    background_save_entries = Fcons(s->entry, background_save_entries);
+    s->next = background_saves;
+    background_saves = s;
+
+#ifdef USE_THREADS
+    {
+	/* The editor's signals must only ever be handled by the main
+	   thread. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	s->started = (pthread_create(&s->thread, 0,
+				     write_in_background, s) == 0);
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+	if(!s->started)
+	    write_in_background(s);
+    }
+#else
+    write_in_background(s);
+#endif
+    return Qt;
+}
+
 
 /* init */
 
@@ -390,11 +1521,19 @@ files_init(void)
     rep_INTERN(write_buffer_contents);
     rep_INTERN(read_file_contents);
     rep_INTERN(insert_file_contents);
+    rep_INTERN_SPECIAL(mmap_file_threshold);
+    Fset(Qmmap_file_threshold, Qnil);
+    rep_INTERN_SPECIAL(save_file_durability);
+    Fset(Qsave_file_durability, Qnil);
+    rep_INTERN(fsync);
+    background_save_entries = Qnil;
+    rep_mark_static(&background_save_entries);
 
 #if rep_INTERFACE >= 9
     tem = rep_push_structure ("rep");
 #endif
     rep_ADD_SUBR_INT(Swrite_buffer_contents);
+    rep_ADD_SUBR(Swrite_buffer_contents_in_background);
     rep_ADD_SUBR(Sread_file_contents);
     rep_ADD_SUBR(Sinsert_file_contents);
 #if rep_INTERFACE >= 9
@@ -24,6 +24,10 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 
 /* Basic buffer utility functions. These are also used by the regjade.c
    regexp code.
@@ -38,22 +42,29 @@
 bool
 buffer_strpbrk(Lisp_Buffer *tx, Pos *pos, const char *chars)
 {
-    LINE *line = tx->lines + PROW(pos);
+    LINE *line = &TX_LINE(tx, PROW(pos));
     int chars_has_newline = strchr(chars, '\n') ? 1 : 0;
+    size_t chars_len = strlen(chars);
 
     if(PCOL(pos) >= line->ln_Strlen)
     {
 	PCOL(pos) = 0;
 	PROW(pos)++;
-	line++;
+	line = &TX_LINE(tx, PROW(pos));
     }
 
     while(PROW(pos) < tx->logical_end)
     {
-	char *ptr = strpbrk(line->ln_Line + PCOL(pos), chars);
-	if(ptr != NULL)
+	/* Lines aren't necessarily zero-terminated (they may be part
+	   of a mapped file), so can't use strpbrk() */
+	char *text = LINE_TEXT(line);
+	char *ptr = text + PCOL(pos);
+	char *end = text + line->ln_Strlen - 1;
+	while(ptr < end && (*ptr == 0 || !memchr(chars, *ptr, chars_len)))
+	    ptr++;
+	if(ptr < end)
 	{
-	    PCOL(pos) = ptr - line->ln_Line;
+	    PCOL(pos) = ptr - text;
 	    return true;
 	}
 	else if(chars_has_newline)
@@ -63,7 +74,7 @@ buffer_strpbrk(Lisp_Buffer *tx, Pos *pos, const char *chars)
 	}
 	PCOL(pos) = 0;
 	PROW(pos)++;
-	line++;
+	line = &TX_LINE(tx, PROW(pos));
     }
     return false;
 }
@@ -72,7 +83,7 @@ buffer_strpbrk(Lisp_Buffer *tx, Pos *pos, const char *chars)
 bool
 buffer_reverse_strpbrk(Lisp_Buffer *tx, Pos *pos, const char *chars)
 {
-    LINE *line = tx->lines + PROW(pos);
+    LINE *line = &TX_LINE(tx, PROW(pos));
     int chars_has_newline = strchr(chars, '\n') ? 1 : 0;
 
     if(PCOL(pos) >= line->ln_Strlen)
@@ -83,19 +94,22 @@ buffer_reverse_strpbrk(Lisp_Buffer *tx, Pos *pos, const char *chars)
     }
     while(1)
     {
-	char *match = line->ln_Line + PCOL(pos);
-	while(match >= line->ln_Line)
+	char *text = LINE_TEXT(line);
+	char *match = text + PCOL(pos);
+	while(match >= text)
 	{
-	    if(strchr(chars, *match) != NULL)
+	    /* The end of the line always matches */
+	    if(match == text + line->ln_Strlen - 1
+	       || strchr(chars, *match) != NULL)
 	    {
-		PCOL(pos) = match - line->ln_Line;
+		PCOL(pos) = match - text;
 		return true;
 	    }
 	    match--;
 	}
-	line--;
 	if(--PROW(pos) < tx->logical_start)
 	    return false;
+	line = &TX_LINE(tx, PROW(pos));
 	PCOL(pos) = line->ln_Strlen - 1;
 	if(chars_has_newline)
 	    return true;
@@ -106,19 +120,19 @@ buffer_reverse_strpbrk(Lisp_Buffer *tx, Pos *pos, const char *chars)
 bool
 buffer_strchr(Lisp_Buffer *tx, Pos *pos, char c)
 {
-    LINE *line = tx->lines + PROW(pos);
+    LINE *line = &TX_LINE(tx, PROW(pos));
     if(PCOL(pos) >= line->ln_Strlen)
     {
 	PCOL(pos) = 0;
 	PROW(pos)++;
-	line++;
+	line = &TX_LINE(tx, PROW(pos));
     }
 
     if(c == '\n')
     {
 	if(PROW(pos) < tx->logical_end - 1)
 	{
-	    PCOL(pos) = tx->lines[PROW(pos)].ln_Strlen - 1;
+	    PCOL(pos) = TX_LINE(tx, PROW(pos)).ln_Strlen - 1;
 	    return true;
 	}
 	else
@@ -131,15 +145,17 @@ buffer_strchr(Lisp_Buffer *tx, Pos *pos, char c)
     {
 	while(PROW(pos) < tx->logical_end)
 	{
-	    char *match = strchr(line->ln_Line + PCOL(pos), c);
+	    char *text = LINE_TEXT(line);
+	    char *match = memchr(text + PCOL(pos), c,
+				 line->ln_Strlen - 1 - PCOL(pos));
 	    if(match)
 	    {
-		PCOL(pos) = match - line->ln_Line;
+		PCOL(pos) = match - text;
 		return true;
 	    }
 	    PROW(pos)++;
 	    PCOL(pos) = 0;
-	    line++;
+	    line = &TX_LINE(tx, PROW(pos));
 	}
 	return false;
     }
@@ -149,7 +165,7 @@ buffer_strchr(Lisp_Buffer *tx, Pos *pos, char c)
 bool
 buffer_reverse_strchr(Lisp_Buffer *tx, Pos *pos, char c)
 {
-    LINE *line = tx->lines + PROW(pos);
+    LINE *line = &TX_LINE(tx, PROW(pos));
 
     if(PCOL(pos) >= line->ln_Strlen)
 	PCOL(pos) = line->ln_Strlen - 1;
@@ -162,8 +178,8 @@ buffer_reverse_strchr(Lisp_Buffer *tx, Pos *pos, char c)
 	    return false;
 	else
 	{
-	    line--;
 	    PROW(pos)--;
+	    line = &TX_LINE(tx, PROW(pos));
 	    PCOL(pos) = line->ln_Strlen - 1;
 	    return true;
 	}
@@ -172,73 +188,348 @@ buffer_reverse_strchr(Lisp_Buffer *tx, Pos *pos, char c)
     {
 	while(1)
 	{
-	    char *match = line->ln_Line + PCOL(pos);
-	    while(match >= line->ln_Line)
+	    char *text = LINE_TEXT(line);
+	    char *match = text + PCOL(pos);
+	    while(match >= text)
 	    {
 		if(*match == c)
 		{
-		    PCOL(pos) = match - line->ln_Line;
+		    PCOL(pos) = match - text;
 		    return true;
 		}
 		match--;
 	    }
 	    if(PROW(pos) == tx->logical_start)
 		return false;
-	    line--;
 	    PROW(pos)--;
+	    line = &TX_LINE(tx, PROW(pos));
 	    PCOL(pos) = line->ln_Strlen - 1;
 	}
     }
 }
 
-/* Compares the string STR to the contents of TX at POS using the function
-   CMPFN to do the comparison (must be a pointer to either strncmp() or
-   strncasecmp(), or something with the same interface).
-   Leaves POS at the end of the match if it returns true. */
-/* The argument CMPFN is declared void * to hopefully avoid irksome
-   compiler warnings. */
-#define CMPFN ((int (*)(const char *, const char *, size_t))cmpfn)
+/* Case is ignored by folding ASCII letters to lower case. */
+#define FOLD(c) (((c) >= 'A' && (c) <= 'Z') ? (c) + ('a' - 'A') : (c))
+
+#ifdef __SSE2__
+/* FOLD() for sixteen bytes at once. Adding 0x80 - 'A' takes the upper
+   case letters to the bottom 26 values of the signed range, which a
+   single comparison picks out. */
+static inline __m128i
+fold_16(__m128i x)
+{
+    __m128i t = _mm_add_epi8(x, _mm_set1_epi8((char) (0x80 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(t, _mm_set1_epi8((char) (0x80 + 26)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+/* True if the N bytes at A and B are the same, ignoring case when
+   NOCASE. */
+static bool
+mem_equal(const unsigned char *a, const unsigned char *b,
+	  intptr_t n, bool nocase)
+{
+    if(!nocase)
+	return memcmp(a, b, n) == 0;
+#ifdef __SSE2__
+    for(; n >= 16; a += 16, b += 16, n -= 16)
+    {
+	__m128i x = fold_16(_mm_loadu_si128((const __m128i *) a));
+	__m128i y = fold_16(_mm_loadu_si128((const __m128i *) b));
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+	    return false;
+    }
+#endif
+    for(; n > 0; a++, b++, n--)
+    {
+	if(FOLD(*a) != FOLD(*b))
+	    return false;
+    }
+    return true;
+}
+
+/* Compares the N bytes at STR to the contents of TX at POS, ignoring
+   case when NOCASE. Leaves POS at the end of the match if it returns
+   true, otherwise it's unchanged. */
 bool
 buffer_compare_n(Lisp_Buffer *tx, Pos *pos,
-		 const char *str, int n, void *cmpfn)
+		 const char *str, intptr_t n, bool nocase)
 {
-    LINE *line = tx->lines + PROW(pos);
+    intptr_t row = PROW(pos), col = PCOL(pos);
+    LINE *line = &TX_LINE(tx, row);
 
-    if(PCOL(pos) >= line->ln_Strlen)
+    if(col >= line->ln_Strlen)
     {
-	PCOL(pos) = 0;
-	PROW(pos)++;
-	line++;
+	col = 0;
+	row++;
     }
 
-    while(n > 0 && PROW(pos) < tx->logical_end)
+    while(row < tx->logical_end)
     {
-	char *chunk = strchr(str, '\n');
-	int len;
-	if(chunk == NULL)
-	    len = strlen(str);
-	else
-	    len = chunk - str;
-	if(len > n)
-	    len = n;
-	if(len > 0)
+	const char *newline = memchr(str, '\n', n);
+	intptr_t len = (newline != 0) ? newline - str : n;
+	line = &TX_LINE(tx, row);
+	if(col + len > line->ln_Strlen - 1
+	   || !mem_equal((unsigned char *) LINE_TEXT(line) + col,
+			 (unsigned char *) str, len, nocase))
+	    return false;
+	col += len;
+	if(newline == 0)
 	{
-	    if(CMPFN(line->ln_Line + PCOL(pos), str, len) != 0)
-		return false;
-	    PCOL(pos) += len;
-	    n -= len;
-	    if(len == 0 || chunk == NULL)
-		return true;	/* looked at all n */
+	    PROW(pos) = row;
+	    PCOL(pos) = col;
+	    return true;
 	}
-	if(PCOL(pos) != line->ln_Strlen - 1)
+	/* There's no newline after the last line. */
+	if(col != line->ln_Strlen - 1 || row == tx->logical_end - 1)
 	    return false;
-	n--;
-	PCOL(pos) = 0;
-	PROW(pos)++;
-	line++;
-	str = chunk + 1;
+	str = newline + 1;
+	n -= len + 1;
+	col = 0;
+	row++;
+    }
+    return false;
+}
+
+/* A string being searched for. Strings without newlines are looked for
+   in each line with the SIMD filter below, or Horspool's algorithm.
+   The part of any other string before its first newline has to end a
+   line, so each line has a single place where it can match. */
+struct literal {
+    const unsigned char *str;
+    intptr_t len;
+    intptr_t head;		/* bytes before the first newline */
+    bool nocase;
+
+    /* Horspool shifts for each (folded) char, searching forwards and
+       backwards. */
+    intptr_t skip[256], rskip[256];
+};
+
+#define LITERAL_CHAR(lit, c) ((lit)->nocase ? FOLD(c) : (c))
+
+static void
+init_literal(struct literal *lit, const char *str, intptr_t len, bool nocase)
+{
+    const char *newline = memchr(str, '\n', len);
+    intptr_t i;
+    lit->str = (const unsigned char *) str;
+    lit->len = len;
+    lit->head = (newline != 0) ? newline - str : len;
+    lit->nocase = nocase;
+    if(newline == 0)
+    {
+	for(i = 0; i < 256; i++)
+	    lit->skip[i] = lit->rskip[i] = len;
+	for(i = 0; i < len - 1; i++)
+	    lit->skip[LITERAL_CHAR(lit, lit->str[i])] = len - 1 - i;
+	for(i = len - 1; i > 0; i--)
+	    lit->rskip[LITERAL_CHAR(lit, lit->str[i])] = i;
+    }
+}
+
+#ifdef __SSE2__
+/* The chars that match the char C of LIT, as vectors of sixteen of
+   each; the same char twice unless C is a letter and case is ignored. */
+static inline void
+literal_char_vectors(struct literal *lit, int c, __m128i *x, __m128i *y)
+{
+    int lower = LITERAL_CHAR(lit, c);
+    int upper = (lit->nocase && lower >= 'a' && lower <= 'z'
+		 ? lower - ('a' - 'A') : lower);
+    *x = _mm_set1_epi8((char) lower);
+    *y = _mm_set1_epi8((char) upper);
+}
+
+/* A bit for each of the sixteen positions from TEXT at which the first
+   and last chars of LIT (F and L, from literal_char_vectors()) match. */
+static inline unsigned int
+literal_candidates(struct literal *lit, const unsigned char *text,
+		   __m128i f0, __m128i f1, __m128i l0, __m128i l1)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *) text);
+    __m128i b = _mm_loadu_si128((const __m128i *) (text + lit->len - 1));
+    __m128i first = _mm_or_si128(_mm_cmpeq_epi8(a, f0), _mm_cmpeq_epi8(a, f1));
+    __m128i last = _mm_or_si128(_mm_cmpeq_epi8(b, l0), _mm_cmpeq_epi8(b, l1));
+    return _mm_movemask_epi8(_mm_and_si128(first, last));
+}
+#endif
+
+/* Returns the first column from FROM at which the single-line LIT
+   matches the LEN chars at TEXT, or -1. */
+static intptr_t
+literal_in_line(struct literal *lit, const unsigned char *text,
+		intptr_t from, intptr_t len)
+{
+    intptr_t m = lit->len;
+    int last = LITERAL_CHAR(lit, lit->str[m - 1]);
+#ifdef __SSE2__
+    if(from + m + 15 <= len)
+    {
+	/* Only check the chars in between where the first and last
+	   chars match, sixteen positions at a time. */
+	__m128i f0, f1, l0, l1;
+	literal_char_vectors(lit, lit->str[0], &f0, &f1);
+	literal_char_vectors(lit, lit->str[m - 1], &l0, &l1);
+	for(; from + m + 15 <= len; from += 16)
+	{
+	    unsigned int mask = literal_candidates(lit, text + from,
+						   f0, f1, l0, l1);
+	    while(mask != 0)
+	    {
+		int i = __builtin_ctz(mask);
+		if(m <= 2 || mem_equal(text + from + i + 1, lit->str + 1,
+				       m - 2, lit->nocase))
+		    return from + i;
+		mask &= mask - 1;
+	    }
+	}
     }
-    return n == 0;
+#endif
+    while(from + m <= len)
+    {
+	int c = LITERAL_CHAR(lit, text[from + m - 1]);
+	if(c == last && mem_equal(text + from, lit->str, m - 1, lit->nocase))
+	    return from;
+	from += lit->skip[c];
+    }
+    return -1;
+}
+
+/* Returns the last column no greater than TO at which the single-line
+   LIT matches the LEN chars at TEXT, or -1. */
+static intptr_t
+literal_in_line_reverse(struct literal *lit, const unsigned char *text,
+			intptr_t to, intptr_t len)
+{
+    intptr_t m = lit->len;
+    int first = LITERAL_CHAR(lit, lit->str[0]);
+    if(to > len - m)
+	to = len - m;
+#ifdef __SSE2__
+    if(to >= 15)
+    {
+	__m128i f0, f1, l0, l1;
+	literal_char_vectors(lit, lit->str[0], &f0, &f1);
+	literal_char_vectors(lit, lit->str[m - 1], &l0, &l1);
+	for(; to >= 15; to -= 16)
+	{
+	    unsigned int mask = literal_candidates(lit, text + to - 15,
+						   f0, f1, l0, l1);
+	    while(mask != 0)
+	    {
+		int i = 31 - __builtin_clz(mask);
+		if(m <= 2 || mem_equal(text + to - 15 + i + 1, lit->str + 1,
+				       m - 2, lit->nocase))
+		    return to - 15 + i;
+		mask &= ~(1U << i);
+	    }
+	}
+    }
+#endif
+    while(to >= 0)
+    {
+	int c = LITERAL_CHAR(lit, text[to]);
+	if(c == first && mem_equal(text + to + 1, lit->str + 1,
+				   m - 1, lit->nocase))
+	    return to;
+	to -= lit->rskip[c];
+    }
+    return -1;
+}
+
+/* For a LIT containing a newline, whose head ends row ROW of TX: true
+   if the rest of it matches the following rows, setting END to where
+   the match ends. */
+static bool
+literal_in_rows(Lisp_Buffer *tx, struct literal *lit, intptr_t row, Pos *end)
+{
+    PROW(end) = row;
+    PCOL(end) = TX_LINE(tx, row).ln_Strlen - 1;
+    return buffer_compare_n(tx, end, (char *) lit->str + lit->head,
+			    lit->len - lit->head, lit->nocase);
+}
+
+/* Search TX for LIT from START forwards. If found, sets START and END
+   to the bounds of the match and returns true. */
+static bool
+literal_search_forward(Lisp_Buffer *tx, struct literal *lit,
+		       Pos *start, Pos *end)
+{
+    intptr_t row, col = PCOL(start), found = 0;
+    if(lit->len == 0)
+	return false;
+    for(row = PROW(start); row < tx->logical_end; row++, col = 0)
+    {
+	LINE *line = &TX_LINE(tx, row);
+	unsigned char *text = (unsigned char *) LINE_TEXT(line);
+	intptr_t len = line->ln_Strlen - 1;
+	if(lit->head == lit->len)
+	{
+	    found = literal_in_line(lit, text, col, len);
+	    if(found >= 0)
+	    {
+		PROW(end) = row;
+		PCOL(end) = found + lit->len;
+		break;
+	    }
+	}
+	else
+	{
+	    found = len - lit->head;
+	    if(found >= col && mem_equal(text + found, lit->str,
+					 lit->head, lit->nocase)
+	       && literal_in_rows(tx, lit, row, end))
+		break;
+	}
+    }
+    if(row >= tx->logical_end)
+	return false;
+    PROW(start) = row;
+    PCOL(start) = found;
+    return true;
+}
+
+/* Search TX for LIT backwards from START, as for the function above. */
+static bool
+literal_search_backward(Lisp_Buffer *tx, struct literal *lit,
+			Pos *start, Pos *end)
+{
+    intptr_t row, col = PCOL(start), found = 0;
+    if(lit->len == 0)
+	return false;
+    for(row = PROW(start); row >= tx->logical_start; row--)
+    {
+	LINE *line = &TX_LINE(tx, row);
+	unsigned char *text = (unsigned char *) LINE_TEXT(line);
+	intptr_t len = line->ln_Strlen - 1;
+	if(row != PROW(start) || col > len)
+	    col = len;
+	if(lit->head == lit->len)
+	{
+	    found = literal_in_line_reverse(lit, text, col, len);
+	    if(found >= 0)
+	    {
+		PROW(end) = row;
+		PCOL(end) = found + lit->len;
+		break;
+	    }
+	}
+	else
+	{
+	    found = len - lit->head;
+	    if(found >= 0 && found <= col
+	       && mem_equal(text + found, lit->str, lit->head, lit->nocase)
+	       && literal_in_rows(tx, lit, row, end))
+		break;
+	}
+    }
+    if(row < tx->logical_start)
+	return false;
+    PROW(start) = row;
+    PCOL(start) = found;
+    return true;
 }
 
 /* Move POS forward COUNT characters in TX. Returns true if the end
@@ -246,7 +537,7 @@ buffer_compare_n(Lisp_Buffer *tx, Pos *pos,
 bool
 forward_char(intptr_t count, Lisp_Buffer *tx, Pos *pos)
 {
-    LINE *line = tx->lines + PROW(pos);
+    LINE *line = &TX_LINE(tx, PROW(pos));
     if(PCOL(pos) >= line->ln_Strlen)
 	PCOL(pos) = line->ln_Strlen - 1;
     while(count > 0)
@@ -262,7 +553,7 @@ forward_char(intptr_t count, Lisp_Buffer *tx, Pos *pos)
 	    PROW(pos)++;
 	    if(PROW(pos) >= tx->logical_end)
 		return false;
-	    line++;
+	    line = &TX_LINE(tx, PROW(pos));
 	    PCOL(pos) = 0;
 	}
     }
@@ -274,7 +565,7 @@ forward_char(intptr_t count, Lisp_Buffer *tx, Pos *pos)
 bool
 backward_char(intptr_t count, Lisp_Buffer *tx, Pos *pos)
 {
-    LINE *line = tx->lines + PROW(pos);
+    LINE *line = &TX_LINE(tx, PROW(pos));
     while(count > 0)
     {
 	if(count <= PCOL(pos))
@@ -288,7 +579,7 @@ backward_char(intptr_t count, Lisp_Buffer *tx, Pos *pos)
 	    PROW(pos)--;
 	    if(PROW(pos) < tx->logical_start)
 		return false;
-	    line--;
+	    line = &TX_LINE(tx, PROW(pos));
 	    PCOL(pos) = line->ln_Strlen - 1;
 	}
     }
@@ -389,34 +680,16 @@ match data.
 	tx = rep_VAL(curr_vw->tx);
     if(check_line(VBUFFER(tx), pos))
     {
-	char first[3];
-	intptr_t len = rep_STRING_LEN(str);
-	Pos start;
+	struct literal lit;
+	Pos start, end;
 	COPY_VPOS(&start, pos);
-	if(!rep_NILP(nocasep))
-	{
-	    first[0] = tolower(rep_STR(str)[0]);
-	    first[1] = toupper(rep_STR(str)[0]);
-	    first[2] = 0;
-	}
-	else
+	init_literal(&lit, rep_STR(str), rep_STRING_LEN(str),
+		     !rep_NILP(nocasep));
+	if(literal_search_forward(VBUFFER(tx), &lit, &start, &end))
 	{
-	    first[0] = rep_STR(str)[0];
-	    first[1] = 0;
-	}
-	while(buffer_strpbrk(VBUFFER(tx), &start, first))
-	{
-	    Pos end = start;
-	    if(buffer_compare_n(VBUFFER(tx), &end, rep_STR(str), len,
-				rep_NILP(nocasep) ? strncmp : strncasecmp))
-	    {
-		repv vstart = make_pos(PCOL(&start), PROW(&start));
-		rep_set_string_match(tx, vstart,
-				     make_pos(PCOL(&end), PROW(&end)));
-		return vstart;
-	    }
-	    if(!forward_char(1, VBUFFER(tx), &start))
-		break;
+	    repv vstart = make_pos(PCOL(&start), PROW(&start));
+	    rep_set_string_match(tx, vstart, make_pos(PCOL(&end), PROW(&end)));
+	    return vstart;
 	}
 	return(Qnil);
     }
@@ -439,34 +712,16 @@ match data.
 	tx = rep_VAL(curr_vw->tx);
     if(check_line(VBUFFER(tx), pos))
     {
-	char first[3];
-	intptr_t len = rep_STRING_LEN(str);
-	Pos start;
+	struct literal lit;
+	Pos start, end;
 	COPY_VPOS(&start, pos);
-	if(!rep_NILP(nocasep))
+	init_literal(&lit, rep_STR(str), rep_STRING_LEN(str),
+		     !rep_NILP(nocasep));
+	if(literal_search_backward(VBUFFER(tx), &lit, &start, &end))
 	{
-	    first[0] = tolower(rep_STR(str)[0]);
-	    first[1] = toupper(rep_STR(str)[0]);
-	    first[2] = 0;
-	}
-	else
-	{
-	    first[0] = rep_STR(str)[0];
-	    first[1] = 0;
-	}
-	while(buffer_reverse_strpbrk(VBUFFER(tx), &start, first))
-	{
-	    Pos end = start;
-	    if(buffer_compare_n(VBUFFER(tx), &end, rep_STR(str), len,
-				rep_NILP(nocasep) ? strncmp : strncasecmp))
-	    {
-		repv vstart = make_pos(PCOL(&start), PROW(&start));
-		rep_set_string_match(tx, vstart,
-				     make_pos(PCOL(&end), PROW(&end)));
-		return vstart;
-	    }
-	    if(!backward_char(1, VBUFFER(tx), &start))
-		break;
+	    repv vstart = make_pos(PCOL(&start), PROW(&start));
+	    rep_set_string_match(tx, vstart, make_pos(PCOL(&end), PROW(&end)));
+	    return vstart;
 	}
 	return(Qnil);
     }
@@ -586,7 +841,7 @@ the match data.
 	Pos ppos;
 	COPY_VPOS(&ppos, pos);
 	if(buffer_compare_n(tx, &ppos, rep_STR(string), length,
-			    rep_NILP(casep) ? strncmp : strncasecmp))
+			    !rep_NILP(casep)))
 	{
 	    repv end = COPY_POS(&ppos);
 	    rep_set_string_match(rep_VAL(tx), pos, end);
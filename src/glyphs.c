@@ -211,17 +211,17 @@ make_window_glyphs(glyph_buf *g, Lisp_Window *w)
 	    Lisp_Extent *x, *xc;
 	    tem.col = 0;
 	    tem.row = char_row;
-	    extent = find_extent(vw->tx->global_extent, &tem);
+	    extent = find_view_extent(vw, &tem);
 	    start_visible_extent (vw, extent, 0, glyph_row);
 
 	    extent_delta = 0;
 	    for(xc = extent, x = xc->parent; x != 0; xc = x, x = x->parent)
 	    {
-		x->tem = xc->right_sibling;
+		x->tem = sync_extent(xc->right_sibling);
 		extent_delta += x->start.row;
 		start_visible_extent (vw, x, 0, glyph_row);
 	    }
-	    extent->tem = extent->first_child;
+	    extent->tem = find_extent_child(extent, &tem);
 
 	    if(extent->tem != 0)
 	    {
@@ -277,8 +277,8 @@ make_window_glyphs(glyph_buf *g, Lisp_Window *w)
 	    uint8_t *codes = w->new_content->codes[glyph_row];
 	    uint8_t *attrs = w->new_content->attrs[glyph_row];
 
-	    char *src = vw->tx->lines[char_row].ln_Line;
-	    intptr_t src_len = vw->tx->lines[char_row].ln_Strlen - 1;
+	    char *src = LINE_TEXT(&TX_LINE(vw->tx, char_row));
+	    intptr_t src_len = TX_LINE(vw->tx, char_row).ln_Strlen - 1;
 
 	    /* Position in current screen row, logical glyph position in
 	       current buffer line, actual character in buffer line. */
@@ -370,7 +370,8 @@ make_window_glyphs(glyph_buf *g, Lisp_Window *w)
 			    /* Entering a new extent */				\
 			    extent_delta += extent->start.row;			\
 			    extent = extent->tem;				\
-			    extent->tem = extent->first_child;			\
+			    extent->tem						\
+				= sync_extent(extent->first_child);		\
 			    start_visible_extent (vw, extent,			\
 						  real_glyph_col,		\
 						  glyph_row);			\
@@ -381,7 +382,8 @@ make_window_glyphs(glyph_buf *g, Lisp_Window *w)
 			    end_visible_extent (vw, extent,			\
 						real_glyph_col,			\
 						glyph_row);			\
-			    extent->parent->tem = extent->right_sibling;	\
+			    extent->parent->tem					\
+				= sync_extent(extent->right_sibling);		\
 			    extent = extent->parent;				\
 			    extent_delta -= extent->start.row;			\
 			}							\
@@ -840,7 +842,7 @@ recenter_cursor(Lisp_View *vw)
 		last_col = ROUND_UP_INT(last_col, vw->width - 1);
 	    if(offset > last_col)
 	    {
-		vw->cursor_pos = make_pos(tx->lines[VROW(vw->cursor_pos)].ln_Strlen - 1,
+		vw->cursor_pos = make_pos(TX_LINE(tx, VROW(vw->cursor_pos)).ln_Strlen - 1,
 					    VROW(vw->cursor_pos));
 		offset = get_cursor_column(vw);
 	    }
@@ -1018,8 +1020,9 @@ line_glyph_length(Lisp_Buffer *tx, intptr_t line)
 	{
 	    /* No. Recalculate */
 	    set_data->glyphs
-		= uncached_string_glyph_length(tx, tx->lines[line].ln_Line,
-					       tx->lines[line].ln_Strlen - 1);
+		= uncached_string_glyph_length(tx,
+					       LINE_TEXT(&TX_LINE(tx, line)),
+					       TX_LINE(tx, line).ln_Strlen - 1);
 	    set_data->changes = tx->change_count;
 	    gl_cache.invalid_hits++;
 	}
@@ -1030,8 +1033,9 @@ line_glyph_length(Lisp_Buffer *tx, intptr_t line)
     set_data->line = line;
     set_data->tx = tx;
     set_data->glyphs
-        = uncached_string_glyph_length(tx, tx->lines[line].ln_Line,
-				       tx->lines[line].ln_Strlen - 1);
+        = uncached_string_glyph_length(tx,
+				       LINE_TEXT(&TX_LINE(tx, line)),
+				       TX_LINE(tx, line).ln_Strlen - 1);
     set_data->changes = tx->change_count;
     gl_cache.misses++;
     return set_data->glyphs;
@@ -1050,8 +1054,9 @@ line_glyph_length(Lisp_Buffer *tx, intptr_t line)
 	    {
 		/* No. Recalculate */
 		set_data[i].glyphs
-		    = uncached_string_glyph_length(tx, tx->lines[line].ln_Line,
-						   tx->lines[line].ln_Strlen - 1);
+		    = uncached_string_glyph_length(tx,
+						   LINE_TEXT(&TX_LINE(tx, line)),
+						   TX_LINE(tx, line).ln_Strlen - 1);
 		set_data[i].changes = tx->change_count;
 		gl_cache.invalid_hits++;
 	    }
@@ -1071,8 +1076,9 @@ line_glyph_length(Lisp_Buffer *tx, intptr_t line)
     set_data->line = line;
     set_data->tx = tx;
     set_data->glyphs
-        = uncached_string_glyph_length(tx, tx->lines[line].ln_Line,
-				       tx->lines[line].ln_Strlen - 1);
+        = uncached_string_glyph_length(tx,
+				       LINE_TEXT(&TX_LINE(tx, line)),
+				       TX_LINE(tx, line).ln_Strlen - 1);
     set_data->changes = tx->change_count;
     set_data->lru_clock = ++gl_cache.lru_clock;
     gl_cache.misses++;
@@ -1085,14 +1091,15 @@ line_glyph_length(Lisp_Buffer *tx, intptr_t line)
 intptr_t
 glyph_col(Lisp_Buffer *tx, intptr_t col, intptr_t linenum)
 {
-    if(col >= tx->lines[linenum].ln_Strlen)
+    if(col >= TX_LINE(tx, linenum).ln_Strlen)
     {
 	return (line_glyph_length(tx, linenum)
-		+ (col - (tx->lines[linenum].ln_Strlen - 1)));
+		+ (col - (TX_LINE(tx, linenum).ln_Strlen - 1)));
     }
     else
 	/* TODO: make this work with the cache */
-	return uncached_string_glyph_length(tx, tx->lines[linenum].ln_Line,
+	return uncached_string_glyph_length(tx,
+					    LINE_TEXT(&TX_LINE(tx, linenum)),
 					    col);
 }
 
@@ -1100,8 +1107,8 @@ glyph_col(Lisp_Buffer *tx, intptr_t col, intptr_t linenum)
 intptr_t
 char_col(Lisp_Buffer *tx, intptr_t col, intptr_t linenum)
 {
-    char *src = tx->lines[linenum].ln_Line;
-    intptr_t srclen = tx->lines[linenum].ln_Strlen - 1;
+    char *src = LINE_TEXT(&TX_LINE(tx, linenum));
+    intptr_t srclen = TX_LINE(tx, linenum).ln_Strlen - 1;
     glyph_widths_t *width_table;
     intptr_t w = 0;
     /* FIXME: This is wrong */
@@ -1120,9 +1127,9 @@ char_col(Lisp_Buffer *tx, intptr_t col, intptr_t linenum)
 	    w += w1;
     }
     if(srclen < 0)
-	return((tx->lines[linenum].ln_Strlen - 1) + (col - w));
+	return((TX_LINE(tx, linenum).ln_Strlen - 1) + (col - w));
     else
-	return(src - tx->lines[linenum].ln_Line);
+	return(src - LINE_TEXT(&TX_LINE(tx, linenum)));
 }
 
 /* Return the actual column on the screen that the cursor appears in. */
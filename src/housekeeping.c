@@ -20,6 +20,283 @@
 
 #include "jade.h"
 #include <assert.h>
+#include <string.h>
+
+#ifdef NEED_MEMORY_H
+# include <memory.h>
+#endif
+
+
+/* The mark index */
+
+/* The resident marks of each buffer are kept in TX->marks, sorted by
+   position, so that an edit only needs to look at the marks after it.
+   Rather than changing the row of every one of those marks each time
+   lines are inserted or deleted, the rows of all marks from index
+   SHIFT_START onwards are SHIFT_ROWS short of their true value. When
+   the rows from a different index are next shifted only the marks
+   between the two indices need updating, so (as with the gap in the
+   line array) the cost depends on how many marks lie between one
+   edit and the next, not on the number in the buffer.
+
+   For the same reason the index has a gap of its own where marks are
+   added and removed. Each mark records its slot in the array rather
+   than its index, so only the marks the gap moves over change. */
+
+/* The index of MK in MI */
+static inline intptr_t
+mark_index_of(struct mark_index *mi, Lisp_Mark *mk)
+{
+    return (mk->index < mi->gap
+	    ? mk->index : mk->index - (mi->allocated - mi->count));
+}
+
+/* The true row of the mark at index I */
+static inline intptr_t
+index_row(struct mark_index *mi, intptr_t i)
+{
+    intptr_t row = VROW(MARK_AT(mi, i)->pos);
+    return i >= mi->shift_start ? row + mi->shift_rows : row;
+}
+
+/* Returns the index of the first mark in MI at or after (COL, ROW). */
+static intptr_t
+find_mark(struct mark_index *mi, intptr_t col, intptr_t row)
+{
+    intptr_t lo = 0, hi = mi->count;
+    while(lo < hi)
+    {
+	intptr_t mid = lo + (hi - lo) / 2;
+	intptr_t mid_row = index_row(mi, mid);
+	if(mid_row < row
+	   || (mid_row == row && VCOL(MARK_AT(mi, mid)->pos) < col))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Set the mark at index I to the true position POS. */
+static inline void
+store_index_pos(struct mark_index *mi, intptr_t i, repv pos)
+{
+    if(i >= mi->shift_start && mi->shift_rows != 0)
+	pos = make_pos(VCOL(pos), VROW(pos) - mi->shift_rows);
+    MARK_AT(mi, i)->pos = pos;
+}
+
+/* Set the column of the mark at index I to COL, leaving its row. */
+static inline void
+set_index_col(struct mark_index *mi, intptr_t i, intptr_t col)
+{
+    repv pos = MARK_AT(mi, i)->pos;
+    MARK_AT(mi, i)->pos = make_pos(col, VROW(pos));
+}
+
+/* Add ROWS to the stored row of each mark from index START to END. */
+static void
+add_index_rows(struct mark_index *mi, intptr_t start, intptr_t end,
+	       intptr_t rows)
+{
+    for(; start < end; start++)
+    {
+	repv pos = MARK_AT(mi, start)->pos;
+	MARK_AT(mi, start)->pos = make_pos(VCOL(pos), VROW(pos) + rows);
+    }
+}
+
+/* Add ROWS to the row of every mark from index START onwards. */
+static void
+shift_marks(struct mark_index *mi, intptr_t start, intptr_t rows)
+{
+    if(start >= mi->count)
+	return;
+    if(mi->shift_rows == 0)
+	mi->shift_start = start;
+    else if(start > mi->shift_start)
+    {
+	/* The marks before START only move by the pending amount */
+	add_index_rows(mi, mi->shift_start, start, mi->shift_rows);
+	mi->shift_start = start;
+    }
+    else if(start < mi->shift_start)
+	add_index_rows(mi, start, mi->shift_start, rows);
+    mi->shift_rows += rows;
+}
+
+/* Sort the marks from index START to END, which are all on ROW, by
+   column. Only needed when marks past the end of a line are joined to
+   the line after it. */
+static void
+sort_index_cols(struct mark_index *mi, intptr_t start, intptr_t end,
+		intptr_t row)
+{
+    intptr_t i, j;
+    for(i = start + 1; i < end; i++)
+    {
+	Lisp_Mark *mk = MARK_AT(mi, i);
+	for(j = i; j > start && VCOL(MARK_AT(mi, j-1)->pos) > VCOL(mk->pos); j--)
+	    MARK_AT(mi, j) = MARK_AT(mi, j-1);
+	MARK_AT(mi, j) = mk;
+    }
+    for(i = start; i < end; i++)
+    {
+	MARK_AT(mi, i)->index = MARK_SLOT(mi, i);
+	store_index_pos(mi, i, make_pos(VCOL(MARK_AT(mi, i)->pos), row));
+    }
+}
+
+/* Returns the position of MK. */
+repv
+mark_pos(Lisp_Mark *mk)
+{
+    if(MARK_RESIDENT_P(mk))
+    {
+	struct mark_index *mi = &VBUFFER(mk->file)->marks;
+	if(mi->shift_rows != 0 && mark_index_of(mi, mk) >= mi->shift_start)
+	    return make_pos(VCOL(mk->pos), VROW(mk->pos) + mi->shift_rows);
+    }
+    return mk->pos;
+}
+
+/* Move the gap in MI to be in front of index I. */
+static void
+move_mark_gap(struct mark_index *mi, intptr_t i)
+{
+    intptr_t gap_size = mi->allocated - mi->count, j;
+    if(gap_size > 0 && i < mi->gap)
+    {
+	memmove(mi->marks + i + gap_size, mi->marks + i,
+		sizeof(Lisp_Mark *) * (mi->gap - i));
+	for(j = i + gap_size; j < mi->gap + gap_size; j++)
+	    mi->marks[j]->index = j;
+    }
+    else if(gap_size > 0 && i > mi->gap)
+    {
+	memmove(mi->marks + mi->gap, mi->marks + mi->gap + gap_size,
+		sizeof(Lisp_Mark *) * (i - mi->gap));
+	for(j = mi->gap; j < i; j++)
+	    mi->marks[j]->index = j;
+    }
+    mi->gap = i;
+}
+
+/* Make sure the mark index of TX has room for another mark, so that
+   the next index_mark() can't fail. Returns false if no memory. */
+bool
+reserve_mark_index(Lisp_Buffer *tx)
+{
+    struct mark_index *mi = &tx->marks;
+    if(mi->count == mi->allocated)
+    {
+	intptr_t allocated = MAX(mi->allocated * 2, 16);
+	Lisp_Mark **marks = rep_realloc(mi->marks,
+					sizeof(Lisp_Mark *) * allocated);
+	if(marks == 0)
+	    return false;
+	/* The gap is empty, so it may as well be at the end */
+	mi->marks = marks;
+	mi->allocated = allocated;
+	mi->gap = mi->count;
+    }
+    return true;
+}
+
+/* Add MK, whose position is correct, to the mark index of TX. Returns
+   false if no memory. */
+bool
+index_mark(Lisp_Buffer *tx, Lisp_Mark *mk)
+{
+    struct mark_index *mi = &tx->marks;
+    intptr_t i;
+    if(!reserve_mark_index(tx))
+	return false;
+    i = find_mark(mi, VCOL(mk->pos), VROW(mk->pos));
+    move_mark_gap(mi, i);
+    mi->gap++;
+    mi->count++;
+    if(i < mi->shift_start)
+	mi->shift_start++;
+    mi->marks[i] = mk;
+    mk->index = i;
+    store_index_pos(mi, i, mk->pos);
+    return true;
+}
+
+/* Take MK out of the mark index of TX, leaving its position correct. */
+void
+unindex_mark(Lisp_Buffer *tx, Lisp_Mark *mk)
+{
+    struct mark_index *mi = &tx->marks;
+    intptr_t i = mark_index_of(mi, mk);
+    mk->pos = mark_pos(mk);
+    move_mark_gap(mi, i + 1);
+    mi->gap--;
+    mi->count--;
+    if(i < mi->shift_start)
+	mi->shift_start--;
+}
+
+/* Returns true if the mark at index I of MI is before (or at) POS. */
+static inline bool
+index_before_p(struct mark_index *mi, intptr_t i, repv pos)
+{
+    intptr_t row = index_row(mi, i);
+    return (row < VROW(pos)
+	    || (row == VROW(pos) && VCOL(MARK_AT(mi, i)->pos) <= VCOL(pos)));
+}
+
+/* Returns true if the mark at index I of MI is after (or at) POS. */
+static inline bool
+index_after_p(struct mark_index *mi, intptr_t i, repv pos)
+{
+    intptr_t row = index_row(mi, i);
+    return (row > VROW(pos)
+	    || (row == VROW(pos) && VCOL(MARK_AT(mi, i)->pos) >= VCOL(pos)));
+}
+
+/* Move the resident mark MK to POS. This is quick unless it passes
+   other marks. */
+void
+move_mark(Lisp_Mark *mk, repv pos)
+{
+    Lisp_Buffer *tx = VBUFFER(mk->file);
+    struct mark_index *mi = &tx->marks;
+    intptr_t i = mark_index_of(mi, mk);
+    if((i == 0 || index_before_p(mi, i - 1, pos))
+       && (i == mi->count - 1 || index_after_p(mi, i + 1, pos)))
+    {
+	store_index_pos(mi, i, pos);
+	return;
+    }
+    /* Taking MK out leaves room to put it back, so this can't fail */
+    unindex_mark(tx, mk);
+    mk->pos = pos;
+    index_mark(tx, mk);
+}
+
+/* Remove the null entries left in the mark index of TX by the garbage
+   collector, see mark_sweep() */
+void
+sweep_mark_index(Lisp_Buffer *tx)
+{
+    struct mark_index *mi = &tx->marks;
+    intptr_t i, j, shift_start = mi->shift_start;
+    for(i = j = 0; i < mi->count; i++)
+    {
+	if(MARK_AT(mi, i) != 0)
+	{
+	    mi->marks[j] = MARK_AT(mi, i);
+	    mi->marks[j]->index = j;
+	    j++;
+	}
+	else if(i < mi->shift_start)
+	    shift_start--;
+    }
+    mi->count = mi->gap = j;
+    mi->shift_start = shift_start;
+}
 
 
 /* The next few routines deal with updating the various references to
@@ -31,7 +308,8 @@ adjust_marks_add_x(Lisp_Buffer *tx, intptr_t addx,
 		   intptr_t xpos, intptr_t ypos)
 {
     Lisp_View *thisvw;
-    Lisp_Mark *thismark;
+    struct mark_index *mi = &tx->marks;
+    intptr_t i, end;
 
 #define UPD(p)						\
     do {						\
@@ -52,8 +330,9 @@ adjust_marks_add_x(Lisp_Buffer *tx, intptr_t addx,
 	}
     }
 
-    for(thismark = tx->mark_chain; thismark; thismark = thismark->next)
-	UPD(thismark->pos);
+    end = find_mark(mi, 0, ypos + 1);
+    for(i = find_mark(mi, xpos, ypos); i < end; i++)
+	set_index_col(mi, i, VCOL(MARK_AT(mi, i)->pos) + addx);
 
     UPD(tx->saved_cursor_pos);
     UPD(tx->saved_display_origin);
@@ -62,10 +341,13 @@ adjust_marks_add_x(Lisp_Buffer *tx, intptr_t addx,
 
     adjust_extents_add_cols(tx->global_extent, addx, xpos, ypos);
 
+    for(thisvw = view_chain; thisvw; thisvw = thisvw->next)
     {
-	struct cached_extent *ce = tx->extent_cache;
-	int i;
-	for(i = 0; i < EXTENT_CACHE_SIZE; i++, ce++)
+	struct cached_extent *ce = thisvw->extent_cache;
+	int j;
+	if(thisvw->tx != tx)
+	    continue;
+	for(j = 0; j < EXTENT_CACHE_SIZE; j++, ce++)
 	{
 	    if(ce->extent && ce->pos.row == ypos && ce->pos.col >= xpos)
 		ce->pos.col += addx;
@@ -80,7 +362,8 @@ adjust_marks_sub_x(Lisp_Buffer *tx, intptr_t subx,
 		   intptr_t xpos, intptr_t ypos)
 {
     Lisp_View *thisvw;
-    Lisp_Mark *thismark;
+    struct mark_index *mi = &tx->marks;
+    intptr_t i, end;
 
 #define UPD(p)						\
     do {						\
@@ -104,8 +387,9 @@ adjust_marks_sub_x(Lisp_Buffer *tx, intptr_t subx,
 	}
     }
 
-    for(thismark = tx->mark_chain; thismark; thismark = thismark->next)
-	UPD(thismark->pos);
+    end = find_mark(mi, 0, ypos + 1);
+    for(i = find_mark(mi, xpos, ypos); i < end; i++)
+	set_index_col(mi, i, MAX(VCOL(MARK_AT(mi, i)->pos) - subx, xpos));
 
     UPD(tx->saved_cursor_pos);
     UPD(tx->saved_display_origin);
@@ -114,13 +398,21 @@ adjust_marks_sub_x(Lisp_Buffer *tx, intptr_t subx,
 
     adjust_extents_sub_cols(tx->global_extent, subx, xpos, ypos);
 
+    for(thisvw = view_chain; thisvw; thisvw = thisvw->next)
     {
-	struct cached_extent *ce = tx->extent_cache;
-	int i;
-	for(i = 0; i < EXTENT_CACHE_SIZE; i++, ce++)
+	struct cached_extent *ce = thisvw->extent_cache;
+	int j;
+	if(thisvw->tx != tx)
+	    continue;
+	for(j = 0; j < EXTENT_CACHE_SIZE; j++, ce++)
 	{
 	    if(ce->extent && ce->pos.row == ypos && ce->pos.col >= xpos)
-		ce->pos.col -= subx;
+	    {
+		/* Extents may have ended in the deleted text */
+		if(ce->pos.col <= xpos + subx)
+		    ce->stamp = tx->extent_stamp - 1;
+		ce->pos.col = MAX(ce->pos.col - subx, xpos);
+	    }
 	}
     }
 
@@ -134,7 +426,7 @@ void
 adjust_marks_add_y(Lisp_Buffer *tx, intptr_t addy, intptr_t ypos)
 {
     Lisp_View *thisvw;
-    Lisp_Mark *thismark;
+    struct mark_index *mi = &tx->marks;
 
 #define UPD(p)						\
     do {						\
@@ -159,8 +451,7 @@ adjust_marks_add_y(Lisp_Buffer *tx, intptr_t addy, intptr_t ypos)
 		UPD(thisvw->display_origin);
 	}
     }
-    for(thismark = tx->mark_chain; thismark; thismark = thismark->next)
-	UPD(thismark->pos);
+    shift_marks(mi, find_mark(mi, 0, ypos), addy);
 
 
     if(tx->logical_start > ypos)
@@ -174,10 +465,13 @@ adjust_marks_add_y(Lisp_Buffer *tx, intptr_t addy, intptr_t ypos)
 
     adjust_extents_add_rows(tx->global_extent, addy, ypos);
 
+    for(thisvw = view_chain; thisvw; thisvw = thisvw->next)
     {
-	struct cached_extent *ce = tx->extent_cache;
-	int i;
-	for(i = 0; i < EXTENT_CACHE_SIZE; i++, ce++)
+	struct cached_extent *ce = thisvw->extent_cache;
+	int j;
+	if(thisvw->tx != tx)
+	    continue;
+	for(j = 0; j < EXTENT_CACHE_SIZE; j++, ce++)
 	{
 	    if(ce->extent && ce->pos.row >= ypos)
 		ce->pos.row += addy;
@@ -195,7 +489,8 @@ void
 adjust_marks_sub_y(Lisp_Buffer *tx, intptr_t suby, intptr_t ypos)
 {
     Lisp_View *thisvw;
-    Lisp_Mark *thismark;
+    struct mark_index *mi = &tx->marks;
+    intptr_t i, end;
 
 #define UPD_Y(y)				\
     do {					\
@@ -246,8 +541,10 @@ adjust_marks_sub_y(Lisp_Buffer *tx, intptr_t suby, intptr_t ypos)
 		UPD1(thisvw->display_origin);
 	}
     }
-    for(thismark = tx->mark_chain; thismark; thismark = thismark->next)
-	UPD(thismark->pos);
+    end = find_mark(mi, 0, ypos + suby);
+    for(i = find_mark(mi, 0, ypos); i < end; i++)
+	store_index_pos(mi, i, make_pos(0, ypos));
+    shift_marks(mi, end, -suby);
 
     UPD_Y(tx->logical_start);
     UPD_Y(tx->logical_end);
@@ -259,13 +556,27 @@ adjust_marks_sub_y(Lisp_Buffer *tx, intptr_t suby, intptr_t ypos)
 
     adjust_extents_sub_rows(tx->global_extent, suby, ypos);
 
+    for(thisvw = view_chain; thisvw; thisvw = thisvw->next)
     {
-	struct cached_extent *ce = tx->extent_cache;
-	int i;
-	for(i = 0; i < EXTENT_CACHE_SIZE; i++, ce++)
+	struct cached_extent *ce = thisvw->extent_cache;
+	int j;
+	if(thisvw->tx != tx)
+	    continue;
+	for(j = 0; j < EXTENT_CACHE_SIZE; j++, ce++)
 	{
 	    if(ce->extent && ce->pos.row >= ypos)
-		ce->pos.row = MAX(ypos, ce->pos.row - suby);
+	    {
+		if(ce->pos.row < ypos + suby
+		   || (ce->pos.row == ypos + suby && ce->pos.col == 0))
+		    ce->stamp = tx->extent_stamp - 1;
+		if(ce->pos.row - suby < ypos)
+		{
+		    ce->pos.row = ypos;
+		    ce->pos.col = 0;
+		}
+		else
+		    ce->pos.row -= suby;
+	    }
 	}
     }
 
@@ -281,7 +592,8 @@ void
 adjust_marks_split_y(Lisp_Buffer *tx, intptr_t xpos, intptr_t ypos)
 {
     Lisp_View *thisvw;
-    Lisp_Mark *thismark;
+    struct mark_index *mi = &tx->marks;
+    intptr_t i, end;
 
 #define UPD_Y(y)				\
     do {					\
@@ -325,8 +637,11 @@ adjust_marks_split_y(Lisp_Buffer *tx, intptr_t xpos, intptr_t ypos)
 		UPD1(thisvw->display_origin);
 	}
     }
-    for(thismark = tx->mark_chain; thismark; thismark = thismark->next)
-	UPD(thismark->pos);
+    end = find_mark(mi, 0, ypos + 1);
+    i = find_mark(mi, xpos, ypos);
+    shift_marks(mi, i, 1);
+    for(; i < end; i++)
+	set_index_col(mi, i, VCOL(MARK_AT(mi, i)->pos) - xpos);
 
     UPD_Y(tx->logical_start);
     UPD_Y(tx->logical_end);
@@ -338,10 +653,13 @@ adjust_marks_split_y(Lisp_Buffer *tx, intptr_t xpos, intptr_t ypos)
 
     adjust_extents_split_row(tx->global_extent, xpos, ypos);
 
+    for(thisvw = view_chain; thisvw; thisvw = thisvw->next)
     {
-	struct cached_extent *ce = tx->extent_cache;
-	int i;
-	for(i = 0; i < EXTENT_CACHE_SIZE; i++, ce++)
+	struct cached_extent *ce = thisvw->extent_cache;
+	int j;
+	if(thisvw->tx != tx)
+	    continue;
+	for(j = 0; j < EXTENT_CACHE_SIZE; j++, ce++)
 	{
 	    if(ce->extent
 	       && (ce->pos.row > ypos
@@ -366,7 +684,8 @@ void
 adjust_marks_join_y(Lisp_Buffer *tx, intptr_t xpos, intptr_t ypos)
 {
     Lisp_View *thisvw;
-    Lisp_Mark *thismark;
+    struct mark_index *mi = &tx->marks;
+    intptr_t i, start, end;
 
 #define UPD_Y(y)				\
     do {					\
@@ -406,8 +725,22 @@ adjust_marks_join_y(Lisp_Buffer *tx, intptr_t xpos, intptr_t ypos)
 		UPD1(thisvw->display_origin);
 	}
     }
-    for(thismark = tx->mark_chain; thismark; thismark = thismark->next)
-	UPD(thismark->pos);
+    start = find_mark(mi, 0, ypos);
+    end = find_mark(mi, 0, ypos + 2);
+    i = find_mark(mi, 0, ypos + 1);
+    shift_marks(mi, i, -1);
+    if(i > start && i < end
+       && VCOL(MARK_AT(mi, i-1)->pos) > VCOL(MARK_AT(mi, i)->pos) + xpos)
+    {
+	for(; i < end; i++)
+	    set_index_col(mi, i, VCOL(MARK_AT(mi, i)->pos) + xpos);
+	sort_index_cols(mi, start, end, ypos);
+    }
+    else
+    {
+	for(; i < end; i++)
+	    set_index_col(mi, i, VCOL(MARK_AT(mi, i)->pos) + xpos);
+    }
 
     UPD_Y(tx->logical_start);
     UPD_Y(tx->logical_end);
@@ -419,11 +752,21 @@ adjust_marks_join_y(Lisp_Buffer *tx, intptr_t xpos, intptr_t ypos)
 
     adjust_extents_join_rows(tx->global_extent, xpos, ypos);
 
+    for(thisvw = view_chain; thisvw; thisvw = thisvw->next)
     {
-	struct cached_extent *ce = tx->extent_cache;
-	int i;
-	for(i = 0; i < EXTENT_CACHE_SIZE; i++, ce++)
+	struct cached_extent *ce = thisvw->extent_cache;
+	int j;
+	if(thisvw->tx != tx)
+	    continue;
+	for(j = 0; j < EXTENT_CACHE_SIZE; j++, ce++)
 	{
+	    if(ce->extent
+	       && ((ce->pos.row == ypos && ce->pos.col >= xpos)
+		   || (ce->pos.row == ypos + 1 && ce->pos.col == 0)))
+	    {
+		/* Extents may have ended at the deleted newline */
+		ce->stamp = tx->extent_stamp - 1;
+	    }
 	    if(ce->extent && ce->pos.row > ypos)
 	    {
 		if(ce->pos.row == ypos + 1)
@@ -433,8 +776,105 @@ adjust_marks_join_y(Lisp_Buffer *tx, intptr_t xpos, intptr_t ypos)
 	}
     }
 
+#undef UPD_Y
 #undef UPD
-#undef UPD2
+#undef UPD1
+}
+
+/*
+ * Use when inserting a block of text containing ADDY newlines at
+ * (XPOS, YPOS); ENDX is the length of the text after the last newline.
+ * This has the same effect as splitting the line then adding each of
+ * the new lines one at a time, but in a single pass.
+ */
+void
+adjust_marks_insert_lines(Lisp_Buffer *tx, intptr_t xpos, intptr_t ypos,
+			  intptr_t addy, intptr_t endx)
+{
+    Lisp_View *thisvw;
+    struct mark_index *mi = &tx->marks;
+    intptr_t i, end;
+
+#define UPD(p)								\
+    do {								\
+	if(p && VROW(p) > ypos)						\
+	    (p) = make_pos(VCOL(p), VROW(p) + addy);			\
+	else if(p && VROW(p) == ypos && VCOL(p) >= xpos)		\
+	    (p) = make_pos(VCOL(p) - xpos + endx, VROW(p) + addy);	\
+    } while(0)
+
+#define UPD1(p)								\
+    do {								\
+	if(p && (VROW(p) > ypos || (VROW(p) == ypos && xpos == 0)))	\
+	    (p) = make_pos(VCOL(p), VROW(p) + addy);			\
+    } while(0)
+
+    for(thisvw = view_chain; thisvw; thisvw = thisvw->next)
+    {
+	if(thisvw->tx == tx)
+	{
+	    UPD(thisvw->cursor_pos);
+            if(thisvw->car & VWFF_RECTBLOCKS)
+	    {
+		UPD1(thisvw->block_start);
+		UPD1(thisvw->block_end);
+	    }
+            else
+	    {
+                UPD(thisvw->block_start);
+                UPD(thisvw->block_end);
+	    }
+	    if(thisvw != curr_vw)
+		UPD1(thisvw->display_origin);
+	}
+    }
+    end = find_mark(mi, 0, ypos + 1);
+    i = find_mark(mi, xpos, ypos);
+    shift_marks(mi, i, addy);
+    for(; i < end; i++)
+	set_index_col(mi, i, VCOL(MARK_AT(mi, i)->pos) - xpos + endx);
+
+    if(tx->logical_start > ypos)
+	tx->logical_start += addy;
+    if(tx->logical_end > ypos || (tx->logical_end == ypos && xpos == 0))
+	tx->logical_end += addy;
+
+    UPD(tx->saved_cursor_pos);
+    UPD(tx->saved_display_origin);
+    UPD(tx->saved_block[0]);
+    UPD(tx->saved_block[1]);
+
+    if(xpos == 0)
+	adjust_extents_add_rows(tx->global_extent, addy, ypos);
+    else
+    {
+	adjust_extents_split_row(tx->global_extent, xpos, ypos);
+	if(addy > 1)
+	    adjust_extents_add_rows(tx->global_extent, addy - 1, ypos + 1);
+    }
+    if(endx > 0)
+	adjust_extents_add_cols(tx->global_extent, endx, 0, ypos + addy);
+
+    for(thisvw = view_chain; thisvw; thisvw = thisvw->next)
+    {
+	struct cached_extent *ce = thisvw->extent_cache;
+	int j;
+	if(thisvw->tx != tx)
+	    continue;
+	for(j = 0; j < EXTENT_CACHE_SIZE; j++, ce++)
+	{
+	    if(ce->extent && ce->pos.row > ypos)
+		ce->pos.row += addy;
+	    else if(ce->extent && ce->pos.row == ypos && ce->pos.col >= xpos)
+	    {
+		ce->pos.col += endx - xpos;
+		ce->pos.row += addy;
+	    }
+	}
+    }
+
+#undef UPD
+#undef UPD1
 }
 
 
@@ -27,6 +27,7 @@
 
 #include <rep.h>
 #include <stdarg.h>
+#include <sys/types.h>
 
 #if defined (HAVE_GTK)
 # include "gtk_defs.h"
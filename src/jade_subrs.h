@@ -27,6 +27,9 @@ extern Lisp_Buffer *swap_buffers(Lisp_View *, Lisp_Buffer *);
 extern repv *get_buffer_cursor_ptr(Lisp_Buffer *tx);
 extern repv get_buffer_cursor(Lisp_Buffer *);
 extern bool auto_save_buffers(bool);
+extern bool compact_idle_buffers(void);
+extern bool compress_idle_buffers(void);
+extern repv Fcompact_buffer(repv);
 extern void kill_buffer_local_variables(Lisp_Buffer *tx);
 extern void buffers_init(void);
 extern void buffers_kill(void);
@@ -94,12 +97,23 @@ extern repv Fprefix_numeric_argument(repv arg);
 extern repv Finteractive(repv spec);
 extern repv Fcommandp(repv cmd);
 
+/* from compress.c */
+extern bool compress_line_list(Lisp_Buffer *tx);
+extern bool thaw_line_list(Lisp_Buffer *tx);
+extern void kill_compressed_text(Lisp_Buffer *tx);
+
 /* from edit.c */
 extern bool clear_line_list(Lisp_Buffer *);
 extern void kill_line_list(Lisp_Buffer *);
+extern void drop_offset_tree(Lisp_Buffer *tx);
+extern intptr_t row_offset(Lisp_Buffer *tx, intptr_t row);
+extern intptr_t offset_row(Lisp_Buffer *tx, intptr_t offset, intptr_t *colp);
 extern LINE *resize_line_list(Lisp_Buffer *, intptr_t, intptr_t);
 extern char *alloc_line_buf(Lisp_Buffer *, intptr_t length);
-extern void free_line_buf(Lisp_Buffer *tx, char *line);
+extern void free_line_buf(Lisp_Buffer *tx, char *line, intptr_t length);
+extern bool make_line_writable(Lisp_Buffer *tx, intptr_t row);
+extern bool unmap_line_list(Lisp_Buffer *tx);
+extern bool compact_line_list(Lisp_Buffer *tx);
 extern bool insert_gap(Lisp_Buffer *, intptr_t, intptr_t, intptr_t);
 extern repv insert_bytes(Lisp_Buffer *, const char *, size_t, repv);
 extern repv insert_string(Lisp_Buffer *, const char *, size_t, repv);
@@ -137,6 +151,8 @@ extern repv Ftranslate_area(repv start, repv end, repv table, repv tx);
 extern repv Fget_char(repv pos, repv tx);
 extern repv Fset_char(repv ch, repv pos, repv tx);
 extern repv Fposp(repv arg);
+extern repv Fpos_col(repv pos);
+extern repv Fpos_line(repv pos);
 extern repv Fcursor_pos(void);
 extern repv Fempty_line_p(repv pos, repv tx);
 extern repv Findent_pos(repv pos, repv tx);
@@ -148,13 +164,19 @@ extern repv Foffset_to_pos(repv voffset, repv tx);
 extern repv Fcall_process_area(repv arg_list);
 
 /* from extent.c */
+extern Lisp_Extent *sync_extent(Lisp_Extent *e);
 extern Lisp_Extent *find_extent_forwards(Lisp_Extent *root, Pos *pos);
+extern Lisp_Extent *find_extent_child(Lisp_Extent *e, Pos *pos);
+extern Lisp_Extent *find_view_extent(Lisp_View *vw, Pos *pos);
 extern Lisp_Extent *find_extent(Lisp_Extent *root, Pos *pos);
+extern void clear_extent_cache(Lisp_View *vw);
+extern void mark_extent_cache(Lisp_View *vw);
 extern void map_section_extents(void (*)(Lisp_Extent *, void *),
 				Lisp_Extent *, Pos *, Pos *, void *);
 extern void make_global_extent(Lisp_Buffer *tx);
 extern void reset_global_extent(Lisp_Buffer *tx);
 extern bool buffer_set_if_bound(repv symbol, repv value);
+extern repv extent_hot_property(Lisp_Extent *e, enum extent_hot_prop prop);
 extern void adjust_extents_add_cols(Lisp_Extent *, intptr_t,
 				    intptr_t, intptr_t);
 extern void adjust_extents_sub_cols(Lisp_Extent *, intptr_t,
@@ -172,10 +194,12 @@ extern repv Qfront_sticky, Qrear_sticky;
 extern repv Qlocal_variables, Qcatch_variables;
 extern int extent_type;
 extern repv Fmake_extent(repv, repv, repv);
+extern repv Fmake_extents(repv);
 extern repv Fdelete_extent(repv);
 extern repv Fdelete_all_extents(repv);
 extern repv Fmove_extent(repv, repv, repv);
 extern repv Fget_extent(repv, repv);
+extern repv Fextent_cache_statistics(repv);
 extern repv Fmap_extents(repv, repv, repv);
 extern repv Fextent_start(repv);
 extern repv Fextent_end(repv);
@@ -216,7 +240,7 @@ extern int face_type;
 extern repv Qforeground, Qbackground, Qunderline, Qbold, Qitalic;
 extern repv Qinverted, Qboxed;
 extern repv Qdefault_face, Qblock_face, Qmodeline_face;
-extern repv Qhighlight_face, Qface;
+extern repv Qhighlight_face, Qface, Qmouse_face;
 extern repv mouse_cursor_face;
 extern char *default_fg_color, *default_bg_color;
 extern char *default_block_color, *default_hl_color, *default_ml_color;
@@ -232,6 +256,9 @@ extern repv Fget_color(repv);
 extern repv Fwrite_buffer_contents(repv, repv, repv);
 extern repv Fread_file_contents(repv);
 extern repv Finsert_file_contents(repv);
+extern void forget_file_lease(char *base);
+extern void wait_for_background_saves(void);
+extern repv Fwrite_buffer_contents_in_background(repv, repv);
 extern void files_init(void);
 
 /* from find.c */
@@ -241,7 +268,7 @@ extern bool buffer_reverse_strpbrk(Lisp_Buffer *tx, Pos *pos,
 extern bool buffer_strchr(Lisp_Buffer *tx, Pos *pos, char c);
 extern bool buffer_reverse_strchr(Lisp_Buffer *tx, Pos *pos, char c);
 extern bool buffer_compare_n(Lisp_Buffer *tx, Pos *pos, const char *str,
-			     int n, void *cmpfn);
+			     intptr_t n, bool nocase);
 extern bool forward_char(long count, Lisp_Buffer *tx, Pos *pos);
 extern bool backward_char(long count, Lisp_Buffer *tx, Pos *pos);
 extern void find_init(void);
@@ -283,6 +310,12 @@ extern repv Fset_glyph(repv gt, repv ch, repv glyph);
 extern repv Fget_glyph(repv gt, repv ch);
 
 /* from housekeeping.c */
+extern repv mark_pos(Lisp_Mark *mk);
+extern bool reserve_mark_index(Lisp_Buffer *tx);
+extern bool index_mark(Lisp_Buffer *tx, Lisp_Mark *mk);
+extern void unindex_mark(Lisp_Buffer *tx, Lisp_Mark *mk);
+extern void move_mark(Lisp_Mark *mk, repv pos);
+extern void sweep_mark_index(Lisp_Buffer *tx);
 extern void adjust_marks_add_x(Lisp_Buffer *, intptr_t, intptr_t,
 			       intptr_t);
 extern void adjust_marks_sub_x(Lisp_Buffer *, intptr_t, intptr_t,
@@ -291,6 +324,8 @@ extern void adjust_marks_add_y(Lisp_Buffer *, intptr_t, intptr_t);
 extern void adjust_marks_sub_y(Lisp_Buffer *, intptr_t, intptr_t);
 extern void adjust_marks_split_y(Lisp_Buffer *, intptr_t, intptr_t);
 extern void adjust_marks_join_y(Lisp_Buffer *, intptr_t, intptr_t);
+extern void adjust_marks_insert_lines(Lisp_Buffer *, intptr_t, intptr_t,
+				      intptr_t, intptr_t);
 extern void reset_all_views(Lisp_Buffer *);
 
 /* from keys.c */
@@ -302,6 +337,7 @@ extern void keys_init(void);
 extern unsigned long current_event[2], last_event[2];
 extern repv Qglobal_keymap, Qlocal_keymap, Qunbound_key_hook;
 extern repv Qesc_means_meta, Qkeymap, Qoverriding_local_keymap;
+extern repv Qmouse_keymap;
 extern repv Qminor_mode_keymap_alist, Qautoload_keymap;
 extern repv Qnext_keymap_path;
 extern repv Qidle_hook;
@@ -320,6 +356,21 @@ extern repv Fsearch_keymap(repv ev, repv km);
 extern repv Fkeymapp(repv arg);
 extern repv Feventp(repv arg);
 
+/* from lines.c */
+extern struct line_arena_stats line_arena_totals;
+extern intptr_t line_buf_size(intptr_t length);
+extern char *line_arena_alloc(struct line_arena *a, intptr_t length);
+extern void line_arena_free(struct line_arena *a, char *ptr, intptr_t length);
+extern void line_arena_kill(struct line_arena *a);
+extern void line_arena_merge(struct line_arena *dst, struct line_arena *src);
+extern void line_arena_replace(struct line_arena *a, struct line_arena *fresh);
+extern char *line_arena_map(struct line_arena *a, int fd, size_t length);
+extern void line_arena_unmap(struct line_arena *a);
+extern struct line_store *line_arena_freeze(struct line_arena *a);
+extern bool line_arena_frozen_p(struct line_arena *a, char *ptr,
+				intptr_t length);
+extern void line_store_release(struct line_store *s);
+
 /* from main.c */
 extern bool batch_mode_p (void);
 extern int main(int, char **);
@@ -349,6 +400,7 @@ extern repv Ffind_matching_bracket(repv pos, repv tx, repv esc);
 extern repv Fraw_mouse_pos(void);
 
 /* from redisplay.c */
+extern size_t glyph_buf_bytes;
 extern glyph_buf *alloc_glyph_buf(intptr_t cols, intptr_t rows);
 extern void free_glyph_buf(glyph_buf *gb);
 extern void copy_glyph_buf(glyph_buf *dst, glyph_buf *src);
@@ -366,24 +418,42 @@ extern int regexec_buffer(rep_regexp *prog, Lisp_Buffer *tx, repv start, int fla
 extern int regexec_reverse_buffer(rep_regexp *prog, Lisp_Buffer *tx, repv start, int flags);
 extern int regmatch_buffer(rep_regexp *prog, Lisp_Buffer *tx, repv start, int flags);
 
+/* from regnfa.c */
+extern int regexec_automaton(rep_regexp *prog, Lisp_Buffer *tx, Pos *start,
+			     bool nocase, bool anchored);
+
 /* from regsub.c */
 extern void jade_regsub(int last_type, rep_regsubs *matches,
 			const char *source, char *dest, void *data);
 extern size_t jade_regsublen(int last_type, rep_regsubs *matches,
 			     const char *source, void *data);
 
+/* from snapshot.c */
+extern Buffer_Snapshot *make_buffer_snapshot(Lisp_Buffer *tx);
+extern void release_buffer_snapshot(Buffer_Snapshot *snap);
+extern bool unmap_buffer_snapshot(Buffer_Snapshot *snap);
+extern intptr_t snapshot_section_length(Buffer_Snapshot *snap,
+					repv start, repv end);
+extern void snapshot_copy_section(Buffer_Snapshot *snap, repv start,
+				  repv end, char *buf);
+
 /* from undo.c */
 extern void undo_record_unmodified(Lisp_Buffer *tx);
 extern void undo_record_deletion(Lisp_Buffer *, repv, repv);
 extern repv undo_push_deletion(Lisp_Buffer *, repv, repv);
 extern void undo_record_insertion(Lisp_Buffer *, repv, repv);
 extern void undo_record_modification(Lisp_Buffer *, repv, repv);
+extern bool begin_edit_batch(Lisp_Buffer *tx);
+extern void end_edit_batch(Lisp_Buffer *tx);
 extern void undo_end_of_command(void);
 extern void undo_trim(void);
 extern void undo_init(void);
 extern repv Qundo;
 extern repv Fundo(repv tx, repv arg);
+extern repv Fbegin_batched_edits(repv tx);
+extern repv Fend_batched_edits(repv tx);
 extern repv var_max_undo_size(repv val);
+extern repv Fmax_batch_undo_size(repv val);
 extern repv var_buffer_record_undo(repv val);
 
 /* from views.c */
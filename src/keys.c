@@ -151,8 +151,8 @@ lookup_binding(unsigned long code, unsigned long mods, bool (*callback)(repv key
 		int i;
 		for (i = 0; k == 0 && i < vw->pointer_extents_count; i++)
 		{
-		    tem = Fextent_get(rep_VAL(vw->pointer_extents[i]),
-				      Qmouse_keymap);
+		    tem = extent_hot_property(vw->pointer_extents[i],
+					      EXTENT_MOUSE_KEYMAP);
 		    if (tem && tem != Qnil)
 			k = search_keymap (tem, code, mods, callback);
 		}
@@ -164,7 +164,8 @@ lookup_binding(unsigned long code, unsigned long mods, bool (*callback)(repv key
 	    tem = Fget_extent(Qnil, Qnil);
 	    while(!k && EXTENTP(tem))
 	    {
-		k = search_keymap(Fextent_get(tem, Qkeymap),
+		k = search_keymap(extent_hot_property(VEXTENT(tem),
+						      EXTENT_KEYMAP),
 				  code, mods, callback);
 		tem = Fextent_parent(tem);
 	    }
@@ -0,0 +1,732 @@
+/* lines.c -- Allocation of the strings stored in buffer lines
+   Copyright (C) 1993, 1994 John Harper <john@dcs.warwick.ac.uk>
+   $Id$
+
+   This file is part of Jade.
+
+   Jade is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   Jade is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Jade; see the file COPYING.	If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Each buffer owns an arena that all of its line strings are carved
+   from. Strings up to LINE_MAX_SMALL bytes are rounded up to one of
+   LINE_SIZE_CLASSES sizes and taken from a free list for that size,
+   or from the end of the most recently allocated block. Larger strings
+   are allocated separately but kept on a list in the arena, so that
+   killing a buffer only ever frees a handful of big blocks, never each
+   line individually.
+
+   Blocks and large strings come straight from malloc(), not rep_alloc(),
+   since the threads loading a file allocate them too (see load_file()
+   in files.c). Only the main thread may call into the Lisp system. */
+
+#include "jade.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef NEED_MEMORY_H
+# include <memory.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+
+/* Sizes of the blocks that small strings are carved from. Each
+   buffer starts with small blocks, each subsequent block is twice the
+   size of the previous, up to the maximum. */
+#define LINE_BLOCK_MIN_SIZE (16 * 1024)
+#define LINE_BLOCK_MAX_SIZE (1024 * 1024)
+
+/* Header of each block. The data follows immediately. */
+struct line_block {
+    struct line_block *next;
+    size_t size;
+};
+
+/* Header of each separately-allocated large string. */
+struct line_large {
+    struct line_large *next, *pred;
+    intptr_t size;			/* bytes after the header */
+    bool frozen;			/* part of a line store */
+    bool freed;				/*  and freed since it was frozen */
+};
+
+/* A small string freed while its store was frozen. */
+struct line_freed {
+    char *ptr;
+    int class;
+};
+
+/* Storage frozen by line_arena_freeze(). */
+struct line_store {
+    int refs;
+    struct line_arena *arena;		/* arena still using it, or null */
+    struct line_store *older;		/* arena's previous store */
+    struct line_block *blocks;
+    struct line_large *large;
+    char **ranges;			/* sorted start,end pairs of blocks */
+    intptr_t range_count;
+    char *free_list[LINE_SIZE_CLASSES];	/* arena's free lists when frozen */
+    struct line_freed *freed;		/* small strings to reuse on thaw */
+    intptr_t freed_count, freed_size;
+    bool unused;			/* arena's lines no longer in it */
+    char *map_base;			/* mapped file owned by the store */
+    size_t map_length;
+};
+
+#define BLOCK_DATA(b)  ((char *) ((b) + 1))
+#define LARGE_DATA(l)  ((char *) ((l) + 1))
+#define DATA_LARGE(p)  (((struct line_large *) (p)) - 1)
+
+/* Freed small strings are threaded through their first word. */
+#define FREE_NEXT(p)   (*(char **) (p))
+
+static struct line_store *find_store(struct line_arena *a, char *ptr);
+static bool note_frozen_free(struct line_store *s, char *ptr, int c);
+
+/* Global totals, mostly for the benefit of anyone measuring things.
+   Detached arenas are only counted once they're merged. */
+struct line_arena_stats line_arena_totals;
+
+#define ADD_TOTAL(a, field, n)			\
+    do {					\
+	if(!(a)->detached)			\
+	    line_arena_totals.field += (n);	\
+    } while(0)
+
+
+/* Size classes. The first sixteen classes go up in steps of eight
+   bytes, after that there are four classes per power of two. */
+
+static inline int
+size_class(intptr_t n)
+{
+    intptr_t m;
+    int e;
+    if(n <= 128)
+	return n <= 0 ? 0 : (n - 1) >> 3;
+    m = n - 1;
+    e = 7;
+    while((m >> (e + 1)) != 0)
+	e++;
+    return 16 + (e - 7) * 4 + ((m >> (e - 2)) & 3);
+}
+
+static inline intptr_t
+class_size(int c)
+{
+    if(c < 16)
+	return (c + 1) << 3;
+    else
+    {
+	int e = 7 + (c - 16) / 4;
+	return (intptr_t) (5 + ((c - 16) & 3)) << (e - 2);
+    }
+}
+
+/* Returns the number of bytes actually reserved for a string of
+   LENGTH bytes (including its terminator). Two strings with the same
+   value can be resized in place between each other. */
+intptr_t
+line_buf_size(intptr_t length)
+{
+    if(length > LINE_MAX_SMALL)
+	return ROUND_UP_INT(length, 8);
+    else
+	return class_size(size_class(length));
+}
+
+
+/* Blocks */
+
+/* Push the unused tail of the current block onto the free lists. */
+static void
+retire_block_tail(struct line_arena *a)
+{
+    while(a->block_end - a->block_ptr >= 8)
+    {
+	intptr_t space = a->block_end - a->block_ptr;
+	int c = size_class(MIN(space, LINE_MAX_SMALL));
+	if(class_size(c) > space)
+	    c--;
+	FREE_NEXT(a->block_ptr) = a->free_list[c];
+	a->free_list[c] = a->block_ptr;
+	a->block_ptr += class_size(c);
+    }
+}
+
+static bool
+new_block(struct line_arena *a)
+{
+    struct line_block *b;
+    size_t size = (a->blocks == 0 ? LINE_BLOCK_MIN_SIZE
+		   : MIN(a->blocks->size * 2, LINE_BLOCK_MAX_SIZE));
+    b = malloc(sizeof(struct line_block) + size);
+    if(b == 0)
+	return false;
+    retire_block_tail(a);
+    b->size = size;
+    b->next = a->blocks;
+    a->blocks = b;
+    a->block_ptr = BLOCK_DATA(b);
+    a->block_end = a->block_ptr + size;
+    a->stats.block_count++;
+    a->stats.block_bytes += size;
+    ADD_TOTAL(a, block_count, 1);
+    ADD_TOTAL(a, block_bytes, size);
+    return true;
+}
+
+
+/* Allocation */
+
+/* Allocate a chunk of memory from arena A to store a string of
+   LENGTH bytes (including the terminating zero). */
+char *
+line_arena_alloc(struct line_arena *a, intptr_t length)
+{
+    char *ptr;
+    if(length > LINE_MAX_SMALL)
+    {
+	struct line_large *l = malloc(sizeof(struct line_large)
+				      + line_buf_size(length));
+	if(l == 0)
+	    return 0;
+	l->pred = 0;
+	l->size = line_buf_size(length);
+	l->frozen = false;
+	l->freed = false;
+	l->next = a->large;
+	if(l->next != 0)
+	    l->next->pred = l;
+	a->large = l;
+	a->stats.large_bytes += line_buf_size(length);
+	ADD_TOTAL(a, large_bytes, line_buf_size(length));
+	ptr = LARGE_DATA(l);
+    }
+    else
+    {
+	int c = size_class(length);
+	ptr = a->free_list[c];
+	if(ptr != 0)
+	    a->free_list[c] = FREE_NEXT(ptr);
+	else
+	{
+	    intptr_t size = class_size(c);
+	    if(a->block_end - a->block_ptr < size && !new_block(a))
+		return 0;
+	    ptr = a->block_ptr;
+	    a->block_ptr += size;
+	}
+	a->stats.small_bytes += class_size(c);
+	ADD_TOTAL(a, small_bytes, class_size(c));
+    }
+    a->stats.line_count++;
+    ADD_TOTAL(a, line_count, 1);
+    return ptr;
+}
+
+/* Return PTR, a string of LENGTH bytes allocated from arena A. */
+void
+line_arena_free(struct line_arena *a, char *ptr, intptr_t length)
+{
+    if(LINE_ARENA_MAPPED_P(a, ptr))
+	return;
+    else if(line_arena_frozen_p(a, ptr, length))
+    {
+	/* Still being used by a snapshot, so it's only noted, to be
+	   freed when its store is thawed (see thaw_store()). */
+	if(length > LINE_MAX_SMALL)
+	    DATA_LARGE(ptr)->freed = true;
+	else if(note_frozen_free(find_store(a, ptr), ptr,
+				 size_class(length)))
+	{
+	    a->stats.small_bytes -= line_buf_size(length);
+	    ADD_TOTAL(a, small_bytes, -line_buf_size(length));
+	}
+	a->stats.line_count--;
+	ADD_TOTAL(a, line_count, -1);
+	return;
+    }
+    else if(length > LINE_MAX_SMALL)
+    {
+	struct line_large *l = DATA_LARGE(ptr);
+	if(l->pred != 0)
+	    l->pred->next = l->next;
+	else
+	    a->large = l->next;
+	if(l->next != 0)
+	    l->next->pred = l->pred;
+	a->stats.large_bytes -= line_buf_size(length);
+	ADD_TOTAL(a, large_bytes, -line_buf_size(length));
+	free(l);
+    }
+    else
+    {
+	int c = size_class(length);
+	FREE_NEXT(ptr) = a->free_list[c];
+	a->free_list[c] = ptr;
+	a->stats.small_bytes -= class_size(c);
+	ADD_TOTAL(a, small_bytes, -class_size(c));
+    }
+    a->stats.line_count--;
+    ADD_TOTAL(a, line_count, -1);
+}
+
+/* Release everything allocated from arena A in one go. */
+void
+line_arena_kill(struct line_arena *a)
+{
+    struct line_block *b = a->blocks;
+    struct line_large *l = a->large;
+    while(b != 0)
+    {
+	struct line_block *next = b->next;
+	free(b);
+	b = next;
+    }
+    while(l != 0)
+    {
+	struct line_large *next = l->next;
+	free(l);
+	l = next;
+    }
+    ADD_TOTAL(a, block_count, -a->stats.block_count);
+    ADD_TOTAL(a, block_bytes, -a->stats.block_bytes);
+    ADD_TOTAL(a, small_bytes, -a->stats.small_bytes);
+    ADD_TOTAL(a, large_bytes, -a->stats.large_bytes);
+    ADD_TOTAL(a, line_count, -a->stats.line_count);
+    line_arena_unmap(a);
+    if(a->frozen != 0)
+    {
+	struct line_store *s;
+	for(s = a->frozen; s != 0; s = s->older)
+	    s->arena = 0;
+	line_store_release(a->frozen);
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+/* Move everything allocated from arena SRC into arena DST, leaving SRC
+   empty. The strings stay where they are, they're just owned by DST
+   from now on (SRC mustn't have a mapped file). */
+void
+line_arena_merge(struct line_arena *dst, struct line_arena *src)
+{
+    int c;
+    assert(src->map_base == 0);
+
+    /* DST keeps allocating from its own newest block, so SRC's blocks
+       go on the end of its list. */
+    retire_block_tail(src);
+    if(src->blocks != 0)
+    {
+	struct line_block **b = &dst->blocks;
+	while(*b != 0)
+	    b = &(*b)->next;
+	*b = src->blocks;
+    }
+    if(src->large != 0)
+    {
+	struct line_large *l = src->large;
+	while(l->next != 0)
+	    l = l->next;
+	l->next = dst->large;
+	if(dst->large != 0)
+	    dst->large->pred = l;
+	dst->large = src->large;
+    }
+    for(c = 0; c < LINE_SIZE_CLASSES; c++)
+    {
+	if(src->free_list[c] != 0)
+	{
+	    char *ptr = src->free_list[c];
+	    while(FREE_NEXT(ptr) != 0)
+		ptr = FREE_NEXT(ptr);
+	    FREE_NEXT(ptr) = dst->free_list[c];
+	    dst->free_list[c] = src->free_list[c];
+	}
+    }
+
+    dst->stats.line_count += src->stats.line_count;
+    dst->stats.block_count += src->stats.block_count;
+    dst->stats.block_bytes += src->stats.block_bytes;
+    dst->stats.small_bytes += src->stats.small_bytes;
+    dst->stats.large_bytes += src->stats.large_bytes;
+    if(src->detached)
+    {
+	ADD_TOTAL(dst, line_count, src->stats.line_count);
+	ADD_TOTAL(dst, block_count, src->stats.block_count);
+	ADD_TOTAL(dst, block_bytes, src->stats.block_bytes);
+	ADD_TOTAL(dst, small_bytes, src->stats.small_bytes);
+	ADD_TOTAL(dst, large_bytes, src->stats.large_bytes);
+    }
+    memset(src, 0, sizeof(*src));
+}
+
+/* Free everything allocated from arena A, then give it everything that
+   was allocated from arena FRESH instead, leaving FRESH empty. A keeps
+   its mapped file and its line stores, though none of its strings are
+   in the stores now; they're freed when the stores are thawed. */
+void
+line_arena_replace(struct line_arena *a, struct line_arena *fresh)
+{
+    struct line_arena old = *a;
+    intptr_t mapped_bytes = a->stats.mapped_bytes;
+    struct line_store *s;
+    for(s = a->frozen; s != 0; s = s->older)
+	s->unused = true;
+    old.map_base = 0;
+    old.frozen = 0;
+    line_arena_kill(&old);
+
+    a->blocks = 0;
+    a->large = 0;
+    a->block_ptr = a->block_end = 0;
+    memset(a->free_list, 0, sizeof(a->free_list));
+    memset(&a->stats, 0, sizeof(a->stats));
+    a->stats.mapped_bytes = mapped_bytes;
+    line_arena_merge(a, fresh);
+}
+
+
+/* Mapped files */
+
+#if defined (HAVE_MMAP) && defined (HAVE_SYS_MMAN_H)
+/* Drop the mapping at BASE, and the lease that files.c holds on its
+   file while it's mapped. */
+static void
+unmap_file(char *base, size_t length)
+{
+    munmap(base, length);
+    forget_file_lease(base);
+}
+#endif
+
+/* Map the first LENGTH bytes of the file open on FD into arena A, so
+   that lines can point straight into it. Returns the address of the
+   mapping, or a null pointer if the file couldn't be mapped. */
+char *
+line_arena_map(struct line_arena *a, int fd, size_t length)
+{
+#if defined (HAVE_MMAP) && defined (HAVE_SYS_MMAN_H)
+    struct stat st;
+    void *base;
+    assert(a->map_base == 0);
+    if(length == 0 || fstat(fd, &st) != 0)
+	return 0;
+    base = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(base == MAP_FAILED)
+	return 0;
+    a->map_base = base;
+    a->map_length = length;
+    a->map_dev = st.st_dev;
+    a->map_ino = st.st_ino;
+    a->stats.mapped_bytes = length;
+    line_arena_totals.mapped_bytes += length;
+    return a->map_base;
+#else
+    return 0;
+#endif
+}
+
+/* Drop the mapping of arena A. Nothing may point into it any more. */
+void
+line_arena_unmap(struct line_arena *a)
+{
+#if defined (HAVE_MMAP) && defined (HAVE_SYS_MMAN_H)
+    if(a->map_base != 0)
+    {
+	/* If frozen, the mapping belongs to a line store now */
+	if(!a->map_frozen)
+	    unmap_file(a->map_base, a->map_length);
+	a->map_frozen = false;
+	line_arena_totals.mapped_bytes -= a->map_length;
+	a->stats.mapped_bytes = 0;
+	a->map_base = 0;
+	a->map_length = 0;
+    }
+#endif
+}
+
+
+/* Frozen storage
+
+   Taking a snapshot of a buffer freezes everything allocated from its
+   arena so far: the blocks and large strings are handed over to a new
+   line store, shared by the arena and the snapshot, and the arena
+   starts again from nothing. Strings in a store are never modified or
+   reused, so the snapshot can be read by another thread while the
+   buffer is edited; make_line_writable() gives a line its own copy
+   before changing it. Strings freed while frozen are noted in their
+   store, and once the arena is the only user of a store, the store's
+   contents are given back to it with those strings (and the free lists
+   it was frozen with) ready to be reused. */
+
+static int
+compare_ranges(const void *a, const void *b)
+{
+    char *x = *(char **) a, *y = *(char **) b;
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/* Freeze all strings allocated from arena A so far. Returns the store
+   holding them, with a reference for the caller, or a null pointer if
+   no memory. */
+struct line_store *
+line_arena_freeze(struct line_arena *a)
+{
+    struct line_store *s = rep_alloc(sizeof(struct line_store));
+    struct line_block *b;
+    struct line_large *l;
+    intptr_t i = 0;
+    if(s == 0)
+	return 0;
+    s->range_count = 0;
+    for(b = a->blocks; b != 0; b = b->next)
+	s->range_count++;
+    s->ranges = rep_alloc(sizeof(char *) * 2 * MAX(s->range_count, 1));
+    if(s->ranges == 0)
+    {
+	rep_free(s);
+	return 0;
+    }
+    for(b = a->blocks; b != 0; b = b->next)
+    {
+	s->ranges[i++] = BLOCK_DATA(b);
+	s->ranges[i++] = BLOCK_DATA(b) + b->size;
+    }
+    qsort(s->ranges, s->range_count, sizeof(char *) * 2, compare_ranges);
+    for(l = a->large; l != 0; l = l->next)
+	l->frozen = true;
+    retire_block_tail(a);
+
+    s->refs = 2;			/* the arena and the caller */
+    s->arena = a;
+    s->older = a->frozen;		/* takes the arena's reference */
+    s->blocks = a->blocks;
+    s->large = a->large;
+    s->map_base = 0;
+    s->map_length = 0;
+    s->freed = 0;
+    s->freed_count = s->freed_size = 0;
+    s->unused = false;
+    if(a->map_base != 0 && !a->map_frozen)
+    {
+	s->map_base = a->map_base;
+	s->map_length = a->map_length;
+	a->map_frozen = true;
+    }
+
+    a->frozen = s;
+    a->blocks = 0;
+    a->large = 0;
+    a->block_ptr = a->block_end = 0;
+    memcpy(s->free_list, a->free_list, sizeof(a->free_list));
+    memset(a->free_list, 0, sizeof(a->free_list));
+    return s;
+}
+
+/* Returns the line store of arena A whose blocks contain the small
+   string PTR, or a null pointer. */
+static struct line_store *
+find_store(struct line_arena *a, char *ptr)
+{
+    struct line_store *s;
+    for(s = a->frozen; s != 0; s = s->older)
+    {
+	intptr_t lo = 0, hi = s->range_count;
+	while(lo < hi)
+	{
+	    intptr_t mid = (lo + hi) / 2;
+	    if(ptr < s->ranges[mid*2])
+		hi = mid;
+	    else if(ptr >= s->ranges[mid*2+1])
+		lo = mid + 1;
+	    else
+		return s;
+	}
+    }
+    return 0;
+}
+
+/* True if PTR, a string of LENGTH bytes from arena A, is in one of its
+   line stores (mapped strings aren't counted). */
+bool
+line_arena_frozen_p(struct line_arena *a, char *ptr, intptr_t length)
+{
+    if(a->frozen == 0 || LINE_ARENA_MAPPED_P(a, ptr))
+	return false;
+    else if(length > LINE_MAX_SMALL)
+	return DATA_LARGE(ptr)->frozen;
+    else
+	return find_store(a, ptr) != 0;
+}
+
+/* Remember that PTR, a small string of size class C in store S, has
+   been freed. Returns false if there's no memory to remember it, then
+   it stays allocated until the store is freed. */
+static bool
+note_frozen_free(struct line_store *s, char *ptr, int c)
+{
+    if(s->freed_count == s->freed_size)
+    {
+	intptr_t size = MAX(s->freed_size * 2, 64);
+	struct line_freed *tem = rep_realloc(s->freed,
+					     sizeof(struct line_freed) * size);
+	if(tem == 0)
+	    return false;
+	s->freed = tem;
+	s->freed_size = size;
+    }
+    s->freed[s->freed_count].ptr = ptr;
+    s->freed[s->freed_count].class = c;
+    s->freed_count++;
+    return true;
+}
+
+/* Free the blocks and large strings of store S. */
+static void
+free_store_strings(struct line_store *s)
+{
+    struct line_block *b = s->blocks;
+    struct line_large *l = s->large;
+    while(b != 0)
+    {
+	struct line_block *next = b->next;
+	free(b);
+	b = next;
+    }
+    while(l != 0)
+    {
+	struct line_large *next = l->next;
+	free(l);
+	l = next;
+    }
+    s->blocks = 0;
+    s->large = 0;
+}
+
+/* Free store S and everything in it. */
+static void
+free_store(struct line_store *s)
+{
+    free_store_strings(s);
+#if defined (HAVE_MMAP) && defined (HAVE_SYS_MMAN_H)
+    if(s->map_base != 0)
+	unmap_file(s->map_base, s->map_length);
+#endif
+    if(s->freed != 0)
+	rep_free(s->freed);
+    rep_free(s->ranges);
+    rep_free(s);
+}
+
+/* Give the contents of store S back to its arena, the only thing still
+   using it. Strings that were freed while it was frozen are freed now,
+   and if none of the arena's lines are in S any more, all of it is. */
+static void
+thaw_store(struct line_store *s)
+{
+    struct line_arena *a = s->arena;
+    struct line_block **b = &a->blocks;
+    struct line_large *l, *next;
+    intptr_t i;
+
+    if(s->unused)
+    {
+	/* Not counted in the arena's stats any more */
+	free_store_strings(s);
+	s->freed_count = 0;
+    }
+    while(*b != 0)
+	b = &(*b)->next;
+    *b = s->blocks;
+    for(i = 0; s->blocks != 0 && i < LINE_SIZE_CLASSES; i++)
+    {
+	if(s->free_list[i] != 0)
+	{
+	    char *ptr = s->free_list[i];
+	    while(FREE_NEXT(ptr) != 0)
+		ptr = FREE_NEXT(ptr);
+	    FREE_NEXT(ptr) = a->free_list[i];
+	    a->free_list[i] = s->free_list[i];
+	}
+    }
+    for(i = 0; i < s->freed_count; i++)
+    {
+	int c = s->freed[i].class;
+	FREE_NEXT(s->freed[i].ptr) = a->free_list[c];
+	a->free_list[c] = s->freed[i].ptr;
+    }
+    for(l = s->large; l != 0; l = next)
+    {
+	next = l->next;
+	if(l->freed)
+	{
+	    a->stats.large_bytes -= l->size;
+	    ADD_TOTAL(a, large_bytes, -l->size);
+	    free(l);
+	}
+	else
+	{
+	    l->frozen = false;
+	    l->pred = 0;
+	    l->next = a->large;
+	    if(a->large != 0)
+		a->large->pred = l;
+	    a->large = l;
+	}
+    }
+    if(s->map_base != 0)
+    {
+	if(a->map_frozen && a->map_base == s->map_base)
+	    a->map_frozen = false;
+#if defined (HAVE_MMAP) && defined (HAVE_SYS_MMAN_H)
+	else
+	    unmap_file(s->map_base, s->map_length);
+#endif
+    }
+    a->frozen = s->older;
+    if(s->freed != 0)
+	rep_free(s->freed);
+    rep_free(s->ranges);
+    rep_free(s);
+}
+
+/* Drop a reference to store S. */
+void
+line_store_release(struct line_store *s)
+{
+    while(s != 0)
+    {
+	struct line_store *older = s->older;
+	if(--s->refs > 0)
+	{
+	    /* Thaw S, and any older stores only S was using */
+	    while(s != 0 && s->refs == 1
+		  && s->arena != 0 && s->arena->frozen == s)
+	    {
+		older = s->older;
+		thaw_store(s);
+		s = older;
+	    }
+	    return;
+	}
+	free_store(s);
+	s = older;
+    }
+}
@@ -63,7 +63,9 @@ on_idle (int since_last)
 {
     if(remove_all_messages(true)
        || print_event_prefix()
-       || auto_save_buffers(false))
+       || auto_save_buffers(false)
+       || compact_idle_buffers()
+       || compress_idle_buffers())
     {
 	return true;
     }
@@ -77,6 +79,7 @@ on_termination (void)
     /* Autosave all buffers */
     while(auto_save_buffers(true))
 	;
+    wait_for_background_saves();
 }
 
 static void
@@ -217,8 +217,10 @@ of the buffer's restriction.
     if(!rep_NILP(irp))
     {
 	intptr_t x, y;
+	if(!THAW_LINES(VBUFFER(tx)))
+	    return 0;
 	y = VBUFFER(tx)->line_count - 1;
-	x = VBUFFER(tx)->lines[y].ln_Strlen - 1;
+	x = TX_LINE(VBUFFER(tx), y).ln_Strlen - 1;
 	return make_pos(x, y);
     }
     else
@@ -254,8 +256,10 @@ the cursor).
 	tx = rep_VAL(curr_vw->tx);
     if(!POSP(pos))
 	pos = get_buffer_cursor(VBUFFER(tx));
+    if(!THAW_LINES(VBUFFER(tx)))
+	return 0;
     if(VROW(pos) < VBUFFER(tx)->line_count)
-	return make_pos(VBUFFER(tx)->lines[VROW(pos)].ln_Strlen - 1, VROW(pos));
+	return make_pos(TX_LINE(VBUFFER(tx), VROW(pos)).ln_Strlen - 1, VROW(pos));
     else
 	return Qnil;
 }
@@ -388,17 +392,17 @@ find_matching_bracket(Pos *pos, Lisp_Buffer *tx, char esc)
    that COL is referenced more than once, so no side effects please!   */
 #define TST_ESC(line, col) ((col) > 0 && (line)[(col)-1] == esc)
 
-    LINE *line = tx->lines + PROW(pos);	/* safe */
+    LINE *line = &TX_LINE(tx, PROW(pos));	/* safe */
     if(PCOL(pos) < line->ln_Strlen)
     {
-	char startc = line->ln_Line[PCOL(pos)];
+	char startc = LINE_TEXT(line)[PCOL(pos)];
 	intptr_t i;
 	for(i = 0; i < NUM_BRAC_TYPES; i++)
 	{
 	    if(startc == bracs[i])
 		break;
 	}
-	if(!TST_ESC(line->ln_Line, PCOL(pos)) && (i < NUM_BRAC_TYPES))
+	if(!TST_ESC(LINE_TEXT(line), PCOL(pos)) && (i < NUM_BRAC_TYPES))
 	{
 	    intptr_t x = PCOL(pos);
 	    intptr_t y = PROW(pos);
@@ -418,18 +422,18 @@ find_matching_bracket(Pos *pos, Lisp_Buffer *tx, char esc)
 			    Fsignal(Qerror, rep_LIST_1(rep_VAL(&no_brac)));
 			    return(false);
 			}
-			line--;
+			line = &TX_LINE(tx, y);
 			x = line->ln_Strlen - 1;
 		    }
-		    c = line->ln_Line[x];
+		    c = LINE_TEXT(line)[x];
 		    if(c == startc)
 		    {
-			if(!TST_ESC(line->ln_Line, x))
+			if(!TST_ESC(LINE_TEXT(line), x))
 			    braccount++;
 		    }
 		    else if(c == endc)
 		    {
-			if(!TST_ESC(line->ln_Line, x) && !(--braccount))
+			if(!TST_ESC(LINE_TEXT(line), x) && !(--braccount))
 			    found = true;
 		    }
 		}
@@ -448,18 +452,18 @@ find_matching_bracket(Pos *pos, Lisp_Buffer *tx, char esc)
 			    Fsignal(Qerror, rep_LIST_1(rep_VAL(&no_brac)));
 			    return(false);
 			}
-			line++;
+			line = &TX_LINE(tx, y);
 			x = 0;
 		    }
-		    c = line->ln_Line[x];
+		    c = LINE_TEXT(line)[x];
 		    if(c == startc)
 		    {
-			if(!TST_ESC(line->ln_Line, x))
+			if(!TST_ESC(LINE_TEXT(line), x))
 			    braccount++;
 		    }
 		    else if(c == endc)
 		    {
-			if(!TST_ESC(line->ln_Line, x) && !(--braccount))
+			if(!TST_ESC(LINE_TEXT(line), x) && !(--braccount))
 			    found = true;
 		    }
 		}
@@ -68,15 +68,24 @@ static bool redisplay_no_copy;
 
 /* Glyph buffer basics */
 
+/* Total bytes of all allocated glyph buffers */
+size_t glyph_buf_bytes;
+
+static inline size_t
+glyph_buf_size(intptr_t cols, intptr_t rows)
+{
+    return (sizeof(glyph_buf)
+	    + sizeof(uint8_t *) * rows
+	    + sizeof(uint8_t *) * rows
+	    + sizeof(uintptr_t) * rows
+	    + sizeof(uint8_t) * rows * cols * 2);
+}
+
 /* Allocate a new glyph buffer and initialise it. */
 glyph_buf *
 alloc_glyph_buf(intptr_t cols, intptr_t rows)
 {
-    size_t size = (sizeof(glyph_buf)
-		   + sizeof(uint8_t *) * rows
-		   + sizeof(uint8_t *) * rows
-		   + sizeof(uintptr_t) * rows
-		   + sizeof(uint8_t) * rows * cols * 2);
+    size_t size = glyph_buf_size(cols, rows);
     glyph_buf *g = rep_alloc(size);
     if(g == 0)
 	abort();
@@ -101,6 +110,7 @@ alloc_glyph_buf(intptr_t cols, intptr_t rows)
 	    g->attrs[i] = p;
 	    p += sizeof(uint8_t) * cols;
 	}
+	glyph_buf_bytes += size;
     }
     return g;
 }
@@ -109,7 +119,11 @@ alloc_glyph_buf(intptr_t cols, intptr_t rows)
 void
 free_glyph_buf(glyph_buf *gb)
 {
-    rep_free(gb);
+    if(gb != 0)
+    {
+	glyph_buf_bytes -= glyph_buf_size(gb->cols, gb->rows);
+	rep_free(gb);
+    }
 }
 
 void
@@ -62,20 +62,20 @@ extern char *regprop (char *);
 /* Expands to the current input character at position P. This should
    not be called when P is past the end of the buffer. */
 #define INPUT_CHAR(p)						\
-    ((PCOL(p) >= regtx->lines[PROW(p)].ln_Strlen - 1)	\
+    ((PCOL(p) >= TX_LINE(regtx, PROW(p)).ln_Strlen - 1)	\
      ? '\n'							\
-     : regtx->lines[PROW(p)].ln_Line[PCOL(p)])
+     : LINE_TEXT(&TX_LINE(regtx, PROW(p)))[PCOL(p)])
 
 #define TOUPPER_INPUT_CHAR(p)					\
-    ((PCOL(p) >= regtx->lines[PROW(p)].ln_Strlen - 1)	\
+    ((PCOL(p) >= TX_LINE(regtx, PROW(p)).ln_Strlen - 1)	\
      ? '\n'							\
-     : toupper(regtx->lines[PROW(p)].ln_Line[PCOL(p)]))
+     : toupper(LINE_TEXT(&TX_LINE(regtx, PROW(p)))[PCOL(p)]))
 
 /* Non-zero when position P is past the last character in the buffer. */
 #define END_OF_INPUT(p)						\
     (PROW(p) >= regtx->logical_end				\
      || (PROW(p) == regtx->logical_end - 1			\
-	 && PCOL(p) >= regtx->lines[PROW(p)].ln_Strlen - 1))
+	 && PCOL(p) >= TX_LINE(regtx, PROW(p)).ln_Strlen - 1))
 
 #define START_OF_INPUT(p)					\
     (PROW(p) < regtx->logical_start				\
@@ -93,6 +93,7 @@ regexec_buffer(prog, tx, start, eflags)
     int eflags;
 {
     Pos s;
+    int ret;
 
     /* For REG_NOCASE and strpbrk()  */
     static char mat[3] = "xX";
@@ -123,7 +124,7 @@ regexec_buffer(prog, tx, start, eflags)
 	    while (buffer_strpbrk(tx, &s, mat))
 	    {
 		if(buffer_compare_n(tx, &s, prog->regmust,
-				    prog->regmlen, strncasecmp))
+				    prog->regmlen, true))
 		{
 		    found = 1;
 		    break;	    /* Found it. */
@@ -136,7 +137,7 @@ regexec_buffer(prog, tx, start, eflags)
 	    while (buffer_strchr(tx, &s, prog->regmust[0]))
 	    {
 		if(buffer_compare_n(tx, &s, prog->regmust,
-				    prog->regmlen, strncmp))
+				    prog->regmlen, false))
 		{
 		    found = 1;
 		    break;	    /* Found it. */
@@ -148,6 +149,14 @@ regexec_buffer(prog, tx, start, eflags)
 	    return (0);
     }
 
+    /* Unless the program has nodes that it doesn't know, the
+       automaton in regnfa.c searches in time linear in the length of
+       the text, which the backtracking below can't promise. */
+    COPY_VPOS(&s, start);
+    ret = regexec_automaton(prog, tx, &s, regnocase, false);
+    if (ret >= 0)
+	return (ret);
+
     /* Simplest case:  anchored match need be tried only once.
        For buffers, this means that it only needs to be tried
        at the start of each line after position START */
@@ -258,7 +267,7 @@ regexec_reverse_buffer(prog, tx, start, eflags)
 	    while (buffer_reverse_strpbrk(tx, &s, mat))
 	    {
 		if(buffer_compare_n(tx, &s, prog->regmust,
-				    prog->regmlen, strncasecmp))
+				    prog->regmlen, true))
 		{
 		    found = 1;
 		    break;	    /* Found it. */
@@ -271,7 +280,7 @@ regexec_reverse_buffer(prog, tx, start, eflags)
 	    while (buffer_reverse_strchr(tx, &s, prog->regmust[0]))
 	    {
 		if(buffer_compare_n(tx, &s, prog->regmust,
-				    prog->regmlen, strncmp))
+				    prog->regmlen, false))
 		{
 		    found = 1;
 		    break;	    /* Found it. */
@@ -403,10 +412,14 @@ regmatch_buffer(prog, tx, start, eflags)
     int eflags;
 {
     Pos s;
+    int ret;
     COPY_VPOS(&s, start);
 
     /* Check for REG_NOCASE, means ignore case in string matches.  */
     regnocase = ((eflags & rep_REG_NOCASE) != 0);
+    ret = regexec_automaton(prog, tx, &s, regnocase, true);
+    if (ret >= 0)
+	return ret;
     return regtry(tx, prog, &s);
 }
 
@@ -494,13 +507,13 @@ regmatch(prog)
 	    break;
 	case EOL:
 	    if (PCOL(&reginput)
-		< regtx->lines[PROW(&reginput)].ln_Strlen - 1)
+		< TX_LINE(regtx, PROW(&reginput)).ln_Strlen - 1)
 		return (0);
 	    break;
 	case ANY:
 	    /* Don't match newlines for . */
 	    if(PCOL(&reginput)
-	       == regtx->lines[PROW(&reginput)].ln_Strlen - 1)
+	       == TX_LINE(regtx, PROW(&reginput)).ln_Strlen - 1)
 		return (0);
 	    forward_char(1, regtx, &reginput);
 	    break;
@@ -523,7 +536,7 @@ regmatch(prog)
 		    {
 			/* Advances reginput to end of match */
 			if(!buffer_compare_n(regtx, &reginput, opnd,
-					     len, strncasecmp))
+					     len, true))
 			    return (0);
 		    }
 		}
@@ -540,7 +553,7 @@ regmatch(prog)
 		    {
 			/* Advances reginput to end of match */
 			if(!buffer_compare_n(regtx, &reginput, opnd,
-					     len, strncmp))
+					     len, false))
 			    return (0);
 		    }
 		}
@@ -833,7 +846,7 @@ regrepeat(p)
 	/* TODO: what to do here? How about matching up to the
 	   end of the buffer? No, this could be something like .*
 	   what we want is to match up to the end of a line. */
-	count = (regtx->lines[PROW(&scan)].ln_Strlen - 1) - PCOL(&scan);
+	count = (TX_LINE(regtx, PROW(&scan)).ln_Strlen - 1) - PCOL(&scan);
 	PCOL(&scan) += count;
 	break;
     case EXACTLY:
@@ -0,0 +1,991 @@
+/* regnfa.c -- searching buffers for regexps in linear time
+   Copyright (C) 1998 John Harper <john@dcs.warwick.ac.uk>
+   $Id$
+
+   This file is part of Jade.
+
+   Jade is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   Jade is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Jade; see the file COPYING.	If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* The matcher in regjade.c backtracks through the program that librep
+   compiles each regexp to, so something like `.*foo.*bar' can take
+   time quadratic (or worse) in the size of the buffer. Here the same
+   program is translated to a Thompson NFA, which is run over the lines
+   of the buffer in two passes:
+
+     1. A DFA, built lazily from the NFA, scans forwards for the first
+	position at which any match ends. It also notes the last
+	position before that at which no partial match was alive, the
+	leftmost match can't start before there.
+
+     2. From that position, a Pike VM (an NFA simulation whose threads
+	carry the positions of the subexpressions and are kept in order
+	of priority) finds the same match that the backtracking matcher
+	would have found.
+
+   Both take time linear in the length of the text they scan. Programs
+   that can't be translated are left to regjade.c. */
+
+#define rep_NEED_REGEXP_INTERNALS
+#include "jade.h"
+#include <rep_regexp.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <ctype.h>
+
+#ifdef NEED_MEMORY_H
+# include <memory.h>
+#endif
+
+#define UCHAR(c) ((int) (unsigned char) (c))
+
+/* Instructions of the NFA. */
+enum nfa_op {
+    NFA_CHAR,			/* consume a char in set SET */
+    NFA_SPLIT,			/* go to OUT, else OUT1 */
+    NFA_JUMP,			/* go to OUT */
+    NFA_SAVE,			/* record the position in slot ARG */
+    NFA_ASSERT,			/* check the zero-width node ARG */
+    NFA_MATCH
+};
+
+struct nfa_inst {
+    unsigned char op, arg;
+    int out, out1;		/* -1 for nowhere */
+    int set;
+};
+
+/* The classes of char that the zero-width nodes (BOL, EOL, WEDGE and
+   NWEDGE) look at either side of a position. EDGE is the start or end
+   of the input. */
+enum { CLASS_WORD, CLASS_OTHER, CLASS_NEWLINE, CLASS_EDGE };
+
+#define SET_BYTES (256 / 8)
+#define SET_MEMBER(set, c) ((set)[(c) >> 3] & (1 << ((c) & 7)))
+
+/* A state of the DFA is the set of NFA instructions that threads have
+   reached, before following empty transitions (the kernel), plus the
+   class of the char before the position. Which zero-width nodes match
+   depends on the class of the next char too, so MATCH has a bit for
+   each class, set if a match ends when that class of char follows. */
+struct dfa_state {
+    struct dfa_state *next[256];
+    struct dfa_state *hash_next;
+    unsigned char prev_class;
+    unsigned char match;
+    /* Set when the only thread is the one starting here. */
+    unsigned char fresh;
+    int n_insts;
+    int insts[1];
+};
+
+/* The DFA cache of each automaton is emptied when it holds this many
+   states. If that happens again before this many chars per state have
+   been scanned the DFA is abandoned and the Pike VM searches alone. */
+#define DFA_MAX_STATES 256
+#define DFA_MIN_CHARS_PER_STATE 16
+#define DFA_HASH_SIZE 509
+
+struct automaton {
+    struct automaton *next;
+
+    /* The program that this was made from, and whether case is
+       ignored. */
+    char *program;
+    int length;
+    bool nocase;
+
+    /* Instruction 0 jumps to the start of the program, nothing else
+       jumps to it. */
+    struct nfa_inst *insts;
+    int n_insts;
+    unsigned char (*sets)[SET_BYTES];
+    int n_slots;
+    unsigned char classes[256];
+
+    struct dfa_state *states[DFA_HASH_SIZE];
+    int n_states;
+    intptr_t flushed_at;
+
+    /* Scratch space. Instructions are marked as visited by setting
+       their MARK to GENERATION. */
+    int *stack, *list, *kernel;
+    int n_kernel;
+    unsigned int *mark;
+    unsigned int generation;
+};
+
+/* Automata of the most recently used programs, newest first. */
+#define AUTOMATON_CACHE_SIZE 4
+static struct automaton *automata;
+
+static void dfa_flush(struct automaton *a);
+
+
+/* Translating programs */
+
+static char *
+node_next(char *p)
+{
+    int offset = NEXT(p);
+    if(offset == 0)
+	return 0;
+    return (OP(p) == BACK) ? p - offset : p + offset;
+}
+
+static char *
+node_skip(char *p)
+{
+    if(OP(p) == EXACTLY || OP(p) == ANYOF || OP(p) == ANYBUT)
+	return OPERAND(p) + strlen(OPERAND(p)) + 1;
+    else
+	return OPERAND(p);
+}
+
+/* The number of bytes in PROGRAM, up to and including its END node. */
+static int
+program_length(char *program)
+{
+    char *p = program + 1;
+    while(OP(p) != END)
+	p = node_skip(p);
+    return OPERAND(p) - program;
+}
+
+/* Fill SET with the chars matched by the one-char node P; for EXACTLY
+   nodes, by its char C. Returns false if P isn't such a node. */
+static bool
+node_set(char *p, int c, bool nocase, unsigned char *set)
+{
+    char *opnd = OPERAND(p);
+    int i;
+    memset(set, 0, SET_BYTES);
+    for(i = 0; i < 256; i++)
+    {
+	bool in;
+	switch(OP(p))
+	{
+	case ANY:
+	    in = (i != '\n');
+	    break;
+	case EXACTLY:
+	    in = nocase ? toupper(i) == toupper(c) : i == c;
+	    break;
+	case ANYOF:
+	    in = strchr(opnd, i) != 0;
+	    break;
+	case ANYBUT:
+	    in = strchr(opnd, i) == 0;
+	    break;
+	case WORD:
+	    in = (i == '_' || isalnum(i));
+	    break;
+	case NWORD:
+	    in = !(i == '_' || isalnum(i));
+	    break;
+	case WSPC:
+	    in = isspace(i) != 0;
+	    break;
+	case NWSPC:
+	    in = !isspace(i);
+	    break;
+	case DIGI:
+	    in = isdigit(i) != 0;
+	    break;
+	case NDIGI:
+	    in = !isdigit(i);
+	    break;
+	default:
+	    return false;
+	}
+	if(in)
+	    set[i >> 3] |= 1 << (i & 7);
+    }
+    return true;
+}
+
+static void
+free_automaton(struct automaton *a)
+{
+    dfa_flush(a);
+    if(a->program != 0)
+	rep_free(a->program);
+    if(a->insts != 0)
+	rep_free(a->insts);
+    if(a->sets != 0)
+	rep_free(a->sets);
+    if(a->stack != 0)
+	rep_free(a->stack);
+    if(a->mark != 0)
+	rep_free(a->mark);
+    rep_free(a);
+}
+
+/* Translate the LENGTH bytes of PROGRAM to an NFA, with an instruction
+   for each node (two for the repeating nodes, one per char for EXACTLY
+   nodes). Each instruction goes where the node's successor would have
+   gone in regmatch(); the operands of repeating nodes are translated
+   as well but are never reached. Returns null if PROGRAM contains a
+   node that isn't known here, or if no memory. */
+static struct automaton *
+compile_automaton(char *program, int length, bool nocase)
+{
+    struct automaton *a;
+    int *first, n_insts = 1, n_sets = 0, max_group = 0, i;
+    char *p;
+
+    first = rep_alloc(sizeof(int) * length);
+    if(first == 0)
+	return 0;
+    for(i = 0; i < length; i++)
+	first[i] = -1;
+
+    for(p = program + 1; ; p = node_skip(p))
+    {
+	int op = OP(p);
+	first[p - program] = n_insts;
+	if(op == EXACTLY)
+	{
+	    int len = strlen(OPERAND(p));
+	    n_insts += (len > 0) ? len : 1;
+	    n_sets += len;
+	}
+	else if(op == STAR || op == PLUS || op == NGSTAR || op == NGPLUS)
+	{
+	    n_insts += 2;
+	    n_sets++;
+	}
+	else if(op == ANY || op == ANYOF || op == ANYBUT || op == WORD
+		|| op == NWORD || op == WSPC || op == NWSPC || op == DIGI
+		|| op == NDIGI)
+	{
+	    n_insts++;
+	    n_sets++;
+	}
+	else if(op == END || op == BOL || op == EOL || op == WEDGE
+		|| op == NWEDGE || op == BRANCH || op == BACK || op == NOTHING)
+	    n_insts++;
+	else if(op > OPEN && op <= OPEN + 9)
+	{
+	    if(op - OPEN > max_group)
+		max_group = op - OPEN;
+	    n_insts++;
+	}
+	else if(op > CLOSE && op <= CLOSE + 9)
+	    n_insts++;
+	else
+	{
+	    rep_free(first);
+	    return 0;
+	}
+	if(op == END)
+	    break;
+    }
+
+    a = rep_alloc(sizeof(struct automaton));
+    if(a == 0)
+    {
+	rep_free(first);
+	return 0;
+    }
+    memset(a, 0, sizeof(struct automaton));
+    a->length = length;
+    a->nocase = nocase;
+    a->n_insts = n_insts;
+    a->n_slots = 2 * (max_group + 1);
+    a->program = rep_alloc(length);
+    a->insts = rep_alloc(sizeof(struct nfa_inst) * n_insts);
+    a->sets = rep_alloc(SET_BYTES * (n_sets + 1));
+    a->stack = rep_alloc(sizeof(int) * n_insts * 4);
+    a->mark = rep_alloc(sizeof(unsigned int) * n_insts);
+    if(a->program == 0 || a->insts == 0 || a->sets == 0
+       || a->stack == 0 || a->mark == 0)
+    {
+	rep_free(first);
+	free_automaton(a);
+	return 0;
+    }
+    memcpy(a->program, program, length);
+    a->list = a->stack + n_insts * 2;
+    a->kernel = a->list + n_insts;
+    memset(a->mark, 0, sizeof(unsigned int) * n_insts);
+    for(i = 0; i < 256; i++)
+    {
+	a->classes[i] = ((i == '_' || isalnum(i)) ? CLASS_WORD
+			 : (i == '\n') ? CLASS_NEWLINE : CLASS_OTHER);
+    }
+
+#define TARGET(p) ((p) != 0 ? first[(p) - program] : -1)
+
+    a->insts[0].op = NFA_JUMP;
+    a->insts[0].out = first[1];
+    n_sets = 0;
+    for(p = program + 1; ; p = node_skip(p))
+    {
+	struct nfa_inst *inst = &a->insts[first[p - program]];
+	char *next = node_next(p);
+	int op = OP(p), j;
+	inst->out = TARGET(next);
+	inst->out1 = -1;
+	switch(op)
+	{
+	case EXACTLY:
+	    inst->op = NFA_JUMP;
+	    for(j = 0; OPERAND(p)[j] != 0; j++)
+	    {
+		inst[j].op = NFA_CHAR;
+		inst[j].set = n_sets;
+		node_set(p, UCHAR(OPERAND(p)[j]), nocase, a->sets[n_sets++]);
+		inst[j].out = (OPERAND(p)[j+1] != 0
+			       ? first[p - program] + j + 1 : TARGET(next));
+		inst[j].out1 = -1;
+	    }
+	    break;
+
+	case STAR: case PLUS: case NGSTAR: case NGPLUS:
+	    if(!node_set(OPERAND(p), UCHAR(*OPERAND(OPERAND(p))),
+			 nocase, a->sets[n_sets]))
+	    {
+		rep_free(first);
+		free_automaton(a);
+		return 0;
+	    }
+	    j = first[p - program];
+	    if(op == STAR || op == NGSTAR)
+	    {
+		/* A SPLIT, then the char looping back to it. */
+		inst[0].op = NFA_SPLIT;
+		inst[0].out = (op == STAR) ? j + 1 : TARGET(next);
+		inst[0].out1 = (op == STAR) ? TARGET(next) : j + 1;
+		inst[1].op = NFA_CHAR;
+		inst[1].set = n_sets++;
+		inst[1].out = j;
+		inst[1].out1 = -1;
+	    }
+	    else
+	    {
+		/* The char, then a SPLIT looping back to it. */
+		inst[0].op = NFA_CHAR;
+		inst[0].set = n_sets++;
+		inst[0].out = j + 1;
+		inst[1].op = NFA_SPLIT;
+		inst[1].out = (op == PLUS) ? j : TARGET(next);
+		inst[1].out1 = (op == PLUS) ? TARGET(next) : j;
+	    }
+	    break;
+
+	case BRANCH:
+	    /* As in regmatch(), a BRANCH not followed by another has
+	       no alternative. */
+	    inst->out = TARGET(OPERAND(p));
+	    if(next != 0 && OP(next) == BRANCH)
+	    {
+		inst->op = NFA_SPLIT;
+		inst->out1 = TARGET(next);
+	    }
+	    else
+		inst->op = NFA_JUMP;
+	    break;
+
+	case BACK: case NOTHING:
+	    inst->op = NFA_JUMP;
+	    break;
+
+	case BOL: case EOL: case WEDGE: case NWEDGE:
+	    inst->op = NFA_ASSERT;
+	    inst->arg = op;
+	    break;
+
+	case END:
+	    inst->op = NFA_MATCH;
+	    break;
+
+	default:
+	    if(op > OPEN && op <= OPEN + 9)
+	    {
+		inst->op = NFA_SAVE;
+		inst->arg = 2 * (op - OPEN);
+	    }
+	    else if(op > CLOSE && op <= CLOSE + 9)
+	    {
+		inst->op = NFA_SAVE;
+		inst->arg = 2 * (op - CLOSE) + 1;
+	    }
+	    else
+	    {
+		/* One of the single-char nodes */
+		inst->op = NFA_CHAR;
+		inst->set = n_sets;
+		node_set(p, 0, nocase, a->sets[n_sets++]);
+	    }
+	}
+	if(op == END)
+	    break;
+    }
+
+#undef TARGET
+
+    rep_free(first);
+    return a;
+}
+
+/* Returns the automaton of PROG, translating it if it isn't cached.
+   Returns null if PROG can't be translated. */
+static struct automaton *
+find_automaton(rep_regexp *prog, bool nocase)
+{
+    int length = program_length(prog->program);
+    struct automaton **ptr = &automata, *a;
+    int count = 0;
+    while((a = *ptr) != 0)
+    {
+	if(a->length == length && a->nocase == nocase
+	   && memcmp(a->program, prog->program, length) == 0)
+	{
+	    *ptr = a->next;
+	    a->next = automata;
+	    automata = a;
+	    return a;
+	}
+	if(++count == AUTOMATON_CACHE_SIZE)
+	{
+	    /* Forget the least recently used. */
+	    *ptr = a->next;
+	    free_automaton(a);
+	}
+	else
+	    ptr = &a->next;
+    }
+    a = compile_automaton(prog->program, length, nocase);
+    if(a != 0)
+    {
+	a->next = automata;
+	automata = a;
+    }
+    return a;
+}
+
+
+/* Running the NFA */
+
+/* Returns a new value for marking instructions as visited. */
+static unsigned int
+next_generation(struct automaton *a)
+{
+    if(++a->generation == 0)
+    {
+	memset(a->mark, 0, sizeof(unsigned int) * a->n_insts);
+	a->generation = 1;
+    }
+    return a->generation;
+}
+
+/* True if the zero-width node OP matches at a position between chars
+   of classes PREV and NEXT; as in regmatch(). */
+static bool
+assertion_holds(int op, int prev, int next)
+{
+    switch(op)
+    {
+    case BOL:
+	return prev == CLASS_NEWLINE || prev == CLASS_EDGE;
+    case EOL:
+	return next == CLASS_NEWLINE || next == CLASS_EDGE;
+    case WEDGE:
+	return (prev == CLASS_EDGE || next == CLASS_EDGE
+		|| (prev == CLASS_WORD) != (next == CLASS_WORD));
+    case NWEDGE:
+	return (prev != CLASS_EDGE && next != CLASS_EDGE
+		&& (prev == CLASS_WORD) == (next == CLASS_WORD));
+    }
+    return false;
+}
+
+/* The char at POS in TX, '\n' at the end of each line but the last, or
+   -1 at the end of the input. */
+static inline int
+input_char(Lisp_Buffer *tx, Pos *pos)
+{
+    LINE *line = &TX_LINE(tx, PROW(pos));
+    if(PCOL(pos) < line->ln_Strlen - 1)
+	return UCHAR(LINE_TEXT(line)[PCOL(pos)]);
+    return (PROW(pos) < tx->logical_end - 1) ? '\n' : -1;
+}
+
+/* The class of the char before POS in TX. */
+static int
+prev_class(struct automaton *a, Lisp_Buffer *tx, Pos *pos)
+{
+    if(PCOL(pos) > 0)
+	return a->classes[UCHAR(LINE_TEXT(&TX_LINE(tx, PROW(pos)))
+				[PCOL(pos) - 1])];
+    return (PROW(pos) > tx->logical_start) ? CLASS_NEWLINE : CLASS_EDGE;
+}
+
+#define CHAR_CLASS(a, c) ((c) < 0 ? CLASS_EDGE : (a)->classes[c])
+
+
+/* The DFA */
+
+/* Follow the empty transitions from the kernel of S when the next char
+   is of class NEXT. Leaves the NFA_CHAR instructions reached in the
+   list of A and returns how many there are, or -1 if NFA_MATCH was
+   reached. */
+static int
+dfa_closure(struct automaton *a, struct dfa_state *s, int next)
+{
+    unsigned int generation = next_generation(a);
+    int *stack = a->stack, sp = 0, n = 0, i;
+    for(i = s->n_insts - 1; i >= 0; i--)
+	stack[sp++] = s->insts[i];
+    while(sp > 0)
+    {
+	int pc = stack[--sp];
+	while(pc >= 0 && a->mark[pc] != generation)
+	{
+	    struct nfa_inst *inst = &a->insts[pc];
+	    a->mark[pc] = generation;
+	    switch(inst->op)
+	    {
+	    case NFA_CHAR:
+		a->list[n++] = pc;
+		pc = -1;
+		break;
+	    case NFA_MATCH:
+		return -1;
+	    case NFA_SPLIT:
+		stack[sp++] = inst->out1;
+		pc = inst->out;
+		break;
+	    case NFA_ASSERT:
+		pc = (assertion_holds(inst->arg, s->prev_class, next)
+		      ? inst->out : -1);
+		break;
+	    default:
+		pc = inst->out;
+	    }
+	}
+    }
+    return n;
+}
+
+static unsigned int
+hash_kernel(int *insts, int n, int prev)
+{
+    unsigned int hash = prev;
+    while(n-- > 0)
+	hash = hash * 31 + *insts++;
+    return hash % DFA_HASH_SIZE;
+}
+
+/* Returns the state with kernel INSTS (N of them, in increasing order)
+   after a char of class PREV, or null if there's no room for it. */
+static struct dfa_state *
+dfa_state(struct automaton *a, int *insts, int n, int prev)
+{
+    unsigned int hash = hash_kernel(insts, n, prev);
+    struct dfa_state *s;
+    int class;
+    for(s = a->states[hash]; s != 0; s = s->hash_next)
+    {
+	if(s->prev_class == prev && s->n_insts == n
+	   && memcmp(s->insts, insts, sizeof(int) * n) == 0)
+	    return s;
+    }
+    if(a->n_states >= DFA_MAX_STATES)
+	return 0;
+    s = rep_alloc(offsetof(struct dfa_state, insts) + sizeof(int) * n);
+    if(s == 0)
+	return 0;
+    memset(s->next, 0, sizeof(s->next));
+    s->prev_class = prev;
+    s->n_insts = n;
+    memcpy(s->insts, insts, sizeof(int) * n);
+    s->fresh = (n == 1 && insts[0] == 0);
+    s->match = 0;
+    for(class = CLASS_WORD; class <= CLASS_EDGE; class++)
+    {
+	if(dfa_closure(a, s, class) < 0)
+	    s->match |= 1 << class;
+    }
+    s->hash_next = a->states[hash];
+    a->states[hash] = s;
+    a->n_states++;
+    return s;
+}
+
+static void
+dfa_flush(struct automaton *a)
+{
+    int i;
+    for(i = 0; i < DFA_HASH_SIZE; i++)
+    {
+	struct dfa_state *s = a->states[i];
+	while(s != 0)
+	{
+	    struct dfa_state *next = s->hash_next;
+	    rep_free(s);
+	    s = next;
+	}
+	a->states[i] = 0;
+    }
+    a->n_states = 0;
+}
+
+static int
+compare_insts(const void *x, const void *y)
+{
+    return *(const int *) x - *(const int *) y;
+}
+
+/* Returns the state that S goes to on char C, adding it to the cache.
+   No match may end before C in S. SCANNED is the number of chars read
+   so far in this search, to decide whether flushing the cache is
+   worthwhile if it's full. Returns null if the DFA gives up. */
+static struct dfa_state *
+dfa_next(struct automaton *a, struct dfa_state *s, int c, intptr_t scanned)
+{
+    struct dfa_state *next;
+    int n = dfa_closure(a, s, a->classes[c]), i;
+    unsigned int generation = next_generation(a);
+
+    /* Each search starts another thread at every position. */
+    a->n_kernel = 0;
+    a->kernel[a->n_kernel++] = 0;
+    a->mark[0] = generation;
+    for(i = 0; i < n; i++)
+    {
+	struct nfa_inst *inst = &a->insts[a->list[i]];
+	if(SET_MEMBER(a->sets[inst->set], c)
+	   && inst->out >= 0 && a->mark[inst->out] != generation)
+	{
+	    a->mark[inst->out] = generation;
+	    a->kernel[a->n_kernel++] = inst->out;
+	}
+    }
+    qsort(a->kernel, a->n_kernel, sizeof(int), compare_insts);
+
+    next = dfa_state(a, a->kernel, a->n_kernel, a->classes[c]);
+    if(next != 0)
+    {
+	s->next[c] = next;
+	return next;
+    }
+
+    /* Out of room. S is lost with the rest of the cache. */
+    if(scanned - a->flushed_at < DFA_MAX_STATES * DFA_MIN_CHARS_PER_STATE)
+	return 0;
+    dfa_flush(a);
+    a->flushed_at = scanned;
+    return dfa_state(a, a->kernel, a->n_kernel, a->classes[c]);
+}
+
+/* Scan TX forwards from START for the first position at which a match
+   ends. Returns 1 if there is one, setting FROM to the last position
+   before it at which only a match starting there was in progress.
+   Returns 0 if there are no matches, or -1 if the DFA gave up. */
+static int
+dfa_search(struct automaton *a, Lisp_Buffer *tx, Pos *start, Pos *from)
+{
+    intptr_t row = PROW(start), col = PCOL(start);
+    intptr_t last = tx->logical_end - 1, scanned = 0;
+    int initial = 0;
+    struct dfa_state *s;
+
+    a->flushed_at = -DFA_MAX_STATES * DFA_MIN_CHARS_PER_STATE;
+    s = dfa_state(a, &initial, 1, prev_class(a, tx, start));
+    if(s == 0)
+    {
+	dfa_flush(a);
+	s = dfa_state(a, &initial, 1, prev_class(a, tx, start));
+	if(s == 0)
+	    return -1;
+    }
+    *from = *start;
+
+    for(;;)
+    {
+	LINE *line = &TX_LINE(tx, row);
+	unsigned char *text = (unsigned char *) LINE_TEXT(line);
+	intptr_t len = line->ln_Strlen - 1;
+	struct dfa_state *next;
+	int c;
+
+	for(; col < len; col++)
+	{
+	    c = text[col];
+	    if(s->fresh)
+	    {
+		PROW(from) = row;
+		PCOL(from) = col;
+	    }
+	    if(s->match & (1 << a->classes[c]))
+		return 1;
+	    next = s->next[c];
+	    if(next == 0)
+	    {
+		next = dfa_next(a, s, c, scanned + col);
+		if(next == 0)
+		    return -1;
+	    }
+	    s = next;
+	}
+
+	if(s->fresh)
+	{
+	    PROW(from) = row;
+	    PCOL(from) = col;
+	}
+	if(row == last)
+	    return (s->match & (1 << CLASS_EDGE)) != 0;
+	if(s->match & (1 << CLASS_NEWLINE))
+	    return 1;
+	next = s->next['\n'];
+	if(next == 0)
+	{
+	    next = dfa_next(a, s, '\n', scanned + col);
+	    if(next == 0)
+		return -1;
+	}
+	s = next;
+	scanned += len + 1;
+	row++;
+	col = 0;
+    }
+}
+
+
+/* The Pike VM */
+
+struct thread_list {
+    int n;
+    int *insts;
+    Pos *slots;			/* N_SLOTS for each thread */
+};
+
+struct pike_frame {
+    int pc;
+    int slot;			/* if >= 0, restore it to OLD */
+    Pos old;
+};
+
+/* Add a thread at PC to L, with its slots SLOTS, and the threads that
+   it leads to by empty transitions, in order of priority. POS is the
+   position and PREV and NEXT the classes of the chars either side of
+   it. Instructions already visited in L (marked with GENERATION) are
+   skipped, they were reached by a thread of higher priority. */
+static void
+add_thread(struct automaton *a, struct thread_list *l, int pc, Pos *slots,
+	   struct pike_frame *stack, unsigned int generation,
+	   Pos *pos, int prev, int next)
+{
+    int sp = 0;
+    stack[sp].pc = pc;
+    stack[sp++].slot = -1;
+    while(sp > 0)
+    {
+	struct pike_frame *f = &stack[--sp];
+	if(f->slot >= 0)
+	{
+	    slots[f->slot] = f->old;
+	    continue;
+	}
+	pc = f->pc;
+	while(pc >= 0 && a->mark[pc] != generation)
+	{
+	    struct nfa_inst *inst = &a->insts[pc];
+	    a->mark[pc] = generation;
+	    switch(inst->op)
+	    {
+	    case NFA_CHAR:
+	    case NFA_MATCH:
+		l->insts[l->n] = pc;
+		memcpy(&l->slots[l->n * a->n_slots], slots,
+		       sizeof(Pos) * a->n_slots);
+		l->n++;
+		pc = -1;
+		break;
+	    case NFA_SPLIT:
+		stack[sp].pc = inst->out1;
+		stack[sp++].slot = -1;
+		pc = inst->out;
+		break;
+	    case NFA_SAVE:
+		stack[sp].slot = inst->arg;
+		stack[sp++].old = slots[inst->arg];
+		slots[inst->arg] = *pos;
+		pc = inst->out;
+		break;
+	    case NFA_ASSERT:
+		pc = (assertion_holds(inst->arg, prev, next)
+		      ? inst->out : -1);
+		break;
+	    default:
+		pc = inst->out;
+	    }
+	}
+    }
+}
+
+/* Run the NFA over TX from FROM, finding the leftmost match at or
+   after it (or only at it, if ANCHORED). The slots of the match are
+   stored in RESULT, with -1 as the row of those that weren't set.
+   Returns 1 if there's a match, 0 if not, or -1 if no memory. */
+static int
+pike_match(struct automaton *a, Lisp_Buffer *tx, Pos *from,
+	   bool anchored, Pos *result)
+{
+    int n_insts = a->n_insts, n_slots = a->n_slots, i;
+    struct thread_list lists[2], *clist = &lists[0], *nlist = &lists[1];
+    struct pike_frame *stack;
+    Pos *work, pos = *from, next_pos;
+    int c, next_c, prev;
+    unsigned int generation;
+    bool matched = false;
+    char *block;
+
+    block = rep_alloc(sizeof(int) * n_insts * 2
+		      + sizeof(Pos) * (n_insts * n_slots * 2 + n_slots)
+		      + sizeof(struct pike_frame) * (n_insts + 1));
+    if(block == 0)
+	return -1;
+    stack = (struct pike_frame *) block;
+    work = (Pos *) (stack + n_insts + 1);
+    clist->slots = work + n_slots;
+    nlist->slots = clist->slots + n_insts * n_slots;
+    clist->insts = (int *) (nlist->slots + n_insts * n_slots);
+    nlist->insts = clist->insts + n_insts;
+
+    prev = prev_class(a, tx, &pos);
+    c = input_char(tx, &pos);
+    clist->n = 0;
+    generation = next_generation(a);
+    for(;;)
+    {
+	struct thread_list *tem;
+
+	/* A new thread starting here has the lowest priority. */
+	if(!matched && (!anchored || PPOS_EQUAL_P(&pos, from)))
+	{
+	    for(i = 0; i < n_slots; i++)
+		PROW(&work[i]) = -1;
+	    work[0] = pos;
+	    add_thread(a, clist, 0, work, stack, generation,
+		       &pos, prev, CHAR_CLASS(a, c));
+	}
+	if(clist->n == 0 && (matched || anchored))
+	    break;
+
+	next_pos = pos;
+	next_c = -1;
+	if(c >= 0)
+	{
+	    if(c == '\n')
+	    {
+		PROW(&next_pos)++;
+		PCOL(&next_pos) = 0;
+	    }
+	    else
+		PCOL(&next_pos)++;
+	    next_c = input_char(tx, &next_pos);
+	}
+
+	generation = next_generation(a);
+	nlist->n = 0;
+	for(i = 0; i < clist->n; i++)
+	{
+	    struct nfa_inst *inst = &a->insts[clist->insts[i]];
+	    Pos *slots = &clist->slots[i * n_slots];
+	    if(inst->op == NFA_MATCH)
+	    {
+		/* Threads after this one have lower priority. */
+		memcpy(result, slots, sizeof(Pos) * n_slots);
+		result[1] = pos;
+		matched = true;
+		break;
+	    }
+	    if(c >= 0 && SET_MEMBER(a->sets[inst->set], c) && inst->out >= 0)
+	    {
+		memcpy(work, slots, sizeof(Pos) * n_slots);
+		add_thread(a, nlist, inst->out, work, stack, generation,
+			   &next_pos, a->classes[c], CHAR_CLASS(a, next_c));
+	    }
+	}
+	if(c < 0)
+	    break;
+
+	tem = clist;
+	clist = nlist;
+	nlist = tem;
+	pos = next_pos;
+	prev = a->classes[c];
+	c = next_c;
+    }
+
+    rep_free(block);
+    return matched ? 1 : 0;
+}
+
+
+/* Entry point */
+
+/* Search TX forwards from START for a match of PROG, or when ANCHORED
+   only try to match at START, storing the match data in PROG like
+   regtry() does. Returns 1 for a match, 0 for none, or -1 if PROG
+   can't be run here and regjade.c has to do it. */
+int
+regexec_automaton(rep_regexp *prog, Lisp_Buffer *tx, Pos *start,
+		  bool nocase, bool anchored)
+{
+    struct automaton *a;
+    Pos from, slots[2 * rep_NSUBEXP];
+    int i, ret;
+
+    if(PROW(start) < tx->logical_start || PROW(start) >= tx->logical_end
+       || PCOL(start) < 0
+       || PCOL(start) >= TX_LINE(tx, PROW(start)).ln_Strlen)
+	return -1;
+
+    a = find_automaton(prog, nocase);
+    if(a == 0)
+	return -1;
+
+    from = *start;
+    if(!anchored)
+    {
+	ret = dfa_search(a, tx, start, &from);
+	if(ret == 0)
+	    return 0;
+	else if(ret < 0)
+	    from = *start;
+    }
+    ret = pike_match(a, tx, &from, anchored, slots);
+    if(ret <= 0)
+	return ret;
+
+    for(i = 0; i < rep_NSUBEXP; i++)
+    {
+	prog->matches.obj.startp[i] = 0;
+	prog->matches.obj.endp[i] = 0;
+	if(2 * i < a->n_slots && PROW(&slots[2 * i]) >= 0)
+	    prog->matches.obj.startp[i] = make_pos(PCOL(&slots[2 * i]),
+						   PROW(&slots[2 * i]));
+	if(2 * i + 1 < a->n_slots && PROW(&slots[2 * i + 1]) >= 0)
+	    prog->matches.obj.endp[i] = make_pos(PCOL(&slots[2 * i + 1]),
+						 PROW(&slots[2 * i + 1]));
+    }
+    prog->lasttype = rep_reg_obj;
+    return 1;
+}
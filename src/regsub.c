@@ -61,6 +61,10 @@ jade_regsub(lasttype, matches, source, dest, data)
 	rep_regerror("Bad type of data to regsub");
 	return;
     }
+    if (lasttype == rep_reg_obj && !THAW_LINES(VBUFFER(rep_VAL(data)))) {
+	*dest = '\0';
+	return;
+    }
 
     src = source;
     dst = dest;
@@ -143,6 +147,8 @@ jade_regsublen(lasttype, matches, source, data)
 	rep_regerror("Bad type of data to regsublen");
 	return (0);
     }
+    if (lasttype == rep_reg_obj && !THAW_LINES(VBUFFER(rep_VAL(data))))
+	return (0);
 
     src = source;
     while ((c = *src++) != '\0') {
@@ -0,0 +1,171 @@
+/* snapshot.c -- Immutable copies of the text of buffers
+   Copyright (C) 1993, 1994 John Harper <john@dcs.warwick.ac.uk>
+   $Id$
+
+   This file is part of Jade.
+
+   Jade is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   Jade is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Jade; see the file COPYING.	If not, write to
+   the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* A snapshot records the lines of a buffer as they were when it was
+   taken. Only the array of lines is copied, the strings themselves are
+   shared with the buffer by freezing its line arena (see lines.c), so
+   the buffer copies each line the first time it's changed afterwards.
+
+   Nothing in a snapshot ever changes, so another thread can save,
+   search or index it while the buffer is being edited. Snapshots must
+   be made and released by the main thread though. */
+
+#include "jade.h"
+#include <string.h>
+
+#ifdef NEED_MEMORY_H
+# include <memory.h>
+#endif
+
+/* Returns a snapshot of the current contents of TX, or a null pointer
+   if no memory. */
+Buffer_Snapshot *
+make_buffer_snapshot(Lisp_Buffer *tx)
+{
+    LINE *lines;
+    Buffer_Snapshot *snap;
+    intptr_t tail = tx->line_count - tx->line_gap;
+    if(!THAW_LINES(tx))
+	return 0;
+    lines = TX_LINES(tx);
+    snap = rep_alloc(sizeof(Buffer_Snapshot));
+    if(snap == 0)
+	return 0;
+    snap->lines = rep_alloc(sizeof(LINE) * tx->line_count);
+    if(snap->lines == 0)
+    {
+	rep_free(snap);
+	return 0;
+    }
+    snap->store = line_arena_freeze(&tx->line_arena);
+    if(snap->store == 0)
+    {
+	rep_free(snap->lines);
+	rep_free(snap);
+	return 0;
+    }
+    memcpy(snap->lines, lines, sizeof(LINE) * tx->line_gap);
+    memcpy(snap->lines + tx->line_gap,
+	   lines + tx->total_lines - tail, sizeof(LINE) * tail);
+    snap->line_count = tx->line_count;
+    snap->change_count = tx->change_count;
+    snap->map_base = tx->line_arena.map_base;
+    snap->map_length = tx->line_arena.map_length;
+    snap->map_dev = tx->line_arena.map_dev;
+    snap->map_ino = tx->line_arena.map_ino;
+    snap->map_copy = 0;
+    return snap;
+}
+
+/* Finish with SNAP. Any lines only it was using are given back to
+   the buffer it was taken from. */
+void
+release_buffer_snapshot(Buffer_Snapshot *snap)
+{
+    line_store_release(snap->store);
+    if(snap->map_copy != 0)
+	rep_free(snap->map_copy);
+    rep_free(snap->lines);
+    rep_free(snap);
+}
+
+/* Give the lines of SNAP that point into the buffer's mapped file a copy
+   of their own, one after the other with their newlines, as they were
+   in the file. Needed before the file is overwritten in place, when no
+   other thread may be reading SNAP. Returns false if no memory (SNAP is
+   unchanged). */
+bool
+unmap_buffer_snapshot(Buffer_Snapshot *snap)
+{
+    intptr_t row, length = 0;
+    char *copy, *ptr;
+    if(snap->map_base == 0 || snap->map_copy != 0)
+	return true;
+    for(row = 0; row < snap->line_count; row++)
+    {
+	LINE *line = &snap->lines[row];
+	if(!LINE_INLINE_P(line)
+	   && ((uintptr_t) line->ln_Text.heap
+	       - (uintptr_t) snap->map_base < snap->map_length))
+	{
+	    length += line->ln_Strlen;
+	}
+    }
+    copy = rep_alloc(MAX(length, 1));
+    if(copy == 0)
+	return false;
+    ptr = copy;
+    for(row = 0; row < snap->line_count; row++)
+    {
+	LINE *line = &snap->lines[row];
+	if(!LINE_INLINE_P(line)
+	   && ((uintptr_t) line->ln_Text.heap
+	       - (uintptr_t) snap->map_base < snap->map_length))
+	{
+	    memcpy(ptr, line->ln_Text.heap, line->ln_Strlen);
+	    line->ln_Text.heap = ptr;
+	    ptr += line->ln_Strlen;
+	}
+    }
+    snap->map_copy = copy;
+    snap->map_base = copy;
+    snap->map_length = length;
+    return true;
+}
+
+/* Returns the number of bytes between START and END in SNAP, counting
+   each newline as one byte. */
+intptr_t
+snapshot_section_length(Buffer_Snapshot *snap, repv start, repv end)
+{
+    intptr_t row, length;
+    if(VROW(start) == VROW(end))
+	return VCOL(end) - VCOL(start);
+    length = snap->lines[VROW(start)].ln_Strlen - VCOL(start);
+    for(row = VROW(start) + 1; row < VROW(end); row++)
+	length += snap->lines[row].ln_Strlen;
+    return length + VCOL(end);
+}
+
+/* Copies the text between START and END in SNAP to BUF, like
+   copy_section() */
+void
+snapshot_copy_section(Buffer_Snapshot *snap, repv start, repv end, char *buf)
+{
+    intptr_t row = VROW(start), length;
+    if(VROW(start) == VROW(end))
+    {
+	length = VCOL(end) - VCOL(start);
+	memcpy(buf, LINE_TEXT(&snap->lines[row]) + VCOL(start), length);
+	return;
+    }
+    length = snap->lines[row].ln_Strlen - VCOL(start) - 1;
+    memcpy(buf, LINE_TEXT(&snap->lines[row]) + VCOL(start), length);
+    buf[length] = '\n';
+    buf += length + 1;
+    for(row++; row < VROW(end); row++)
+    {
+	length = snap->lines[row].ln_Strlen - 1;
+	memcpy(buf, LINE_TEXT(&snap->lines[row]), length);
+	buf[length] = '\n';
+	buf += length + 1;
+    }
+    memcpy(buf, LINE_TEXT(&snap->lines[row]), VCOL(end));
+}
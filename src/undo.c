@@ -26,6 +26,10 @@
    information.  */
 static int max_undo_size = 10000;
 
+/* Maximum number of bytes of original text that one segment of a batch
+   of edits may cover, see batch_edit(). */
+static int max_batch_undo_size = 1024 * 1024;
+
 /* Lets us use the string which undo_record_deletion() creates for
    other uses.	*/
 static repv pending_deletion_string;
@@ -40,6 +44,41 @@ static Lisp_Buffer *last_undid_tx;
 
 DEFSYM(undo, "undo");
 
+/* Roughly the number of bytes used by ITEM of an undo list, and the
+   cons cell holding it. */
+static size_t
+undo_item_size(repv item)
+{
+    size_t size = sizeof(rep_cons);
+    if(rep_CONSP(item))
+    {
+	size += sizeof(rep_cons);
+	if(rep_CONSP(rep_CDR(item)))
+	    size += sizeof(rep_cons);
+	else if(rep_STRINGP(rep_CDR(item)))
+	    size += rep_STRING_LEN(rep_CDR(item));
+    }
+    return size;
+}
+
+/* Roughly the number of bytes used by undo list LIST. */
+static size_t
+undo_list_size(repv list)
+{
+    size_t size = 0;
+    for(; rep_CONSP(list); list = rep_CDR(list))
+	size += undo_item_size(rep_CAR(list));
+    return size;
+}
+
+/* Push ITEM onto the undo list of TX. */
+static inline void
+push_undo_item(Lisp_Buffer *tx, repv item)
+{
+    tx->undo_list = Fcons(item, tx->undo_list);
+    tx->undo_bytes += undo_item_size(item);
+}
+
 /* If not in an undo, this will re-combine the waiting_undo and
    undo_list. */
 
@@ -90,8 +129,147 @@ check_first_mod(Lisp_Buffer *tx)
        && ((tx->car & TXFF_NO_UNDO) == 0))
     {
 	/* First modification, record this. */
-	tx->undo_list = Fcons(Qt, tx->undo_list);
+	push_undo_item(tx, Qt);
+    }
+}
+
+/* Returns the number of bytes in rows FROM up to TO of SNAP, with their
+   newlines. */
+static intptr_t
+snapshot_rows_length(Buffer_Snapshot *snap, intptr_t from, intptr_t to)
+{
+    intptr_t length = 0;
+    for(; from < to; from++)
+	length += snap->lines[from].ln_Strlen;
+    return length;
+}
+
+/* Push the undo records for the batch of edits in TX so far, replacing
+   the original text of its rows with what they hold now. NEW_LAST is
+   the row the last of them will be at when the records are undone,
+   NEW_LAST_LEN the length of that row now. */
+static void
+record_edit_batch(Lisp_Buffer *tx, intptr_t new_last, intptr_t new_last_len)
+{
+    Buffer_Snapshot *snap = tx->batch_text;
+    intptr_t first = tx->batch_first_row;
+    intptr_t old_last = snap->line_count - tx->batch_tail_rows - 1;
+    repv start = make_pos(0, first);
+    repv old_end = make_pos(snap->lines[old_last].ln_Strlen - 1, old_last);
+    repv new_end = make_pos(new_last_len - 1, new_last);
+    intptr_t len = snapshot_section_length(snap, start, old_end);
+    repv string = rep_allocate_string(len + 1);
+    if(string != 0)
+    {
+	snapshot_copy_section(snap, start, old_end, rep_MUTABLE_STR(string));
+	rep_MUTABLE_STR(string)[len] = 0;
+	coalesce_undo(tx);
+	if(tx->batch_change_count == tx->proper_saved_changed_count)
+	    push_undo_item(tx, Qt);
+	if(len > 0)
+	    push_undo_item(tx, Fcons(start, string));
+	if(!POS_EQUAL_P(start, new_end))
+	    push_undo_item(tx, Fcons(start, new_end));
+    }
+}
+
+/* Start a new segment of the batch of edits open in TX, from the text
+   as it is now. With no memory for the snapshot, edits are just
+   recorded as usual. */
+static void
+start_batch_segment(Lisp_Buffer *tx)
+{
+    tx->batch_text = make_buffer_snapshot(tx);
+    tx->batch_change_count = tx->change_count;
+    tx->batch_first_row = tx->line_count;
+    tx->batch_tail_rows = tx->line_count;
+    tx->batch_bytes = 0;
+    tx->batch_pending = false;
+}
+
+/* Record the current segment of TX's batch, and arrange for the next
+   edit to start another. NEW_LAST and NEW_LAST_LEN are as for
+   record_edit_batch(). */
+static void
+end_batch_segment(Lisp_Buffer *tx, intptr_t new_last, intptr_t new_last_len)
+{
+    Buffer_Snapshot *snap = tx->batch_text;
+    if(tx->batch_first_row < snap->line_count)
+	record_edit_batch(tx, new_last, new_last_len);
+    tx->batch_text = 0;
+    tx->batch_pending = true;
+    release_buffer_snapshot(snap);
+}
+
+/* While a batch of edits is open in TX, note that the rows from
+   START_ROW to END_ROW have changed instead of recording the edit.
+   Rows are counted from the end of the buffer after the change, so
+   they stay valid as lines are inserted and deleted before them.
+   INSERTED is true if the edit is an insertion that has already been
+   made, otherwise it's about to be made.
+
+   A batch is recorded in segments, each covering no more than
+   max-batch-undo-size bytes of the original text, so that edits
+   scattered over a large buffer don't copy most of it into one undo
+   record. When noting an edit would take the current segment over
+   that, the segment is recorded, and the next segment starts from a
+   new snapshot. An insertion already made is in the new snapshot, so
+   it's recorded by itself, as is an edit too big for any segment.
+
+   Returns false if the edit should be recorded as usual. */
+static bool
+batch_edit(Lisp_Buffer *tx, intptr_t start_row, intptr_t end_row,
+	   bool inserted)
+{
+    Buffer_Snapshot *snap = tx->batch_text;
+    intptr_t first, tail, bytes;
+    if(snap == 0)
+    {
+	if(!tx->batch_pending)
+	    return false;
+	start_batch_segment(tx);
+	snap = tx->batch_text;
+	if(snap == 0 || inserted)
+	    return false;
     }
+    first = MIN(tx->batch_first_row, start_row);
+    tail = MIN(tx->batch_tail_rows, tx->line_count - end_row - 1);
+    if(tx->batch_first_row >= snap->line_count)
+    {
+	/* The first edit in the segment. */
+	bytes = snapshot_rows_length(snap, first, snap->line_count - tail);
+	if(bytes > max_batch_undo_size)
+	{
+	    end_batch_segment(tx, 0, 0);
+	    return false;
+	}
+    }
+    else if(first == tx->batch_first_row && tail == tx->batch_tail_rows)
+	return true;
+    else
+    {
+	bytes = (tx->batch_bytes
+		 + snapshot_rows_length(snap, first, tx->batch_first_row)
+		 + snapshot_rows_length(snap,
+					snap->line_count - tx->batch_tail_rows,
+					snap->line_count - tail));
+	if(bytes > max_batch_undo_size)
+	{
+	    /* An insertion outside the segment's rows has already moved
+	       them if it was before them. */
+	    intptr_t added_rows = inserted ? end_row - start_row : 0;
+	    intptr_t new_last = (tx->line_count - added_rows
+				 - tx->batch_tail_rows - 1);
+	    intptr_t now_last = (start_row < tx->batch_first_row
+				 ? new_last + added_rows : new_last);
+	    end_batch_segment(tx, new_last, TX_LINE(tx, now_last).ln_Strlen);
+	    return batch_edit(tx, start_row, end_row, inserted);
+	}
+    }
+    tx->batch_first_row = first;
+    tx->batch_tail_rows = tail;
+    tx->batch_bytes = bytes;
+    return true;
 }
 
 /* This should be called whenever the buffer is saved, and thus set as
@@ -124,43 +302,52 @@ undo_record_unmodified(Lisp_Buffer *tx)
     }
 }
 
-/* Grabs the string between START and END in buffer TX and adds it to
-   the buffer's undo-list.  This has to be done *before* the text is
-   actually deleted from the buffer (for obvious reasons).  */
-void
-undo_record_deletion(Lisp_Buffer *tx, repv start, repv end)
+/* Add the deletion of the text between START and END in TX to its undo
+   list, regardless of batching. */
+static void
+record_deletion(Lisp_Buffer *tx, repv start, repv end)
 {
-    if((tx->car & TXFF_NO_UNDO) == 0 && !POS_EQUAL_P(start, end))
+    repv string;
+    if((pending_deletion_string != 0)
+       && (pending_deletion_tx = tx)
+       && (POS_EQUAL_P(pending_deletion_start, start))
+       && (POS_EQUAL_P(pending_deletion_end, end)))
+    {
+	/* A saved deletion; use it. */
+	string = pending_deletion_string;
+    }
+    else
     {
-	repv string;
-	if((pending_deletion_string != 0)
-	   && (pending_deletion_tx = tx)
-	   && (POS_EQUAL_P(pending_deletion_start, start))
-	   && (POS_EQUAL_P(pending_deletion_end, end)))
+	size_t len = section_length(tx, start, end);
+	if(len == 1)
 	{
-	    /* A saved deletion; use it. */
-	    string = pending_deletion_string;
+	    /* A deletion of 1 character is recorded as a character. */
+	    string = Fget_char(start, rep_VAL(tx));
+	    if(!string || !rep_CHARP(string))
+		return;
 	}
 	else
 	{
-	    size_t len = section_length(tx, start, end);
-	    if(len == 1)
-	    {
-		/* A deletion of 1 character is recorded as a character. */
-		string = Fget_char(start, rep_VAL(tx));
-		if(!string || !rep_CHARP(string))
-		    return;
-	    }
-	    else
-	    {
-		string = rep_allocate_string(len + 1);
-		copy_section(tx, start, end, rep_MUTABLE_STR(string));
-		rep_MUTABLE_STR(string)[len] = 0;
-	    }
+	    string = rep_allocate_string(len + 1);
+	    copy_section(tx, start, end, rep_MUTABLE_STR(string));
+	    rep_MUTABLE_STR(string)[len] = 0;
 	}
-	coalesce_undo(tx);
-	check_first_mod(tx);
-	tx->undo_list = Fcons(Fcons(start, string), tx->undo_list);
+    }
+    coalesce_undo(tx);
+    check_first_mod(tx);
+    push_undo_item(tx, Fcons(start, string));
+}
+
+/* Grabs the string between START and END in buffer TX and adds it to
+   the buffer's undo-list.  This has to be done *before* the text is
+   actually deleted from the buffer (for obvious reasons).  */
+void
+undo_record_deletion(Lisp_Buffer *tx, repv start, repv end)
+{
+    if((tx->car & TXFF_NO_UNDO) == 0 && !POS_EQUAL_P(start, end)
+       && !batch_edit(tx, VROW(start), VROW(end), false))
+    {
+	record_deletion(tx, start, end);
     }
     pending_deletion_string = 0;
 }
@@ -188,30 +375,39 @@ undo_push_deletion(Lisp_Buffer *tx, repv start, repv end)
 	return rep_null_string();
 }
 
+/* Add the insertion between START and END in TX to its undo list,
+   regardless of batching. */
+static void
+record_insertion(Lisp_Buffer *tx, repv start, repv end)
+{
+    repv item;
+    coalesce_undo(tx);
+    check_first_mod(tx);
+    item = tx->undo_list;
+    if(rep_CONSP(item) && rep_CONSP(rep_CAR(item)))
+    {
+	item = rep_CAR(item);
+	if(POSP(rep_CDR(item)) && POS_EQUAL_P(start, rep_CDR(item)))
+	{
+	    /* This insertion is directly after the end of the
+	       previous insertion; extend the previous one to cover
+	       this one.  */
+	    rep_CDR(item) = end;
+	    return;
+	}
+    }
+    push_undo_item(tx, Fcons(start, end));
+}
+
 /* Adds an insertion between START and END to the TX buffer's undo-list.
    Doesn't copy anything, just records START and END.  */
 void
 undo_record_insertion(Lisp_Buffer *tx, repv start, repv end)
 {
-    if((tx->car & TXFF_NO_UNDO) == 0 && !POS_EQUAL_P(start, end))
+    if((tx->car & TXFF_NO_UNDO) == 0 && !POS_EQUAL_P(start, end)
+       && !batch_edit(tx, VROW(start), VROW(end), true))
     {
-	repv item;
-	coalesce_undo(tx);
-	check_first_mod(tx);
-	item = tx->undo_list;
-	if(rep_CONSP(item) && rep_CONSP(rep_CAR(item)))
-	{
-	    item = rep_CAR(item);
-	    if(POSP(rep_CDR(item)) && POS_EQUAL_P(start, rep_CDR(item)))
-	    {
-		/* This insertion is directly after the end of the
-		   previous insertion; extend the previous one to cover
-		   this one.  */
-		rep_CDR(item) = end;
-		return;
-	    }
-	}
-	tx->undo_list = Fcons(Fcons(start, end), tx->undo_list);
+	record_insertion(tx, start, end);
     }
 }
 
@@ -220,11 +416,57 @@ undo_record_insertion(Lisp_Buffer *tx, repv start, repv end)
 void
 undo_record_modification(Lisp_Buffer *tx, repv start, repv end)
 {
-    if((tx->car & TXFF_NO_UNDO) == 0 && !POS_EQUAL_P(start, end))
+    if((tx->car & TXFF_NO_UNDO) == 0 && !POS_EQUAL_P(start, end)
+       && !batch_edit(tx, VROW(start), VROW(end), false))
+    {
+	record_deletion(tx, start, end);
+	record_insertion(tx, start, end);
+    }
+    pending_deletion_string = 0;
+}
+
+/* Edits made while a batch is open aren't recorded one at a time. A
+   snapshot of the text is taken when the outermost batch is opened,
+   the rows that are changed are noted, and when the batch is closed
+   the whole of the changed region is recorded as one deletion and one
+   insertion. Commands making thousands of small changes then cost one
+   undo record, not thousands of strings and conses. A batch whose
+   region grows too large is recorded in segments, see batch_edit().
+
+   Only the undo records are deferred. Marks, extents and the buffer's
+   change count are still updated by each edit as it's made. */
+
+/* Returns false if an error was signalled. */
+bool
+begin_edit_batch(Lisp_Buffer *tx)
+{
+    if(tx->batch_depth == 0 && (tx->car & TXFF_NO_UNDO) == 0)
+    {
+	if(!THAW_LINES(tx))
+	    return false;
+	start_batch_segment(tx);
+    }
+    tx->batch_depth++;
+    return true;
+}
+
+void
+end_edit_batch(Lisp_Buffer *tx)
+{
+    Buffer_Snapshot *snap = tx->batch_text;
+    if(tx->batch_depth == 0 || --tx->batch_depth > 0)
+	return;
+    tx->batch_pending = false;
+    if(snap == 0)
+	return;
+    if(tx->batch_first_row < snap->line_count
+       && (tx->car & TXFF_NO_UNDO) == 0)
     {
-	undo_record_deletion(tx, start, end);
-	undo_record_insertion(tx, start, end);
+	intptr_t new_last = tx->line_count - tx->batch_tail_rows - 1;
+	record_edit_batch(tx, new_last, TX_LINE(tx, new_last).ln_Strlen);
     }
+    tx->batch_text = 0;
+    release_buffer_snapshot(snap);
 }
 
 /* Signal the end of this command. This includes adding a group-separator
@@ -247,7 +489,7 @@ undo_end_of_command(void)
 	if(!rep_NILP(tx->undo_list)
 	   && ((tx->car & TXFF_NO_UNDO) == 0)
 	   && !(rep_CONSP(tx->undo_list) && rep_NILP(rep_CAR(tx->undo_list))))
-	    tx->undo_list = Fcons(Qnil, tx->undo_list);
+	    push_undo_item(tx, Qnil);
 	tx = tx->next;
     }
 }
@@ -295,7 +537,7 @@ taken from the prefix argument.
 	    if(--count <= 0)
 		break;
 	}
-	else if(rep_CONSP(item) && rep_CONSP(rep_CAR(item)))
+	else if(rep_CONSP(item) && POSP(rep_CAR(item)))
 	{
 	    if(rep_STRINGP(rep_CDR(item)))
 	    {
@@ -304,22 +546,23 @@ taken from the prefix argument.
 		if(new && !rep_NILP(new))
 		    Fgoto(new);
 	    }
+	    else if(POSP(rep_CDR(item)))
+	    {
+		/* An insertion */
+		Fdelete_area(rep_CAR(item), rep_CDR(item), tx);
+		Fgoto(rep_CAR(item));
+	    }
 	    else if(rep_CHARP(rep_CDR(item)))
 	    {
-		/* A deleted character */
+		/* A deleted character. It can't be taken for a
+		   position, see POSP */
 		repv tmp = Finsert(rep_CDR(item), rep_CAR(item), tx);
 		if(tmp && !rep_NILP(tmp))
 		    Fgoto(tmp);
 	    }
-	    else if(rep_CONSP(rep_CDR(item)))
-	    {
-		/* An insertion */
-		Fdelete_area(rep_CAR(item), rep_CDR(item), tx);
-		Fgoto(rep_CAR(item));
-	    }
-	    else if(POSP(item))
-		Fgoto(item);
 	}
+	else if(POSP(item))
+	    Fgoto(item);
 	else if(item == Qt)
 	{
 	    /* clear modification flag. */
@@ -345,6 +588,18 @@ undo information.
     return rep_handle_var_int (val, &max_undo_size);
 }
 
+DEFUN("max-batch-undo-size", Fmax_batch_undo_size, Smax_batch_undo_size, (repv val), rep_Subr1) /*
+::doc:max-batch-undo-size::
+max-batch-undo-size [NEW-VALUE]
+
+The maximum number of bytes of the original text that a single change
+recorded by `begin-batched-edits' may cover. Larger batches of edits are
+recorded as several changes.
+::end:: */
+{
+    return rep_handle_var_int (val, &max_batch_undo_size);
+}
+
 DEFUN("buffer-record-undo", Fbuffer_record_undo, Sbuffer_record_undo, (void), rep_Subr0) /*
 ::doc:buffer-record-undo::
 buffer-record-undo
@@ -392,13 +647,16 @@ This buffer's list of undo information.
   rep_DECLARE1(val, rep_LISTP);
   Lisp_Buffer *tx = curr_vw->tx;
   tx->undo_list = val;
+  tx->undo_bytes = undo_list_size(val);
   return val;
 }
 
 /* Called by gc, this makes each undo-lists use less memory than
    max-undo-size. But it always leaves upto the first boundary
    intact.  Doesn't handle the case when the undo list is split
-   into three bits while in the middle of a sequence of undo's.  */
+   into three bits while in the middle of a sequence of undo's. Each
+   buffer's undo_bytes is counted again afterwards, between collections
+   it's only ever added to.  */
 void
 undo_trim(void)
 {
@@ -421,14 +679,9 @@ undo_trim(void)
 	while(rep_CONSP(*undo_list))
 	{
 	    repv item = rep_CAR(*undo_list);
-	    size_count += sizeof(rep_cons);
+	    size_count += undo_item_size(item);
 	    if(rep_CONSP(item))
 	    {
-		size_count += sizeof(rep_cons);
-		if(rep_CONSP(rep_CDR(item)))
-		    size_count += sizeof(rep_cons) * 2;
-		else if(rep_STRINGP(rep_CDR(item)))
-		    size_count += rep_STRING_LEN(rep_CDR(item));
 		if(size_count > (size_t) max_undo_size)
 		{
 		    /* Truncate the list at the end of this group. */
@@ -440,10 +693,48 @@ undo_trim(void)
 	    }
 	    undo_list = &rep_CDR(*undo_list);
 	}
+	tx->undo_bytes = undo_list_size(tx->undo_list);
 	tx = tx->next;
     }
 }
 
+DEFUN("begin-batched-edits", Fbegin_batched_edits, Sbegin_batched_edits,
+      (repv tx), rep_Subr1) /*
+::doc:begin-batched-edits::
+begin-batched-edits [BUFFER]
+
+Start recording the changes made to BUFFER as a single undoable change,
+until the matching call to `end-batched-edits'. Calls may be nested. It's
+usually easier to use the `with-batched-edits' macro.
+
+When the original text of the changed region would be longer than
+`max-batch-undo-size' bytes, the changes so far are recorded as one
+change and the rest start another.
+::end:: */
+{
+    if(!BUFFERP(tx))
+	tx = rep_VAL(curr_vw->tx);
+    if(!begin_edit_batch(VBUFFER(tx)))
+	return 0;
+    return tx;
+}
+
+DEFUN("end-batched-edits", Fend_batched_edits, Send_batched_edits,
+      (repv tx), rep_Subr1) /*
+::doc:end-batched-edits::
+end-batched-edits [BUFFER]
+
+Finish the batch of changes to BUFFER started by the last call to
+`begin-batched-edits'. When the outermost batch ends everything it changed
+is added to the undo list as one change.
+::end:: */
+{
+    if(!BUFFERP(tx))
+	tx = rep_VAL(curr_vw->tx);
+    end_edit_batch(VBUFFER(tx));
+    return tx;
+}
+
 void
 undo_init(void)
 {
@@ -453,8 +744,11 @@ undo_init(void)
     rep_INTERN(undo);
     rep_ADD_SUBR_INT(Sundo);
     rep_ADD_SUBR(Smax_undo_size);
+    rep_ADD_SUBR(Smax_batch_undo_size);
     rep_ADD_SUBR(Sset_buffer_record_undo);
     rep_ADD_SUBR(Sbuffer_record_undo);
     rep_ADD_SUBR(Sbuffer_undo_list);
     rep_ADD_SUBR(Sset_buffer_undo_list);
+    rep_ADD_SUBR(Sbegin_batched_edits);
+    rep_ADD_SUBR(Send_batched_edits);
 }
@@ -150,6 +150,10 @@ make_view(Lisp_View *sibling, Lisp_Window *parent, Lisp_Buffer *tx,
 	}
     }
 
+    /* The text it shows can't stay compressed */
+    if(!minibuf_p && tx != 0 && !THAW_LINES(tx))
+	return NULL;
+
     /* Now the construction of the view proper... */
     vw = rep_alloc(sizeof(Lisp_View));
     if(vw != NULL)
@@ -1153,6 +1157,7 @@ view_mark (repv val)
 	rep_MARKVAL(VVIEW(val)->display_origin);
 	rep_MARKVAL(VVIEW(val)->block_start);
 	rep_MARKVAL(VVIEW(val)->block_end);
+	mark_extent_cache(VVIEW(val));
 	val = rep_VAL(VVIEW(val)->next_view);
 	if (val != 0)
 	    rep_GC_SET_CELL (val);